@@ -0,0 +1,119 @@
+#pragma once
+
+// The Bayesian error on an efficiency num/den that TGraphAsymmErrors::BayesDivide gives, worked out
+// straight from the quantiles of the beta posterior: a flat Beta(1,1) prior, the posterior mode as the
+// central value, and the shortest interval holding 68.3% of the posterior. Weighted numbers are
+// handled as BayesDivide does, by scaling them to the effective number of entries (den^2/err^2).
+//
+// Unlike BayesDivide there are no histograms or graphs behind it, so it allocates nothing, and is
+// safe to call from many threads at once.
+
+#include "Math/QuantFuncMathCore.h"
+
+#include <cmath>
+#include <cstddef>
+
+struct bayes_interval {
+	double low; // Distance from the mode down to the bottom of the interval
+	double high; // ... and up to the top
+};
+
+// The posterior mode of Beta(a, b), as TEfficiency::BetaMode.
+inline double beta_mode(double a, double b)
+{
+	if (a <= 1.0 || b <= 1.0) {
+		return a < b ? 0.0 : a > b ? 1.0 : 0.5;
+	}
+	return (a - 1.0) / (a + b - 2.0);
+}
+
+// The shortest interval holding a fraction cl of Beta(a, b), as TEfficiency::BetaShortestInterval.
+// The interval is [q(p), q(p + cl)] for the quantile function q; its length is minimized over p
+// with a golden section search (the length is unimodal in p).
+inline void beta_shortest_interval(double cl, double a, double b, double &low, double &high)
+{
+	double mode = beta_mode(a, b);
+	if (mode == 0.0) {
+		low = 0.0;
+		high = ROOT::Math::beta_quantile(cl, a, b);
+		return;
+	}
+	if (mode == 1.0) {
+		low = ROOT::Math::beta_quantile_c(cl, a, b);
+		high = 1.0;
+		return;
+	}
+	if (a == b && a <= 1.0) {
+		// Flat, so there is no shortest interval. Use the central one.
+		low = ROOT::Math::beta_quantile((1.0 - cl) / 2.0, a, b);
+		high = ROOT::Math::beta_quantile((1.0 + cl) / 2.0, a, b);
+		return;
+	}
+
+	auto length = [&](double p) { return ROOT::Math::beta_quantile(p + cl, a, b) - ROOT::Math::beta_quantile(p, a, b); };
+	const double inv_phi = 0.5 * (std::sqrt(5.0) - 1.0);
+	double p_lo = 0.0, p_hi = 1.0 - cl;
+	double p1 = p_hi - inv_phi * (p_hi - p_lo);
+	double p2 = p_lo + inv_phi * (p_hi - p_lo);
+	double l1 = length(p1), l2 = length(p2);
+	while (p_hi - p_lo > 1e-12) {
+		if (l1 < l2) {
+			p_hi = p2;
+			p2 = p1;
+			l2 = l1;
+			p1 = p_hi - inv_phi * (p_hi - p_lo);
+			l1 = length(p1);
+		}
+		else {
+			p_lo = p1;
+			p1 = p2;
+			l1 = l2;
+			p2 = p_lo + inv_phi * (p_hi - p_lo);
+			l2 = length(p2);
+		}
+	}
+	double p = 0.5 * (p_lo + p_hi);
+	low = ROOT::Math::beta_quantile(p, a, b);
+	high = ROOT::Math::beta_quantile(p + cl, a, b);
+}
+
+// The error on num/den, given each with its error squared. Where BayesDivide would refuse to divide
+// (nothing in total, or more passing than in total), it leaves no point behind and its errors read
+// back as -1; so do we.
+inline bayes_interval bayes_efficiency_interval(double num, double num_err2, double den, double den_err2, double cl = 0.683)
+{
+	// BayesDivide only uses the weights if the errors are not just the Poisson ones.
+	bool weighted = std::fabs(num - num_err2) > 1e-6 || std::fabs(den - den_err2) > 1e-6;
+
+	double a, b;
+	if (weighted) {
+		if (den <= 0.0 || den_err2 <= 0.0 || num > den) {
+			return bayes_interval{ -1.0, -1.0 };
+		}
+		double norm = den / den_err2;
+		a = num * norm + 1.0;
+		b = (den - num) * norm + 1.0;
+	}
+	else {
+		double t = std::floor(den + 0.5);
+		double p = std::floor(num + 0.5);
+		if (t <= 0.0 || p > t) {
+			return bayes_interval{ -1.0, -1.0 };
+		}
+		a = p + 1.0;
+		b = t - p + 1.0;
+	}
+
+	double mode = beta_mode(a, b);
+	double low, high;
+	beta_shortest_interval(cl, a, b, low, high);
+	return bayes_interval{ mode - low, high - mode };
+}
+
+// The same for n efficiencies at once (e.g. every region at a lifetime).
+inline void bayes_efficiency_intervals(size_t n, const double *num, const double *num_err2, const double *den, const double *den_err2, bayes_interval *result)
+{
+	for (size_t i = 0; i < n; i++) {
+		result[i] = bayes_efficiency_interval(num[i], num_err2[i], den[i], den_err2[i]);
+	}
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// log Gamma(x) for x > 0. std::lgamma sets the global signgam, so isn't safe to use from several
+// threads; this is the Stirling series, after stepping x up to where it is exact to double precision.
+
+#include <cmath>
+
+inline double log_gamma(double x)
+{
+	double shift = 0.0;
+	while (x < 10.0) {
+		shift += std::log(x);
+		x += 1.0;
+	}
+	double x2 = 1.0 / (x * x);
+	double series = (1.0 / 12.0 - x2 * (1.0 / 360.0 - x2 * (1.0 / 1260.0 - x2 / 1680.0))) / x;
+	return (x - 0.5) * std::log(x) - x + 0.91893853320467274 + series - shift; // 0.5 log(2 pi)
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// Derive independent, reproducible random number seeds for numbered streams.
+// Each unit of work (a lifetime point, for example) gets its own stream, so the
+// random numbers it sees do not depend on how the work was spread over threads or jobs.
+
+// The splitmix64 finalizer: a cheap way to turn nearby integers into well separated seeds.
+inline unsigned long long splitmix64(unsigned long long x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Seed for stream number stream, given the run's base seed. Never returns 0,
+// as ROOT's TRandom3 treats a 0 seed as "seed from the clock".
+inline unsigned int stream_seed(unsigned long long base_seed, unsigned long long stream)
+{
+	auto s = static_cast<unsigned int>(splitmix64(splitmix64(base_seed) ^ stream) >> 32);
+	return s == 0 ? 1u : s;
+}
@@ -46,6 +46,8 @@ public:
 	// give it the upper adn lower boundaries of the last and first bin!
 	int nbin() const { return _v.size() - 1; }
 	double *bin_list() const { return (double*)&(_v[0]); }
+	// The bin edges, lowest to highest.
+	const std::vector<double> &edges() const { return _v; }
 
 private:
 	std::vector<double> _v;
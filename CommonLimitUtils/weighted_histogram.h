@@ -0,0 +1,199 @@
+#pragma once
+
+// A weighted 1D or 2D histogram that keeps just the sum of weights and the sum of the squared
+// weights in each bin, with no ROOT objects behind it. It is cheap to make, nothing is registered
+// anywhere, and each thread can fill its own and add them together at the end. Bin numbering is
+// ROOT's (global bins, with under and overflow), and the divides give what TH1::Divide gives, so
+// it converts to a TH1/TH2 with the same contents when it is time to write it out. The binning is
+// given as plain bin edges, so the header doesn't need ROOT (only as_root does, where it is used).
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <cmath>
+
+template<int N_DIM>
+class weighted_histogram
+{
+	static_assert(N_DIM == 1 || N_DIM == 2, "weighted_histogram is only 1D or 2D");
+
+public:
+	// An empty histogram with no bins, for when one is only sometimes needed. Assign a real one
+	// before filling or adding to it.
+	weighted_histogram()
+		: _nx(0), _ny(0), _entries(0.0)
+	{
+	}
+
+	// A 1D histogram, from its bin edges (lowest to highest, one more than the number of bins).
+	explicit weighted_histogram(const std::vector<double> &x_edges)
+		: _x_edges(x_edges), _nx(n_bins(x_edges)), _ny(0), _entries(0.0)
+	{
+		if (N_DIM != 1) {
+			throw std::runtime_error("A 2D weighted histogram needs a binning for both axes");
+		}
+		_sumw.assign(_nx + 2, 0.0);
+		_sumw2.assign(_nx + 2, 0.0);
+	}
+
+	// A 2D histogram.
+	weighted_histogram(const std::vector<double> &x_edges, const std::vector<double> &y_edges)
+		: _x_edges(x_edges), _y_edges(y_edges), _nx(n_bins(x_edges)), _ny(n_bins(y_edges)), _entries(0.0)
+	{
+		if (N_DIM != 2) {
+			throw std::runtime_error("A 1D weighted histogram has only one axis");
+		}
+		_sumw.assign((_nx + 2) * (_ny + 2), 0.0);
+		_sumw2.assign((_nx + 2) * (_ny + 2), 0.0);
+	}
+
+	// Global bin numbers, as TH1::FindBin returns them.
+	int find_bin(double x) const { return axis_bin(_x_edges, x); }
+	int find_bin(double x, double y) const { return axis_bin(_x_edges, x) + (_nx + 2) * axis_bin(_y_edges, y); }
+
+	// Number of global bins, including under and overflow.
+	int n_cells() const { return static_cast<int>(_sumw.size()); }
+
+	// Fill a bin with a single weight, or with a sum of weights and the sum of their squares.
+	void fill(int bin, double weight)
+	{
+		_sumw[bin] += weight;
+		_sumw2[bin] += weight * weight;
+	}
+	void fill(int bin, double sumw, double sumw2)
+	{
+		_sumw[bin] += sumw;
+		_sumw2[bin] += sumw2;
+	}
+
+	double content(int bin) const { return _sumw[bin]; }
+	double sumw2(int bin) const { return _sumw2[bin]; }
+	double error(int bin) const { return std::sqrt(_sumw2[bin]); }
+
+	// Number of fills. Only used to set the entries of the ROOT histogram.
+	double entries() const { return _entries; }
+	void set_entries(double n) { _entries = n; }
+
+	// Add another histogram with the same binning (e.g. one filled on another thread).
+	weighted_histogram &operator+=(const weighted_histogram &other)
+	{
+		check_binning(other);
+		for (size_t i = 0; i < _sumw.size(); i++) {
+			_sumw[i] += other._sumw[i];
+			_sumw2[i] += other._sumw2[i];
+		}
+		_entries += other._entries;
+		return *this;
+	}
+
+	// Divide, bin by bin, by another histogram with uncorrelated errors. Same as TH1::Divide(h).
+	void divide(const weighted_histogram &other)
+	{
+		check_binning(other);
+		for (size_t i = 0; i < _sumw.size(); i++) {
+			double c0 = _sumw[i];
+			double c1 = other._sumw[i];
+			if (c1 == 0.0) {
+				_sumw[i] = 0.0;
+				_sumw2[i] = 0.0;
+				continue;
+			}
+			double c1sq = c1 * c1;
+			_sumw[i] = c0 / c1;
+			_sumw2[i] = (_sumw2[i] * c1sq + other._sumw2[i] * c0 * c0) / (c1sq * c1sq);
+		}
+	}
+
+	// The efficiency num/den, where num was selected from den, with binomial errors that hold for
+	// weighted fills. Same as TH1::Divide(num, den, 1.0, 1.0, "B").
+	static weighted_histogram divide_binomial(const weighted_histogram &num, const weighted_histogram &den)
+	{
+		num.check_binning(den);
+		weighted_histogram r(num);
+		for (size_t i = 0; i < r._sumw.size(); i++) {
+			double b1 = num._sumw[i];
+			double b2 = den._sumw[i];
+			if (b2 == 0.0) {
+				r._sumw[i] = 0.0;
+				r._sumw2[i] = 0.0;
+				continue;
+			}
+			r._sumw[i] = b1 / b2;
+			if (b1 != b2) {
+				double b2sq = b2 * b2;
+				r._sumw2[i] = std::fabs(((1.0 - 2.0 * b1 / b2) * num._sumw2[i] + b1 * b1 * den._sumw2[i] / b2sq) / b2sq);
+			}
+			else {
+				r._sumw2[i] = 0.0;
+			}
+		}
+		return r;
+	}
+
+	// Copy into a ROOT histogram (TH1F, TH2F, etc.) of the matching dimension. Only needed when writing out.
+	template<class H>
+	std::unique_ptr<H> as_root(const std::string &name, const std::string &title) const
+	{
+		auto h = make_root<H>(name, title, std::integral_constant<int, N_DIM>());
+		h->Sumw2();
+		for (size_t i = 0; i < _sumw.size(); i++) {
+			h->SetBinContent(static_cast<int>(i), _sumw[i]);
+			h->GetSumw2()->fArray[i] = _sumw2[i];
+		}
+		h->SetEntries(_entries);
+		return h;
+	}
+
+private:
+	std::vector<double> _x_edges;
+	std::vector<double> _y_edges;
+	int _nx;
+	int _ny;
+	double _entries;
+	std::vector<double> _sumw;
+	std::vector<double> _sumw2;
+
+	static int n_bins(const std::vector<double> &e)
+	{
+		if (e.size() < 2) {
+			throw std::runtime_error("A weighted histogram axis needs at least two bin edges");
+		}
+		return static_cast<int>(e.size()) - 1;
+	}
+
+	// The bin TAxis::FindBin would return.
+	static int axis_bin(const std::vector<double> &e, double x)
+	{
+		if (x < e.front()) {
+			return 0;
+		}
+		if (!(x < e.back())) {
+			return static_cast<int>(e.size());
+		}
+		return static_cast<int>(std::upper_bound(e.begin(), e.end(), x) - e.begin());
+	}
+
+	void check_binning(const weighted_histogram &other) const
+	{
+		if (_x_edges != other._x_edges || _y_edges != other._y_edges) {
+			throw std::runtime_error("Weighted histograms with different binning can't be combined");
+		}
+	}
+
+	template<class H>
+	std::unique_ptr<H> make_root(const std::string &name, const std::string &title, std::integral_constant<int, 1>) const
+	{
+		return std::unique_ptr<H>(new H(name.c_str(), title.c_str(), _nx, &_x_edges[0]));
+	}
+	template<class H>
+	std::unique_ptr<H> make_root(const std::string &name, const std::string &title, std::integral_constant<int, 2>) const
+	{
+		return std::unique_ptr<H>(new H(name.c_str(), title.c_str(), _nx, &_x_edges[0], _ny, &_y_edges[0]));
+	}
+};
+
+typedef weighted_histogram<1> weighted_histogram_1D;
+typedef weighted_histogram<2> weighted_histogram_2D;
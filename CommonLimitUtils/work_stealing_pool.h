@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Run a fixed set of independent tasks over several threads.
+// Tasks are dealt out round-robin to per-thread queues. A thread works through its own queue
+// from the front, and when it runs dry it steals from the back of the other queues. This keeps
+// all threads busy even when the tasks take very different amounts of time (as lifetime points do).
+class work_stealing_pool {
+public:
+	explicit work_stealing_pool(unsigned int n_threads)
+		: _n_threads(n_threads == 0 ? 1 : n_threads)
+	{}
+
+	unsigned int n_threads() const { return _n_threads; }
+
+	// Call f(task, worker) for every task in [0, n_tasks). worker is in [0, n_threads()) and
+	// can be used to index per-thread resources. Blocks until all tasks are done. If a task throws
+	// no new tasks are started, and the first exception is re-thrown here.
+	template<class Func>
+	void run(size_t n_tasks, Func f) const
+	{
+		if (_n_threads == 1 || n_tasks <= 1) {
+			for (size_t i = 0; i < n_tasks; i++) {
+				f(i, 0u);
+			}
+			return;
+		}
+
+		std::vector<std::unique_ptr<task_queue>> queues;
+		for (unsigned int i = 0; i < _n_threads; i++) {
+			queues.push_back(std::unique_ptr<task_queue>(new task_queue()));
+		}
+		for (size_t i = 0; i < n_tasks; i++) {
+			queues[i % _n_threads]->tasks.push_back(i);
+		}
+
+		std::mutex error_lock;
+		std::exception_ptr error;
+		auto worker = [&queues, &error_lock, &error, &f](unsigned int me) {
+			size_t task;
+			while (next_task(queues, me, task)) {
+				{
+					std::lock_guard<std::mutex> l(error_lock);
+					if (error) {
+						return;
+					}
+				}
+				try {
+					f(task, me);
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> l(error_lock);
+					if (!error) {
+						error = std::current_exception();
+					}
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (unsigned int i = 1; i < _n_threads; i++) {
+			threads.push_back(std::thread(worker, i));
+		}
+		worker(0);
+		for (auto &t : threads) {
+			t.join();
+		}
+
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+private:
+	unsigned int _n_threads;
+
+	struct task_queue {
+		std::mutex lock;
+		std::deque<size_t> tasks;
+	};
+
+	// Grab the next task: our own queue first, then steal from the others.
+	static bool next_task(std::vector<std::unique_ptr<task_queue>> &queues, unsigned int me, size_t &task)
+	{
+		{
+			auto &q = *queues[me];
+			std::lock_guard<std::mutex> l(q.lock);
+			if (!q.tasks.empty()) {
+				task = q.tasks.front();
+				q.tasks.pop_front();
+				return true;
+			}
+		}
+		for (size_t i = 1; i < queues.size(); i++) {
+			auto &q = *queues[(me + i) % queues.size()];
+			std::lock_guard<std::mutex> l(q.lock);
+			if (!q.tasks.empty()) {
+				task = q.tasks.back();
+				q.tasks.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+};
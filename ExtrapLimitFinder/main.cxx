@@ -156,9 +156,11 @@ config parse_command_line(int argc, char **argv)
 
 		// How is the limit set?
 		Flag("UseAsym", "a", "Do asymtotic fit rather than using toys (toys are slow!)"),
+		Flag("Native", "N", "Calculate the limit (toys or asymptotic) with the built in ABCD likelihood rather than RooFit (much faster)"),
 		Flag("ExtrapAtEachLifetime", "l", "Refit limit at each lifetime point to take into account differing efficiencies at A, B, C and D"),
 		Arg("RescaleSignal", "r", "Rescale the expected signal in region A to this number during limit setting", Is::Optional),
 		Arg("NToys", "n", "Number of toys to use when using toy method. Defaults to 5000.", Is::Optional),
+		Arg("Workers", "w", "Number of processes to spread the limits over with -l. Defaults to 1.", Is::Optional),
 
 		// General
 		Flag("Unofficial", "u", "Turn off some protection checks so it can run even thought input isn't 'just right'"),
@@ -180,6 +182,7 @@ config parse_command_line(int argc, char **argv)
 	result.observed_data.D = args.GetAsFloat("nD");
 
 	result.limit_settings.useToys = !args.IsSet("UseAsym");
+	result.limit_settings.nativeLikelihood = args.IsSet("Native");
 	result.limit_settings.scaleLimitByEfficiency = !args.IsSet("ExtrapAtEachLifetime");
 
 
@@ -198,6 +201,12 @@ config parse_command_line(int argc, char **argv)
 	result.limit_settings.luminosity = args.IsSet("Luminosity")
 		? args.GetAsFloat("Luminosity")
 		: 3.2;
+	result.limit_settings.nWorkers = args.IsSet("Workers")
+		? args.GetAsInt("Workers")
+		: 1;
+	if (result.limit_settings.nWorkers < 1) {
+		throw runtime_error("The number of workers must be at least 1");
+	}
 
 	// Systematic Errors
 	result.limit_settings.systematic_errors["lumi"] = 0.021; // Final lumi is 2.1%
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "muon_tree_processor.h"
+#include "lxy_lookup_table.h"
 
 #include "TH2D.h"
 
@@ -17,12 +18,26 @@ public:
 	inline virtual ~Lxy_weight_calculator() {};
 
 	// Region can be 0 == A, 1 == B, 2 == C, 3 == D
-	virtual double operator() (int region, double lxy1, double lxy2) const = 0;
+	double operator() (int region, double lxy1, double lxy2) const {
+		return _table(region, lxy1, lxy2);
+	}
+
+	// The weights for all four regions at once (A, B, C, D).
+	void operator() (double lxy1, double lxy2, double weights[4]) const {
+		_table(lxy1, lxy2, weights);
+	}
 
 	// Return a copy, and the caller will own it
 	virtual std::unique_ptr<TH1> clone_weight(int region) const = 0;
 
-private:
+	// The table behind the lookups
+	const lxy_lookup_table &table() const { return _table; }
+
+protected:
+	Lxy_weight_calculator(bool bilinear);
+
+	// All lookups go through this, the histograms are kept only to be written out.
+	lxy_lookup_table _table;
 };
 
 
@@ -30,12 +45,9 @@ class Lxy_weight_calculator1D : public Lxy_weight_calculator
 {
 public:
 	// Look up and calculate the weight table
-	Lxy_weight_calculator1D(const muon_tree_processor &reader);
+	Lxy_weight_calculator1D(const muon_tree_processor &reader, bool bilinear = false);
 	~Lxy_weight_calculator1D();
 
-	// Region can be 0 == A, 1 == B, 2 == C, 3 == D
-	double operator() (int region, double lxy1, double lxy2) const;
-
 	// Return a copy, and the caller will own it
 	std::unique_ptr<TH1> clone_weight(int region) const {
 		if (region < 0 || region > 3) {
@@ -54,12 +66,16 @@ private:
 class Lxy_weight_calculator2D : public Lxy_weight_calculator
 {
 public:
-	// Look up and calculate the weight table
-	Lxy_weight_calculator2D(const muon_tree_processor &reader);
+	// Look up and calculate the weight table. With bilinear the efficiency is interpolated between
+	// bins, otherwise the passed histograms are smoothed and the efficiency is taken from the bin.
+	Lxy_weight_calculator2D(const muon_tree_processor &reader, bool bilinear = false);
 	~Lxy_weight_calculator2D();
 
-	// Region can be 0 == A, 1 == B, 2 == C, 3 == D
-	double operator() (int region, double lxy1, double lxy2) const;
+	// Or, to share a pass over the events with other work: create it empty, call fill for
+	// each preselected event, and then finish before doing any lookups.
+	explicit Lxy_weight_calculator2D(bool bilinear);
+	void fill(const muon_tree_processor::eventInfo &entry);
+	void finish();
 
 	// Return a copy, and the caller will own it
 	std::unique_ptr<TH1> clone_weight(int region) const {
@@ -72,6 +88,11 @@ public:
 	}
 
 private:
+	bool _bilinear;
 	std::unique_ptr<TH2D> _pass_weight[4];
+
+	// Events where they were generated and where they passed the analysis selection, while filling.
+	std::unique_ptr<TH2D> _generated;
+	std::unique_ptr<TH2D> _passed[4];
 };
 
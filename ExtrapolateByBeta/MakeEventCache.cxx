@@ -0,0 +1,31 @@
+// Convert a slimmed extrapTree file into an event cache, which ExtrapolateByBeta can then
+// read (with -k) without going through ROOT.
+#include "muon_tree_processor.h"
+
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		cout << "Usage: MakeEventCache <extrapTree ROOT file> <cache file>" << endl;
+		return 1;
+	}
+
+	try {
+		string source(argv[1]);
+		string cache(argv[2]);
+		muon_tree_processor reader(source);
+		reader.write_cache(cache, source);
+		cout << "Wrote " << reader.n_events() << " events from " << source << " to " << cache << endl;
+	}
+	catch (exception &e)
+	{
+		cout << "Failed!!" << endl;
+		cout << " --> " << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,230 @@
+// Combine the output files of an ExtrapolateByBeta run that was split into lifetime shards
+// (with -j i/N) into a single file, laid out just as an unsharded run would have written it.
+//
+// Each shard must be there exactly once, every lifetime bin must have been done by exactly one
+// shard, and the shards must agree on the binning, on everything about the generated lifetime, and
+// on the setup of the run (seed, toys and options).
+#include <TFile.h>
+#include <TH1F.h>
+#include <TH1D.h>
+#include <TGraphAsymmErrors.h>
+#include <TKey.h>
+#include <TCollection.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+	// Things in each shard we have to be careful with, and that are not just copied over.
+	const char *region_names = "ABCD";
+	const vector<string> generated_info = { "generated_ctau", "n_toys_used_as_generated", "n_passed_as_generated", "n_as_generated", "eff_as_generated" };
+
+	// One shard file, and what it says about itself.
+	struct shard_file {
+		string name;
+		unique_ptr<TFile> file;
+		int index;
+		int n_shards;
+	};
+
+	template<class T>
+	T *get(const shard_file &shard, const string &name)
+	{
+		auto o = dynamic_cast<T*>(shard.file->Get(name.c_str()));
+		if (o == nullptr) {
+			throw runtime_error("Unable to find " + name + " in " + shard.name + " - is it the output of ExtrapolateByBeta with -j?");
+		}
+		return o;
+	}
+
+	// True if two histograms have the same binning and the same contents, bin for bin.
+	bool same_histo(const TH1 *h1, const TH1 *h2)
+	{
+		if (h1->GetNbinsX() != h2->GetNbinsX()) {
+			return false;
+		}
+		for (int i = 0; i <= h1->GetNbinsX() + 1; i++) {
+			if (h1->GetXaxis()->GetBinLowEdge(i) != h2->GetXaxis()->GetBinLowEdge(i)
+				|| h1->GetBinContent(i) != h2->GetBinContent(i)
+				|| h1->GetBinError(i) != h2->GetBinError(i)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool same_binning(const TH1 *h1, const TH1 *h2)
+	{
+		if (h1->GetNbinsX() != h2->GetNbinsX()) {
+			return false;
+		}
+		for (int i = 1; i <= h1->GetNbinsX() + 1; i++) {
+			if (h1->GetXaxis()->GetBinLowEdge(i) != h2->GetXaxis()->GetBinLowEdge(i)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool is_merged(const string &name)
+	{
+		for (int i_region = 0; i_region < 4; i_region++) {
+			if (name == string("h_res_eff_") + region_names[i_region] || name == string("g_res_eff_") + region_names[i_region]) {
+				return true;
+			}
+		}
+		return name == "n_toys_used" || name == "tau_shard" || name == "shard_setup" || name == "tau_bins_done" || name.find("h_ctau_ratio_") == 0;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		cout << "Usage: MergeExtrapolation <output file> <shard file> [<shard file> ...]" << endl;
+		return 1;
+	}
+
+	try {
+		// Open the shards, and put them in order.
+		vector<shard_file> shards;
+		for (int i = 2; i < argc; i++) {
+			shard_file s;
+			s.name = argv[i];
+			s.file = unique_ptr<TFile>(TFile::Open(s.name.c_str(), "READ"));
+			if (!s.file || !s.file->IsOpen()) {
+				throw runtime_error("Unable to open shard file " + s.name);
+			}
+			auto info = get<TH1D>(s, "tau_shard");
+			s.index = (int)info->GetBinContent(1);
+			s.n_shards = (int)info->GetBinContent(2);
+			shards.push_back(move(s));
+		}
+
+		int n_shards = shards[0].n_shards;
+		if (n_shards != (int)shards.size()) {
+			ostringstream msg;
+			msg << "The shards were made as " << n_shards << " shards, but " << shards.size() << " shard files were given";
+			throw runtime_error(msg.str());
+		}
+		vector<shard_file*> by_index(n_shards, nullptr);
+		for (auto &s : shards) {
+			if (s.n_shards != n_shards) {
+				throw runtime_error("Shard file " + s.name + " is from a run split into a different number of shards");
+			}
+			if (s.index < 0 || s.index >= n_shards || by_index[s.index] != nullptr) {
+				ostringstream msg;
+				msg << "Shard " << s.index << " is given more than once (or isn't a valid shard): " << s.name;
+				throw runtime_error(msg.str());
+			}
+			by_index[s.index] = &s;
+		}
+
+		// All the shards must be from the same sample and setup.
+		const auto &first = *by_index[0];
+		for (auto s : by_index) {
+			if (!same_histo(get<TH1>(first, "shard_setup"), get<TH1>(*s, "shard_setup"))) {
+				throw runtime_error(s->name + " was run with a different seed, number of toys or options than " + first.name);
+			}
+			for (const auto &name : generated_info) {
+				if (!same_histo(get<TH1>(first, name), get<TH1>(*s, name))) {
+					throw runtime_error(name + " in " + s->name + " does not match " + first.name + " - are these shards from the same run?");
+				}
+			}
+			for (int i_region = 0; i_region < 4; i_region++) {
+				auto name = string("h_res_eff_") + region_names[i_region];
+				if (!same_binning(get<TH1>(first, name), get<TH1>(*s, name))) {
+					throw runtime_error("The lifetime binning in " + s->name + " does not match " + first.name);
+				}
+			}
+		}
+
+		// Which shard did each lifetime bin.
+		auto nbin = get<TH1>(first, "tau_bins_done")->GetNbinsX();
+		vector<shard_file*> owner(nbin, nullptr);
+		for (auto s : by_index) {
+			auto done = get<TH1>(*s, "tau_bins_done");
+			for (int i_tau = 0; i_tau < nbin; i_tau++) {
+				if (done->GetBinContent(i_tau + 1) != 0.0) {
+					if (owner[i_tau] != nullptr) {
+						ostringstream msg;
+						msg << "Lifetime bin " << i_tau << " was done by both " << owner[i_tau]->name << " and " << s->name;
+						throw runtime_error(msg.str());
+					}
+					owner[i_tau] = s;
+				}
+			}
+		}
+		for (int i_tau = 0; i_tau < nbin; i_tau++) {
+			if (owner[i_tau] == nullptr) {
+				ostringstream msg;
+				msg << "Lifetime bin " << i_tau << " was not done by any shard";
+				throw runtime_error(msg.str());
+			}
+		}
+
+		// Now build the output, with each bin from the shard that did it.
+		auto output_file = unique_ptr<TFile>(TFile::Open(argv[1], "RECREATE"));
+		if (!output_file || !output_file->IsOpen()) {
+			throw runtime_error(string("Unable to create the output file ") + argv[1]);
+		}
+		output_file->cd();
+
+		for (int i_region = 0; i_region < 4; i_region++) {
+			auto h_name = string("h_res_eff_") + region_names[i_region];
+			auto g_name = string("g_res_eff_") + region_names[i_region];
+
+			auto h_res_eff = (TH1F*)get<TH1F>(first, h_name)->Clone(h_name.c_str());
+			auto g_res_eff = new TGraphAsymmErrors(nbin);
+			g_res_eff->SetName(g_name.c_str());
+			g_res_eff->SetTitle(get<TGraphAsymmErrors>(first, g_name)->GetTitle());
+			for (int i_tau = 0; i_tau < nbin; i_tau++) {
+				auto h = get<TH1F>(*owner[i_tau], h_name);
+				h_res_eff->SetBinContent(i_tau + 1, h->GetBinContent(i_tau + 1));
+				h_res_eff->SetBinError(i_tau + 1, h->GetBinError(i_tau + 1));
+
+				auto g = get<TGraphAsymmErrors>(*owner[i_tau], g_name);
+				g_res_eff->SetPoint(i_tau, g->GetX()[i_tau], g->GetY()[i_tau]);
+				g_res_eff->SetPointEYlow(i_tau, g->GetErrorYlow(i_tau));
+				g_res_eff->SetPointEYhigh(i_tau, g->GetErrorYhigh(i_tau));
+			}
+			h_res_eff->SetDirectory(output_file.get());
+			output_file->Add(g_res_eff);
+		}
+
+		auto h_n_toys = (TH1F*)get<TH1F>(first, "n_toys_used")->Clone("n_toys_used");
+		for (int i_tau = 0; i_tau < nbin; i_tau++) {
+			h_n_toys->SetBinContent(i_tau + 1, get<TH1F>(*owner[i_tau], "n_toys_used")->GetBinContent(i_tau + 1));
+		}
+		h_n_toys->SetDirectory(output_file.get());
+
+		// The ctau check point shapes are in whichever shard did that lifetime, and everything else
+		// (the Lxy efficiency, the generated shape and info) is the same in every shard.
+		for (auto s : by_index) {
+			TIter next(s->file->GetListOfKeys());
+			while (auto key = (TKey*)next()) {
+				string name(key->GetName());
+				if ((s == &first && !is_merged(name)) || name.find("h_ctau_ratio_") == 0) {
+					output_file->cd();
+					key->ReadObj()->Write(name.c_str());
+				}
+			}
+		}
+
+		output_file->Write();
+		cout << "Merged " << n_shards << " shards with " << nbin << " lifetime bins into " << argv[1] << endl;
+	}
+	catch (exception &e)
+	{
+		cout << "Failed!!" << endl;
+		cout << " --> " << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,68 @@
+#include "analytic_decay.h"
+#include "Lxy_weight_calculator.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+	// The same timing window the toys use (see decay_toy_kernel).
+	const double c_light = 2.9979E8; // m/s
+	const double latest_decay = 15.0; // ns
+}
+
+analytic_decay::analytic_decay(const Lxy_weight_calculator &lxyWeight, bool timing_window)
+	: _table(lxyWeight.table()), _timing_window(timing_window),
+	_p1(lxyWeight.table().n_bins() + 2), _p2(lxyWeight.table().n_bins() + 2)
+{
+}
+
+void analytic_decay::expectation(const muon_tree_processor::eventInfo &entry, double tau, double &p_pass, double w[4], double w2[4])
+{
+	// The two LLPs decay independently, so the probabilities factorize.
+	p_pass = bin_probabilities(entry.vpi1_beta, entry.vpi1_gamma, entry.vpi1_sin_theta, tau, _p1)
+		* bin_probabilities(entry.vpi2_beta, entry.vpi2_gamma, entry.vpi2_sin_theta, tau, _p2);
+	_table.expectation(&_p1[0], &_p2[0], w, w2);
+}
+
+double analytic_decay::bin_probabilities(double beta, double gamma, double sin_theta, double tau, vector<double> &p) const
+{
+	fill(p.begin(), p.end(), 0.0);
+
+	// The delay behind light grows linearly with ct, so the timing window is just a maximum ct.
+	// (It can't be early, that would need beta > 1.)
+	double ct_max = numeric_limits<double>::infinity();
+	if (_timing_window) {
+		double delay_per_meter = gamma / c_light * 1E9 - beta * gamma / c_light * 1E9;
+		if (delay_per_meter > 0.0) {
+			ct_max = latest_decay / delay_per_meter;
+		}
+	}
+	double p_pass = 1.0 - exp(-ct_max / tau);
+
+	// Transverse decay length per meter of proper decay length.
+	double a = beta * gamma * sin_theta;
+	if (!(a > 0.0)) {
+		p[_table.find_bin(0.0)] = p_pass;
+		return p_pass;
+	}
+
+	// Probability to survive past transverse length L and still be in time, less the probability
+	// to survive past the latest time, for L up to that point.
+	double L_max = a * ct_max;
+	double s_max = exp(-ct_max / tau);
+	auto survive = [a, tau, L_max, s_max](double L) {
+		return L >= L_max ? s_max : exp(-L / (a * tau));
+	};
+
+	int n_bins = _table.n_bins();
+	p[0] = _table.lxy_min() > 0.0 ? survive(0.0) - survive(_table.lxy_min()) : 0.0;
+	for (int bin = 1; bin <= n_bins; bin++) {
+		p[bin] = survive(_table.bin_low_edge(bin)) - survive(_table.bin_low_edge(bin + 1));
+	}
+	p[n_bins + 1] = survive(_table.lxy_max()) - s_max;
+
+	return p_pass;
+}
@@ -0,0 +1,42 @@
+//
+// Extrapolate without toys: the exact expectation of the Lxy weight over the exponential
+// decay distribution of the two LLPs.
+//
+// The transverse decay length of an LLP is a*ct, with a = beta*gamma*sin(theta), and the Lxy
+// efficiency is constant in each cell of its table. So the probability of each LLP landing in each
+// bin is a difference of two exponentials, and the expected weight is a sum over the table cells.
+//
+#ifndef __analytic_decay__
+#define __analytic_decay__
+
+#include "muon_tree_processor.h"
+#include "decay_toy_kernel.h"
+
+#include <vector>
+
+class Lxy_weight_calculator;
+class lxy_lookup_table;
+
+class analytic_decay
+{
+public:
+	analytic_decay(const Lxy_weight_calculator &lxyWeight, bool timing_window = TIMINGNEEDED != 0);
+
+	// For this event at lifetime tau (meters), calculate the probability that both LLPs pass the
+	// timing window, and the expectation of the Lxy weight of each region, and of its square
+	// (both including the timing window).
+	void expectation(const muon_tree_processor::eventInfo &entry, double tau, double &p_pass, double w[4], double w2[4]);
+
+private:
+	const lxy_lookup_table &_table;
+	bool _timing_window;
+
+	// Probability for each LLP to land in each Lxy bin (ROOT numbering).
+	std::vector<double> _p1;
+	std::vector<double> _p2;
+
+	// Fill p with the bin probabilities for an LLP. Returns the probability it passes the timing window.
+	double bin_probabilities(double beta, double gamma, double sin_theta, double tau, std::vector<double> &p) const;
+};
+
+#endif
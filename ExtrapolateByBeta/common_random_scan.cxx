@@ -0,0 +1,124 @@
+#include "common_random_scan.h"
+#include "decay_toy_kernel.h"
+#include "Lxy_weight_calculator.h"
+#include "work_stealing_pool.h"
+
+#include "TRandom3.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+common_random_scan::common_random_scan(const vector<double> &taus, size_t n_toys, decay_toy_kernel::sampling how, bool pt_shapes, const variable_binning_builder &pt_binning)
+	: _taus(taus), _n_toys(n_toys), _sampling(how), _pt_shapes(pt_shapes), _passed(4 * taus.size(), 0.0)
+{
+	if (_pt_shapes) {
+		_den.assign(_taus.size(), weighted_histogram_2D(pt_binning.edges(), pt_binning.edges()));
+		_num.assign(4 * _taus.size(), weighted_histogram_2D(pt_binning.edges(), pt_binning.edges()));
+	}
+}
+
+namespace {
+	// Events whose toys are thrown together, before the lifetimes are spread over the threads.
+	// With a few hundred toys per event this is some 10 MB of decay lengths.
+	const size_t toy_batch_size = 1024;
+}
+
+void common_random_scan::run(const muon_tree_processor &reader, const Lxy_weight_calculator &lxyWeight, unsigned int seed, const work_stealing_pool &pool)
+{
+	// The toys for a batch of events are thrown once, in event order from a single stream, and then
+	// every group of lifetimes works from them. Each group only touches its own accumulators, so
+	// there is nothing to lock.
+	size_t n_groups = min(static_cast<size_t>(pool.n_threads()), _taus.size());
+	TRandom3 rnd(seed);
+	vector<muon_tree_processor::eventInfo> entries(toy_batch_size);
+	vector<decay_toy_kernel> toys;
+	toys.reserve(toy_batch_size);
+	for (size_t i = 0; i < toy_batch_size; i++) {
+		toys.emplace_back(_n_toys, _sampling);
+	}
+	size_t n_in_batch = 0;
+
+	auto run_batch = [&]() {
+		pool.run(n_groups, [&](size_t group, unsigned int) {
+			for (size_t i_entry = 0; i_entry < n_in_batch; i_entry++) {
+				const auto &entry = entries[i_entry];
+				const auto &entry_toys = toys[i_entry];
+
+				for (size_t i_tau = group; i_tau < _taus.size(); i_tau += n_groups) {
+					double tau = _taus[i_tau];
+
+					// Sum the Lxy weights over the toys. The pT bin is the same for all of them, so
+					// this is all we need to fill the histograms as if each toy had been filled in turn.
+					double sumw[4] = { 0.0, 0.0, 0.0, 0.0 };
+					double sumw2[4] = { 0.0, 0.0, 0.0, 0.0 };
+					double n_pass = 0;
+					for (size_t i_toy = 0; i_toy < entry_toys.n_toys(); i_toy++) {
+						if (entry_toys.passed(i_toy, tau)) {
+							double lxy_w[4];
+							lxyWeight(tau * entry_toys.L2D1(i_toy), tau * entry_toys.L2D2(i_toy), lxy_w);
+							for (int i_region = 0; i_region < 4; i_region++) {
+								sumw[i_region] += lxy_w[i_region];
+								sumw2[i_region] += lxy_w[i_region] * lxy_w[i_region];
+							}
+							n_pass++;
+						}
+					}
+					if (n_pass == 0) {
+						continue;
+					}
+
+					double w = entry.weight;
+					for (int i_region = 0; i_region < 4; i_region++) {
+						_passed[4 * i_tau + i_region] += w * sumw[i_region];
+					}
+
+					if (_pt_shapes) {
+						if (entry.pt_bin < 0) {
+							throw runtime_error("The pT bins must be indexed before running the common random number scan");
+						}
+						auto &den = _den[i_tau];
+						den.fill(entry.pt_bin, w * n_pass, w * w * n_pass);
+						den.set_entries(den.entries() + n_pass);
+						for (int i_region = 0; i_region < 4; i_region++) {
+							auto &num = _num[4 * i_tau + i_region];
+							num.fill(entry.pt_bin, w * sumw[i_region], w * w * sumw2[i_region]);
+							num.set_entries(den.entries());
+						}
+					}
+				}
+			}
+		});
+		n_in_batch = 0;
+	};
+
+	reader.process_all_entries([&](const muon_tree_processor::eventInfo &entry) {
+		// The toys at tau = 1 m. Everything above just scales them.
+		entries[n_in_batch] = entry;
+		toys[n_in_batch].generate(entry, 1.0, rnd);
+		if (++n_in_batch == toy_batch_size) {
+			run_batch();
+		}
+	});
+	if (n_in_batch > 0) {
+		run_batch();
+	}
+}
+
+pair<vector<weighted_histogram_2D>, weighted_histogram_2D> common_random_scan::pt_shape(size_t i_tau) const
+{
+	if (!_pt_shapes) {
+		throw runtime_error("The common random number scan was not asked to build pT shapes");
+	}
+	return make_pair(vector<weighted_histogram_2D>(_num.begin() + 4 * i_tau, _num.begin() + 4 * (i_tau + 1)), _den[i_tau]);
+}
+
+vector<double> common_random_scan::passed_events(size_t i_tau) const
+{
+	vector<double> r(4);
+	for (int i_region = 0; i_region < 4; i_region++) {
+		r[i_region] = _passed[4 * i_tau + i_region] / _n_toys;
+	}
+	return r;
+}
@@ -0,0 +1,58 @@
+//
+// Extrapolate to every lifetime in a single pass over the events, using common random numbers.
+//
+// The proper decay length is ct = -tau*ln(u), so the toys thrown for an event at tau = 1 serve for every
+// other lifetime just by scaling. Each event is visited once: its toys are thrown, and then the pT shapes
+// and the passed event sums of every lifetime are accumulated. Since all lifetimes see the same random
+// numbers the efficiency vs ctau curve is smooth, rather than jittering from point to point.
+//
+#ifndef __common_random_scan__
+#define __common_random_scan__
+
+#include "muon_tree_processor.h"
+#include "decay_toy_kernel.h"
+#include "variable_binning_builder.h"
+#include "weighted_histogram.h"
+
+#include <vector>
+#include <utility>
+
+class Lxy_weight_calculator;
+class work_stealing_pool;
+
+class common_random_scan
+{
+public:
+	// taus - the lifetimes (meters) to extrapolate to.
+	// n_toys - the number of toys thrown per event, shared by all lifetimes.
+	// how - how the toys are drawn (see decay_toy_kernel).
+	// pt_shapes - if true, accumulate the pT shapes (what GetFullPtShape makes) as well as the passed sums.
+	common_random_scan(const std::vector<double> &taus, size_t n_toys, decay_toy_kernel::sampling how, bool pt_shapes, const variable_binning_builder &pt_binning);
+
+	// Make the pass over the events. The toys for each batch of events are thrown once, from seed, and the
+	// lifetimes are split between the pool's threads to use them. So the result does not depend on the
+	// number of threads.
+	void run(const muon_tree_processor &reader, const Lxy_weight_calculator &lxyWeight, unsigned int seed, const work_stealing_pool &pool);
+
+	size_t n_taus() const { return _taus.size(); }
+	double tau(size_t i_tau) const { return _taus[i_tau]; }
+
+	// The numerator (one per region) and denominator pT shapes at lifetime i_tau, filled just as GetFullPtShape fills them.
+	std::pair<std::vector<weighted_histogram_2D>, weighted_histogram_2D> pt_shape(size_t i_tau) const;
+
+	// Events passing each region at lifetime i_tau, averaged over the toys, as CalcPassedEventsLxy calculates them.
+	std::vector<double> passed_events(size_t i_tau) const;
+
+private:
+	std::vector<double> _taus;
+	size_t _n_toys;
+	decay_toy_kernel::sampling _sampling;
+	bool _pt_shapes;
+
+	// Per lifetime accumulators. The pT shapes are indexed by [tau] (den) and [tau][region] (num).
+	std::vector<weighted_histogram_2D> _den;
+	std::vector<weighted_histogram_2D> _num;
+	std::vector<double> _passed; // [tau][region]
+};
+
+#endif
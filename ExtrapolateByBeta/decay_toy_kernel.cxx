@@ -0,0 +1,342 @@
+#include "decay_toy_kernel.h"
+
+#include "TRandom.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+// The vector versions need gcc or clang on x86 (target attributes and cpu detection).
+// Everything else runs the scalar version.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DECAY_KERNEL_X86 1
+#include <immintrin.h>
+#else
+#define DECAY_KERNEL_X86 0
+#endif
+
+using namespace std;
+
+namespace {
+	// Speed of light, in m/s, as the timing window has always used it.
+	const double c_light = 2.9979E8;
+
+	// log(x) = e*ln(2) + log(m), with m in [sqrt(1/2), sqrt(2)). log(m) = 2*atanh(s), s = (m-1)/(m+1),
+	// whose series is summed below. |s| < 0.172, so the terms we leave off are below 1e-17.
+	// The scalar and the vector versions do exactly the same operations in the same order (and
+	// none are fused), so they give the same answer to the last bit.
+	const double c_sqrt2 = 1.41421356237309504880;
+	const double c_ln2_hi = 6.93147180369123816490e-01;
+	const double c_ln2_lo = 1.90821492927058770002e-10;
+	const uint64_t c_mantissa_mask = 0x000FFFFFFFFFFFFFULL;
+	const uint64_t c_one_bits = 0x3FF0000000000000ULL;
+	const double c_atanh[] = {
+		2.0, 2.0 / 3.0, 2.0 / 5.0, 2.0 / 7.0, 2.0 / 9.0, 2.0 / 11.0,
+		2.0 / 13.0, 2.0 / 15.0, 2.0 / 17.0, 2.0 / 19.0, 2.0 / 21.0
+	};
+	const int c_n_atanh = sizeof(c_atanh) / sizeof(c_atanh[0]);
+
+	// The first n points of the 2D Sobol sequence, as 32 bit binary fractions. The first coordinate
+	// is the van der Corput sequence (the bits of i reversed), the second uses the direction numbers
+	// from the primitive polynomial x + 1, v_k = v_{k-1} ^ (v_{k-1} >> 1).
+	void sobol_points_2d(size_t n, uint32_t *points)
+	{
+		uint32_t v[32];
+		v[0] = 1U << 31;
+		for (int k = 1; k < 32; k++) {
+			v[k] = v[k - 1] ^ (v[k - 1] >> 1);
+		}
+		for (size_t i = 0; i < n; i++) {
+			uint32_t x1 = 0, x2 = 0;
+			uint32_t bits = static_cast<uint32_t>(i);
+			for (int k = 0; bits != 0; k++, bits >>= 1) {
+				if (bits & 1) {
+					x1 |= 1U << (31 - k);
+					x2 ^= v[k];
+				}
+			}
+			points[2 * i] = x1;
+			points[2 * i + 1] = x2;
+		}
+	}
+
+	// The per-event constants for the two LLPs.
+	struct llp_constants {
+		double gamma[2];
+		double beta[2];
+		double sin_theta[2];
+	};
+
+	// log(x) for x a normal, positive, number (the uniform random numbers are all in (0,1)).
+	inline double log_scalar(double x)
+	{
+		uint64_t bits;
+		memcpy(&bits, &x, sizeof(bits));
+		double e = static_cast<double>(bits >> 52) - 1023.0;
+		uint64_t m_bits = (bits & c_mantissa_mask) | c_one_bits;
+		double m;
+		memcpy(&m, &m_bits, sizeof(m));
+		if (m > c_sqrt2) {
+			m = m * 0.5;
+			e = e + 1.0;
+		}
+
+		double s = (m - 1.0) / (m + 1.0);
+		double z = s * s;
+		double p = c_atanh[c_n_atanh - 1];
+		for (int i = c_n_atanh - 2; i >= 0; i--) {
+			p = p * z + c_atanh[i];
+		}
+		return e * c_ln2_hi + (s * p + e * c_ln2_lo);
+	}
+
+	// One LLP of one toy: the same special relativity doSR has always done.
+	inline void decay_lane(double u, double tau, const llp_constants &k, int llp, bool timing_window, double &L2D, double &delay, unsigned char &pass)
+	{
+		// Proper decay length, and then the decay length in the lab frame (meters)
+		double ct = -tau * log_scalar(u);
+		double ctprime = k.gamma[llp] * ct;
+		double lxy = k.beta[llp] * ctprime;
+
+		L2D = lxy * k.sin_theta[llp];
+
+		if (timing_window) {
+			// How late, in ns, the decay is compared with something moving at the speed of light.
+			// The first test can't really fire (that would be faster than light), it is there for completeness.
+			double deltat = ctprime / c_light * 1E9 - lxy / c_light * 1E9;
+			delay = deltat;
+			pass = !(deltat < -3.0 || deltat > 15.0);
+		}
+	}
+
+	void decay_block_scalar(const double *u, size_t n, double tau, const llp_constants &k, bool timing_window, double *L2D, double *delay, unsigned char *pass)
+	{
+		for (size_t i = 0; i < n; i++) {
+			decay_lane(u[i], tau, k, static_cast<int>(i & 1), timing_window, L2D[i], delay[i], pass[i]);
+		}
+	}
+
+#if DECAY_KERNEL_X86
+	__attribute__((target("avx2")))
+	inline __m256d log_avx2(__m256d x)
+	{
+		const __m256d one = _mm256_set1_pd(1.0);
+		const __m256d two52 = _mm256_set1_pd(4503599627370496.0);
+
+		__m256i bits = _mm256_castpd_si256(x);
+
+		// The exponent, turned into a double by the 2^52 trick (AVX2 can't convert 64 bit integers).
+		__m256i e_bits = _mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_castpd_si256(two52));
+		__m256d e = _mm256_sub_pd(_mm256_sub_pd(_mm256_castsi256_pd(e_bits), two52), _mm256_set1_pd(1023.0));
+		__m256d m = _mm256_castsi256_pd(_mm256_or_si256(
+			_mm256_and_si256(bits, _mm256_set1_epi64x(static_cast<long long>(c_mantissa_mask))),
+			_mm256_set1_epi64x(static_cast<long long>(c_one_bits))));
+
+		__m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(c_sqrt2), _CMP_GT_OQ);
+		m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+		e = _mm256_add_pd(e, _mm256_and_pd(big, one));
+
+		__m256d s = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+		__m256d z = _mm256_mul_pd(s, s);
+		__m256d p = _mm256_set1_pd(c_atanh[c_n_atanh - 1]);
+		for (int i = c_n_atanh - 2; i >= 0; i--) {
+			p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(c_atanh[i]));
+		}
+		return _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(c_ln2_hi)),
+			_mm256_add_pd(_mm256_mul_pd(s, p), _mm256_mul_pd(e, _mm256_set1_pd(c_ln2_lo))));
+	}
+
+	// Four lanes at a time. n is always even, and every block starts on an even entry, so the
+	// lanes are always LLP 1, LLP 2, LLP 1, LLP 2.
+	__attribute__((target("avx2")))
+	void decay_block_avx2(const double *u, size_t n, double tau, const llp_constants &k, bool timing_window, double *L2D, double *delay, unsigned char *pass)
+	{
+		const __m256d neg_tau = _mm256_set1_pd(-tau);
+		const __m256d gamma = _mm256_setr_pd(k.gamma[0], k.gamma[1], k.gamma[0], k.gamma[1]);
+		const __m256d beta = _mm256_setr_pd(k.beta[0], k.beta[1], k.beta[0], k.beta[1]);
+		const __m256d sin_theta = _mm256_setr_pd(k.sin_theta[0], k.sin_theta[1], k.sin_theta[0], k.sin_theta[1]);
+		const __m256d light = _mm256_set1_pd(c_light);
+		const __m256d ns = _mm256_set1_pd(1E9);
+		const __m256d early = _mm256_set1_pd(-3.0);
+		const __m256d late = _mm256_set1_pd(15.0);
+
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			__m256d ct = _mm256_mul_pd(neg_tau, log_avx2(_mm256_loadu_pd(u + i)));
+			__m256d ctprime = _mm256_mul_pd(gamma, ct);
+			__m256d lxy = _mm256_mul_pd(beta, ctprime);
+			_mm256_storeu_pd(L2D + i, _mm256_mul_pd(lxy, sin_theta));
+
+			if (timing_window) {
+				__m256d deltat = _mm256_sub_pd(
+					_mm256_mul_pd(_mm256_div_pd(ctprime, light), ns),
+					_mm256_mul_pd(_mm256_div_pd(lxy, light), ns));
+				_mm256_storeu_pd(delay + i, deltat);
+				int bad = _mm256_movemask_pd(_mm256_or_pd(
+					_mm256_cmp_pd(deltat, early, _CMP_LT_OQ),
+					_mm256_cmp_pd(deltat, late, _CMP_GT_OQ)));
+				for (int j = 0; j < 4; j++) {
+					pass[i + j] = !((bad >> j) & 1);
+				}
+			}
+		}
+		decay_block_scalar(u + i, n - i, tau, k, timing_window, L2D + i, delay + i, pass + i);
+	}
+
+	__attribute__((target("avx512f")))
+	inline __m512d log_avx512(__m512d x)
+	{
+		const __m512d one = _mm512_set1_pd(1.0);
+		const __m512d two52 = _mm512_set1_pd(4503599627370496.0);
+
+		__m512i bits = _mm512_castpd_si512(x);
+
+		// (maskz form, as the plain shift trips a bogus gcc maybe-uninitialized warning)
+		__m512i e_bits = _mm512_or_si512(_mm512_maskz_srli_epi64(0xFF, bits, 52), _mm512_castpd_si512(two52));
+		__m512d e = _mm512_sub_pd(_mm512_sub_pd(_mm512_castsi512_pd(e_bits), two52), _mm512_set1_pd(1023.0));
+		__m512d m = _mm512_castsi512_pd(_mm512_or_si512(
+			_mm512_and_si512(bits, _mm512_set1_epi64(static_cast<long long>(c_mantissa_mask))),
+			_mm512_set1_epi64(static_cast<long long>(c_one_bits))));
+
+		__mmask8 big = _mm512_cmp_pd_mask(m, _mm512_set1_pd(c_sqrt2), _CMP_GT_OQ);
+		m = _mm512_mask_mul_pd(m, big, m, _mm512_set1_pd(0.5));
+		e = _mm512_mask_add_pd(e, big, e, one);
+
+		__m512d s = _mm512_div_pd(_mm512_sub_pd(m, one), _mm512_add_pd(m, one));
+		__m512d z = _mm512_mul_pd(s, s);
+		__m512d p = _mm512_set1_pd(c_atanh[c_n_atanh - 1]);
+		for (int i = c_n_atanh - 2; i >= 0; i--) {
+			p = _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(c_atanh[i]));
+		}
+		return _mm512_add_pd(_mm512_mul_pd(e, _mm512_set1_pd(c_ln2_hi)),
+			_mm512_add_pd(_mm512_mul_pd(s, p), _mm512_mul_pd(e, _mm512_set1_pd(c_ln2_lo))));
+	}
+
+	// Eight lanes at a time, alternating LLP 1 and LLP 2 as for AVX2.
+	__attribute__((target("avx512f")))
+	void decay_block_avx512(const double *u, size_t n, double tau, const llp_constants &k, bool timing_window, double *L2D, double *delay, unsigned char *pass)
+	{
+		const __m512d neg_tau = _mm512_set1_pd(-tau);
+		const __m512d gamma = _mm512_setr_pd(k.gamma[0], k.gamma[1], k.gamma[0], k.gamma[1], k.gamma[0], k.gamma[1], k.gamma[0], k.gamma[1]);
+		const __m512d beta = _mm512_setr_pd(k.beta[0], k.beta[1], k.beta[0], k.beta[1], k.beta[0], k.beta[1], k.beta[0], k.beta[1]);
+		const __m512d sin_theta = _mm512_setr_pd(k.sin_theta[0], k.sin_theta[1], k.sin_theta[0], k.sin_theta[1], k.sin_theta[0], k.sin_theta[1], k.sin_theta[0], k.sin_theta[1]);
+		const __m512d light = _mm512_set1_pd(c_light);
+		const __m512d ns = _mm512_set1_pd(1E9);
+		const __m512d early = _mm512_set1_pd(-3.0);
+		const __m512d late = _mm512_set1_pd(15.0);
+
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			__m512d ct = _mm512_mul_pd(neg_tau, log_avx512(_mm512_loadu_pd(u + i)));
+			__m512d ctprime = _mm512_mul_pd(gamma, ct);
+			__m512d lxy = _mm512_mul_pd(beta, ctprime);
+			_mm512_storeu_pd(L2D + i, _mm512_mul_pd(lxy, sin_theta));
+
+			if (timing_window) {
+				__m512d deltat = _mm512_sub_pd(
+					_mm512_mul_pd(_mm512_div_pd(ctprime, light), ns),
+					_mm512_mul_pd(_mm512_div_pd(lxy, light), ns));
+				_mm512_storeu_pd(delay + i, deltat);
+				__mmask8 bad = _mm512_cmp_pd_mask(deltat, early, _CMP_LT_OQ) | _mm512_cmp_pd_mask(deltat, late, _CMP_GT_OQ);
+				for (int j = 0; j < 8; j++) {
+					pass[i + j] = !((bad >> j) & 1);
+				}
+			}
+		}
+		decay_block_scalar(u + i, n - i, tau, k, timing_window, L2D + i, delay + i, pass + i);
+	}
+#endif
+}
+
+decay_toy_kernel::decay_toy_kernel(size_t n_toys, sampling how, bool timing_window, simd_level level)
+	: _n_toys(n_toys), _sampling(how), _timing_window(timing_window),
+	_level(level == simd_level::best ? best_level() : level),
+	_uniform(2 * n_toys), _L2D(2 * n_toys), _delay(2 * n_toys, 0.0), _pass(2 * n_toys, 1)
+{
+	if (static_cast<int>(_level) > static_cast<int>(best_level())) {
+		throw runtime_error(string("The decay toy kernel can't run with ") + level_name(_level) + " on this machine");
+	}
+	if (_sampling == sampling::sobol) {
+		if (static_cast<uint64_t>(n_toys) > 0xFFFFFFFFULL) {
+			throw runtime_error("Too many toys for the Sobol sequence");
+		}
+		_sobol.resize(2 * n_toys);
+		sobol_points_2d(n_toys, _sobol.data());
+	}
+}
+
+// Throw all the toys for one event.
+void decay_toy_kernel::generate(const muon_tree_processor::eventInfo &entry, double tau, TRandom &rnd)
+{
+	if (_n_toys == 0) {
+		return;
+	}
+
+	if (_sampling == sampling::sobol) {
+		// Shift every point by the same random amount (xor of the binary fractions), and take the
+		// middle of each 2^-32 cell so that no number is ever 0.
+		double shift_u[2];
+		rnd.RndmArray(2, shift_u);
+		uint32_t shift[2] = { static_cast<uint32_t>(shift_u[0] * 4294967296.0), static_cast<uint32_t>(shift_u[1] * 4294967296.0) };
+		for (size_t i = 0; i < _uniform.size(); i++) {
+			_uniform[i] = ((_sobol[i] ^ shift[i & 1]) + 0.5) * (1.0 / 4294967296.0);
+		}
+	}
+	else {
+		// Same numbers, in the same order, that n_toys pairs of calls to rnd.Exp would have used.
+		rnd.RndmArray(static_cast<int>(_uniform.size()), &_uniform[0]);
+	}
+
+	llp_constants k = {
+		{ entry.vpi1_gamma, entry.vpi2_gamma },
+		{ entry.vpi1_beta, entry.vpi2_beta },
+		{ entry.vpi1_sin_theta, entry.vpi2_sin_theta }
+	};
+
+	switch (_level) {
+#if DECAY_KERNEL_X86
+	case simd_level::avx512:
+		decay_block_avx512(&_uniform[0], _uniform.size(), tau, k, _timing_window, &_L2D[0], &_delay[0], &_pass[0]);
+		break;
+	case simd_level::avx2:
+		decay_block_avx2(&_uniform[0], _uniform.size(), tau, k, _timing_window, &_L2D[0], &_delay[0], &_pass[0]);
+		break;
+#endif
+	default:
+		decay_block_scalar(&_uniform[0], _uniform.size(), tau, k, _timing_window, &_L2D[0], &_delay[0], &_pass[0]);
+		break;
+	}
+}
+
+decay_toy_kernel::simd_level decay_toy_kernel::best_level()
+{
+#if DECAY_KERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return simd_level::avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return simd_level::avx2;
+	}
+#endif
+	return simd_level::scalar;
+}
+
+const char *decay_toy_kernel::sampling_name(sampling how)
+{
+	return how == sampling::sobol ? "Sobol" : "pseudo random";
+}
+
+const char *decay_toy_kernel::level_name(simd_level level)
+{
+	switch (level) {
+	case simd_level::scalar:
+		return "scalar";
+	case simd_level::avx2:
+		return "AVX2";
+	case simd_level::avx512:
+		return "AVX-512";
+	default:
+		return "best";
+	}
+}
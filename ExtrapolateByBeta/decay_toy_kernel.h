@@ -0,0 +1,84 @@
+//
+// Generate the decay positions of the two LLPs in an event for a whole block of toys at once.
+// This is the inner loop of the extrapolation: every event is thrown a few hundred times
+// for every lifetime point.
+//
+#ifndef __decay_toy_kernel__
+#define __decay_toy_kernel__
+
+#include "muon_tree_processor.h"
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Apply the LLP timing window (decays more than 15 ns late, or faster than light, are lost)
+#ifndef TIMINGNEEDED
+#define TIMINGNEEDED 0
+#endif
+
+class TRandom;
+
+class decay_toy_kernel
+{
+public:
+	// Instruction sets the kernel can run with. best picks the fastest one this CPU has.
+	enum class simd_level { scalar, avx2, avx512, best };
+
+	// How the pairs of decay times are drawn.
+	//  pseudo_random - independent random numbers for every toy.
+	//  sobol - the first n_toys points of the 2D Sobol sequence (one coordinate per LLP), with a fresh
+	//          random digital shift for each event. The toys cover the pair of decay distributions much
+	//          more evenly, so the average over them converges faster, and the shift keeps it unbiased.
+	enum class sampling { pseudo_random, sobol };
+
+	decay_toy_kernel(size_t n_toys, sampling how = sampling::pseudo_random, bool timing_window = TIMINGNEEDED != 0, simd_level level = simd_level::best);
+
+	// Throw n_toys() pairs of proper decay times from an exponential with mean tau (in meters),
+	// and turn each into the transverse decay length of each LLP (in meters).
+	// With pseudo_random sampling the random numbers are drawn in the same order as calling
+	// rnd.Exp(tau) for LLP 1 and then LLP 2 of each toy. With sobol only the two numbers of the
+	// shift are drawn.
+	void generate(const muon_tree_processor::eventInfo &entry, double tau, TRandom &rnd);
+
+	size_t n_toys() const { return _n_toys; }
+
+	// Results of the last call to generate for toy i.
+	bool passed(size_t i) const { return _pass[2 * i] && _pass[2 * i + 1]; }
+	double L2D1(size_t i) const { return _L2D[2 * i]; }
+	double L2D2(size_t i) const { return _L2D[2 * i + 1]; }
+
+	// Decay lengths and times scale with tau. So the toys thrown at one tau serve for any other
+	// (common random numbers): multiply L2D by scale = tau'/tau, and use this to apply the timing window.
+	bool passed(size_t i, double scale) const {
+		return !_timing_window || (in_time(scale * _delay[2 * i]) && in_time(scale * _delay[2 * i + 1]));
+	}
+
+	// The instruction set actually in use.
+	simd_level level() const { return _level; }
+	static const char *level_name(simd_level level);
+
+	// The best instruction set the kernel supports on this CPU.
+	static simd_level best_level();
+
+	static const char *sampling_name(sampling how);
+
+private:
+	size_t _n_toys;
+	sampling _sampling;
+	bool _timing_window;
+	simd_level _level;
+
+	std::vector<uint32_t> _sobol; // The Sobol points, as 32 bit fractions, interleaved like _uniform
+
+	// Uniform random numbers, the transverse decay length, the delay and the timing decision.
+	// All are interleaved: even entries are LLP 1, odd ones LLP 2.
+	std::vector<double> _uniform;
+	std::vector<double> _L2D;
+	std::vector<double> _delay; // How late (ns) the decay is compared to light. Only with the timing window.
+	std::vector<unsigned char> _pass;
+
+	static bool in_time(double delay) { return !(delay < -3.0 || delay > 15.0); }
+};
+
+#endif
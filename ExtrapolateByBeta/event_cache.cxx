@@ -0,0 +1,262 @@
+#include "event_cache.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace event_cache {
+
+	namespace {
+		const char magic[8] = { 'E', 'X', 'T', 'R', 'A', 'P', 'E', 'V' };
+		const size_t alignment = 64;
+		const size_t stamp_bytes = 64 * 1024; // How much of each end of the source file goes into its hash
+
+		// The start of the file.
+		struct file_header {
+			char magic[8];
+			uint32_t version;
+			uint32_t n_columns;
+			uint64_t n_events;
+			uint64_t source_size;
+			int64_t source_mtime;
+			uint64_t source_hash;
+			uint64_t checksum; // Of the header (with this zero) and the column table
+			uint64_t reserved;
+		};
+
+		// One entry in the column table, which follows the header.
+		struct column_entry {
+			char name[40];
+			uint64_t element_size;
+			uint64_t offset; // From the start of the file
+			uint64_t reserved;
+		};
+
+		static_assert(sizeof(file_header) == 64, "event cache header must be 64 bytes");
+		static_assert(sizeof(column_entry) == 64, "event cache column entry must be 64 bytes");
+
+		uint64_t header_checksum(file_header h, const column_entry *columns)
+		{
+			h.checksum = 0;
+			return fnv1a(columns, h.n_columns * sizeof(column_entry), fnv1a(&h, sizeof(h)));
+		}
+
+		size_t aligned(size_t offset)
+		{
+			return (offset + alignment - 1) / alignment * alignment;
+		}
+	}
+
+	uint64_t fnv1a(const void *data, size_t n, uint64_t h)
+	{
+		auto p = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < n; i++) {
+			h ^= p[i];
+			h *= 0x100000001b3ULL;
+		}
+		return h;
+	}
+
+	source_stamp stamp_of(const string &source_file)
+	{
+		struct stat info;
+		if (stat(source_file.c_str(), &info) != 0) {
+			throw runtime_error("Unable to find the source file " + source_file + " of the event cache");
+		}
+
+		source_stamp r;
+		r.size = static_cast<uint64_t>(info.st_size);
+		r.mtime = static_cast<int64_t>(info.st_mtime);
+
+		ifstream in(source_file.c_str(), ios::binary);
+		vector<char> buffer(static_cast<size_t>(min<uint64_t>(r.size, stamp_bytes)));
+		in.read(buffer.data(), buffer.size());
+		r.hash = fnv1a(buffer.data(), buffer.size());
+		if (r.size > stamp_bytes) {
+			in.seekg(static_cast<streamoff>(r.size - buffer.size()));
+			in.read(buffer.data(), buffer.size());
+			r.hash = fnv1a(buffer.data(), buffer.size(), r.hash);
+		}
+		if (!in) {
+			throw runtime_error("Unable to read the source file " + source_file + " of the event cache");
+		}
+		return r;
+	}
+
+	writer::writer(const string &source_file, size_t n_events)
+		: _stamp(stamp_of(source_file)), _n_events(n_events)
+	{
+	}
+
+	void writer::add_column(const string &name, const void *values, size_t element_size)
+	{
+		if (name.size() >= sizeof(column_entry().name)) {
+			throw runtime_error("Event cache column name " + name + " is too long");
+		}
+		column c = { name, values, element_size };
+		_columns.push_back(c);
+	}
+
+	void writer::write(const string &cache_file) const
+	{
+		file_header h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, magic, sizeof(magic));
+		h.version = format_version;
+		h.n_columns = static_cast<uint32_t>(_columns.size());
+		h.n_events = _n_events;
+		h.source_size = _stamp.size;
+		h.source_mtime = _stamp.mtime;
+		h.source_hash = _stamp.hash;
+
+		vector<column_entry> table(_columns.size());
+		size_t offset = aligned(sizeof(h) + table.size() * sizeof(column_entry));
+		for (size_t i = 0; i < _columns.size(); i++) {
+			memset(&table[i], 0, sizeof(column_entry));
+			strncpy(table[i].name, _columns[i].name.c_str(), sizeof(table[i].name) - 1);
+			table[i].element_size = _columns[i].element_size;
+			table[i].offset = offset;
+			offset = aligned(offset + _n_events * _columns[i].element_size);
+		}
+		h.checksum = header_checksum(h, table.data());
+
+		// Write to a temporary, and move it into place once it is all there, so a run that is
+		// killed part way through never leaves a half written cache behind.
+		string temp_file = cache_file + ".tmp";
+		{
+			ofstream out(temp_file.c_str(), ios::binary | ios::trunc);
+			out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+			out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(column_entry));
+			const char zeros[alignment] = { 0 };
+			size_t position = sizeof(h) + table.size() * sizeof(column_entry);
+			for (size_t i = 0; i < _columns.size(); i++) {
+				out.write(zeros, table[i].offset - position);
+				size_t n_bytes = _n_events * _columns[i].element_size;
+				out.write(static_cast<const char*>(_columns[i].values), n_bytes);
+				position = table[i].offset + n_bytes;
+			}
+			if (!out) {
+				throw runtime_error("Unable to write the event cache " + temp_file);
+			}
+		}
+		remove(cache_file.c_str());
+		if (rename(temp_file.c_str(), cache_file.c_str()) != 0) {
+			throw runtime_error("Unable to move the event cache into place at " + cache_file);
+		}
+	}
+
+	reader::reader(const string &cache_file)
+		: _data(nullptr), _length(0)
+	{
+#ifndef _WIN32
+		int fd = open(cache_file.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw runtime_error("Unable to open the event cache " + cache_file);
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0) {
+			close(fd);
+			throw runtime_error("The event cache " + cache_file + " is empty");
+		}
+		_length = static_cast<size_t>(info.st_size);
+		void *m = mmap(nullptr, _length, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (m == MAP_FAILED) {
+			throw runtime_error("Unable to map the event cache " + cache_file);
+		}
+		_data = static_cast<const char*>(m);
+#else
+		ifstream in(cache_file.c_str(), ios::binary | ios::ate);
+		if (!in) {
+			throw runtime_error("Unable to open the event cache " + cache_file);
+		}
+		_buffer.resize(static_cast<size_t>(in.tellg()));
+		in.seekg(0);
+		in.read(_buffer.data(), _buffer.size());
+		_length = _buffer.size();
+		_data = _buffer.data();
+#endif
+
+		// Make sure this is a cache we understand, and that it is all there.
+		try {
+			validate(cache_file);
+		}
+		catch (...) {
+#ifndef _WIN32
+			munmap(const_cast<char*>(_data), _length);
+#endif
+			throw;
+		}
+	}
+
+	void reader::validate(const string &cache_file)
+	{
+		file_header h;
+		if (_length < sizeof(h)) {
+			throw runtime_error("The event cache " + cache_file + " is too short");
+		}
+		memcpy(&h, _data, sizeof(h));
+		if (memcmp(h.magic, magic, sizeof(magic)) != 0) {
+			throw runtime_error(cache_file + " is not an event cache");
+		}
+		if (h.version != format_version) {
+			throw runtime_error("The event cache " + cache_file + " is an old version, and must be remade");
+		}
+		if (_length < sizeof(h) + h.n_columns * sizeof(column_entry)) {
+			throw runtime_error("The event cache " + cache_file + " is too short");
+		}
+		auto table = reinterpret_cast<const column_entry*>(_data + sizeof(h));
+		if (header_checksum(h, table) != h.checksum) {
+			throw runtime_error("The event cache " + cache_file + " is corrupt");
+		}
+		for (uint32_t i = 0; i < h.n_columns; i++) {
+			if (table[i].offset % alignment != 0 || table[i].offset + h.n_events * table[i].element_size > _length) {
+				throw runtime_error("The event cache " + cache_file + " is truncated");
+			}
+		}
+
+		_stamp.size = h.source_size;
+		_stamp.mtime = h.source_mtime;
+		_stamp.hash = h.source_hash;
+		_n_events = static_cast<size_t>(h.n_events);
+		_n_columns = h.n_columns;
+	}
+
+	reader::~reader()
+	{
+#ifndef _WIN32
+		munmap(const_cast<char*>(_data), _length);
+#endif
+	}
+
+	bool reader::matches(const string &source_file) const
+	{
+		return stamp_of(source_file) == _stamp;
+	}
+
+	const void *reader::column(const string &name, size_t element_size) const
+	{
+		auto table = reinterpret_cast<const column_entry*>(_data + sizeof(file_header));
+		for (size_t i = 0; i < _n_columns; i++) {
+			if (name == table[i].name) {
+				if (table[i].element_size != element_size) {
+					throw runtime_error("Column " + name + " of the event cache has the wrong type");
+				}
+				return _data + table[i].offset;
+			}
+		}
+		throw runtime_error("Column " + name + " is missing from the event cache");
+	}
+}
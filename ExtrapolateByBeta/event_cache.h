@@ -0,0 +1,97 @@
+//
+// A binary cache of the event columns of an extrapTree, so repeated runs on the same slimmed file
+// don't have to go through ROOT I/O.
+//
+// The file is a fixed header, a table of columns, and then each column's raw values (uncompressed,
+// native byte order, each starting on a 64 byte boundary). It is memory mapped when read, and the
+// columns are used in place. The header records the version of the format and a stamp of the source
+// ROOT file (its size, modification time, and a hash of its first and last 64 kB), so a cache that
+// is out of date with its source is not used.
+//
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace event_cache {
+
+	const uint32_t format_version = 1;
+
+	// Identifies the contents of a source ROOT file.
+	struct source_stamp {
+		uint64_t size;
+		int64_t mtime;
+		uint64_t hash;
+
+		bool operator== (const source_stamp &o) const { return size == o.size && mtime == o.mtime && hash == o.hash; }
+	};
+	source_stamp stamp_of(const std::string &source_file);
+
+	// 64 bit FNV-1a hash of a block of bytes, optionally carrying on from an earlier hash.
+	uint64_t fnv1a(const void *data, size_t n, uint64_t h = 0xcbf29ce484222325ULL);
+
+	// Writes a cache file, one column at a time.
+	class writer
+	{
+	public:
+		writer(const std::string &source_file, size_t n_events);
+
+		// Add a column. values must stay valid until write is called.
+		template<class T>
+		void add_column(const std::string &name, const T *values)
+		{
+			add_column(name, values, sizeof(T));
+		}
+		void add_column(const std::string &name, const void *values, size_t element_size);
+
+		void write(const std::string &cache_file) const;
+
+	private:
+		source_stamp _stamp;
+		size_t _n_events;
+		struct column {
+			std::string name;
+			const void *values;
+			size_t element_size;
+		};
+		std::vector<column> _columns;
+	};
+
+	// A memory mapped cache file. The columns point into the mapping, so this must outlive them.
+	class reader
+	{
+	public:
+		// Throws if the file can't be read or isn't a cache file of this version.
+		explicit reader(const std::string &cache_file);
+		~reader();
+
+		// True if the cache was made from the source file as it is now.
+		bool matches(const std::string &source_file) const;
+
+		size_t n_events() const { return _n_events; }
+
+		template<class T>
+		const T *column(const std::string &name) const
+		{
+			return static_cast<const T*>(column(name, sizeof(T)));
+		}
+		const void *column(const std::string &name, size_t element_size) const;
+
+	private:
+		const char *_data;
+		size_t _length;
+		std::vector<char> _buffer; // Where there is no mmap, the whole file is read in here
+
+		source_stamp _stamp;
+		size_t _n_events;
+		size_t _n_columns;
+
+		// Check the header and column table, and pick up what they say.
+		void validate(const std::string &cache_file);
+
+		reader(const reader &) = delete;
+		reader &operator=(const reader &) = delete;
+	};
+}
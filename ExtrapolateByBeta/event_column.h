@@ -0,0 +1,68 @@
+//
+// One column of event data. It either holds its own values, or is a read-only view of values
+// that live somewhere else (a memory mapped event cache, see event_cache.h). Reading is the same
+// either way; anything that changes a view first copies it into the column's own storage.
+//
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+template<class T>
+class event_column
+{
+public:
+	typedef T value_type;
+
+	event_column() : _view(nullptr), _n(0) {}
+
+	// Point at n values owned by someone else, who must keep them alive.
+	void view(const T *values, size_t n)
+	{
+		_owned.clear();
+		_owned.shrink_to_fit();
+		_view = values;
+		_n = n;
+	}
+	bool is_view() const { return _view != nullptr; }
+
+	size_t size() const { return _view ? _n : _owned.size(); }
+	const T *data() const { return _view ? _view : _owned.data(); }
+	const T &operator[](size_t i) const { return data()[i]; }
+
+	T &operator[](size_t i)
+	{
+		own();
+		return _owned[i];
+	}
+	void push_back(const T &v)
+	{
+		own();
+		_owned.push_back(v);
+	}
+	void reserve(size_t n)
+	{
+		own();
+		_owned.reserve(n);
+	}
+	void resize(size_t n)
+	{
+		own();
+		_owned.resize(n);
+	}
+
+private:
+	std::vector<T> _owned;
+	const T *_view;
+	size_t _n;
+
+	// Copy a view into our own storage, so it can be changed.
+	void own()
+	{
+		if (_view) {
+			_owned.assign(_view, _view + _n);
+			_view = nullptr;
+			_n = 0;
+		}
+	}
+};
@@ -13,30 +13,41 @@
 #include "muon_tree_processor.h"
 #include "variable_binning_builder.h"
 #include "Lxy_weight_calculator.h"
-#include "caching_tlz.h"
+#include "decay_toy_kernel.h"
+#include "common_random_scan.h"
+#include "analytic_decay.h"
+#include "toy_batches.h"
+#include "weighted_histogram.h"
+#include "pt_weight_table.h"
+#include "bayes_interval.h"
+#include "tau_checkpoint.h"
+#include "tau_point_writer.h"
+#include "work_stealing_pool.h"
+#include "rng_streams.h"
 
 #include "Wild/CommandLine.h"
 
 #include "TApplication.h"
-#pragma warning (push)
-#pragma warning (disable: 4244)
-#include "TLorentzVector.h"
-#pragma warning (pop)
 #include "TMath.h"
 #include "TH2F.h"
 #include "TH1F.h"
-#include "TRandom.h"
+#include "TRandom3.h"
 #include "TFile.h"
 #include "TGraphAsymmErrors.h"
 #include "TTree.h"
 #include "TSystem.h"
+#include "TROOT.h"
+#include "RVersion.h"
 
 #include <iostream>
 #include <string>
 #include <vector>
 #include <sstream>
 #include <fstream>
+#include <iomanip>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 using namespace Wild::CommandLine;
@@ -55,32 +66,63 @@ size_t tau_loops(double ctau) {
 	return n_tau_loops_at_gen;
 }
 #endif
+// Toys per event when only doing Lxy scaling
+size_t n_tau_loops_lxy = 100;
+// Toys per event in each batch, and the fewest batches, when the number of toys is adaptive
+size_t n_toy_batch = 20;
+size_t n_min_toy_batches = 3;
 // For the study for the number of loops, see the logbook. But this will affect if the extrap
 // at each lifetime stablieses, so change it with care.
 
 enum BetaShapeType
 {
 	FromMC,		// Uses the MC input files to derive the MC beta shape in each region
-	Unity		// Does weighting by only Lxy
+	Unity,		// Does weighting by only Lxy
+	TruthReweight	// Reweights each generated event to the new lifetime using its truth Lxy
 };
 
 // Helper methods
 struct extrapolate_config {
 	string _muon_tree_root_file;
+	string _event_cache; // If not empty, read the events from (or write them to) this event cache
+	bool _sharded; // Only do one shard of the lifetime bins (see MergeExtrapolation)
+	int _shard_index;
+	int _n_shards;
 	string _output_filename;
 	double _tau_gen;
 	BetaShapeType _beta_type;
+	unsigned int _n_threads; // How many threads to spread the lifetime points over
+	unsigned long _seed; // Base random number seed. Each lifetime point gets its own stream derived from this.
+	bool _lxy_bilinear; // Interpolate the Lxy efficiency between bins rather than smoothing it
+	bool _common_random; // Do all lifetimes in one pass over the events with common random numbers
+	bool _analytic; // Calculate the expectation over the decay distribution exactly, rather than with toys
+	double _toy_precision; // If > 0, throw toys until each region's efficiency has this relative error
+	size_t _max_toys; // The most toys per event per lifetime when the toys are adaptive
+	bool _resume; // Carry on from the checkpoint of an earlier run that was killed
+	size_t _ctau_shape_every; // Save the ctau pT ratio shapes at every n'th lifetime point (0 for none)
+	decay_toy_kernel::sampling _sampling; // How the decay toys are drawn
+	bool _compare_sampling; // Only compare how the two kinds of toy sampling converge
 };
 extrapolate_config parse_command_line(int argc, char **argv);
 variable_binning_builder PopulateTauTable();
-pair<vector<unique_ptr<TH2F>>, unique_ptr<TH2F>> GetFullPtShape(double tau, int ntauloops, const muon_tree_processor &mc_entries, const Lxy_weight_calculator &lxyWeight);
-template<class T> vector<unique_ptr<T>> DivideShape(
-	const pair<vector<unique_ptr<T>>, unique_ptr<T>> &r,
-	const string &name, const string &title);
-vector<doubleError> CalcPassedEvents(const muon_tree_processor &reader, const vector<unique_ptr<TH2F>> &weightHist, bool eventCountOnly = false);
-vector<doubleError> CalcPassedEventsLxy(const muon_tree_processor &reader, double lifetime, Lxy_weight_calculator &lxyWeight);
-vector<doubleError> GenericCalcPassedEvents(const muon_tree_processor &reader, bool ignore_preselection = false);
-std::pair<Double_t, Double_t> getBayes(const doubleError &num, const doubleError &den);
+variable_binning_builder PopulatePTBinning();
+pair<vector<weighted_histogram_2D>, weighted_histogram_2D> GetFullPtShape(double tau, toy_batches &batches, decay_toy_kernel::sampling how, const muon_tree_processor &mc_entries, const Lxy_weight_calculator &lxyWeight, unsigned int seed, const work_stealing_pool &pool);
+pair<vector<weighted_histogram_2D>, weighted_histogram_2D> GetFullPtShapeAnalytic(double tau, int ntauloops, const muon_tree_processor &mc_entries, const Lxy_weight_calculator &lxyWeight);
+vector<weighted_histogram_2D> DivideShape(const pair<vector<weighted_histogram_2D>, weighted_histogram_2D> &r);
+void AddShapeToFile(TFile &f, const vector<weighted_histogram_2D> &shape, const string &name, const string &title);
+vector<doubleError> CalcPassedEvents(const muon_tree_processor &reader, const vector<weighted_histogram_2D> &weightHist, bool eventCountOnly = false);
+vector<doubleError> CalcPassedEventsLxy(const muon_tree_processor &reader, double lifetime, const Lxy_weight_calculator &lxyWeight, toy_batches &batches, decay_toy_kernel::sampling how, unsigned int seed, const work_stealing_pool &pool);
+void CompareSampling(const muon_tree_processor &reader, const Lxy_weight_calculator &lxyWeight, const extrapolate_config &config, const work_stealing_pool &pool);
+toy_batches make_toy_batches(const extrapolate_config &config, size_t n_toys);
+bool keep_ctau_shape(const extrapolate_config &config, size_t i_tau);
+vector<doubleError> CalcPassedEventsLxyAnalytic(const muon_tree_processor &reader, double lifetime, const Lxy_weight_calculator &lxyWeight);
+vector<doubleError> CalcPassedEventsReweighted(const muon_tree_processor &reader, double lifetime, double lifetime_gen);
+struct setup_sums {
+	vector<doubleError> passed; // Events in each region at generation (what CalcPassedEvents gives with no weights)
+	vector<doubleError> generated; // All events, preselected or not (what CalcPassedEvents gives for a count)
+	vector<doubleError> cross_check; // Events in each region, ignoring the preselection
+};
+setup_sums RunSetupPass(const muon_tree_processor &reader, Lxy_weight_calculator2D &lxyWeight);
 bool doMCPreselection(const muon_tree_processor::eventInfo &entry);
 void SetAsymError(unique_ptr<TGraphAsymmErrors> &g, int bin, double tau, double bvalue, const pair<double, double> &assErrors);
 
@@ -99,28 +141,106 @@ int main(int argc, char**argv)
 		// Pull out the various command line arguments
 		auto config = parse_command_line(argc, argv);
 		cout << "TTree input: " << config._muon_tree_root_file << endl;
+		if (config._event_cache.size() > 0) {
+			cout << "Event cache: " << config._event_cache << endl;
+		}
 		cout << "Output file: " << config._output_filename << endl;
 		cout << "Generated lifetime: " << config._tau_gen << endl;
 		cout << "We are using pt-based extrapolation: " << (config._beta_type == BetaShapeType::FromMC ? "yes" : "no") << endl;
+		cout << "We are reweighting the generated events by lifetime: " << (config._beta_type == BetaShapeType::TruthReweight ? "yes" : "no") << endl;
+		cout << "Threads: " << config._n_threads << " Random seed: " << config._seed << endl;
+		cout << "Single pass with common random numbers: " << (config._common_random ? "yes" : "no") << endl;
+		cout << "Analytic expectation instead of toys: " << (config._analytic ? "yes" : "no") << endl;
+		cout << "Decay toy sampling: " << decay_toy_kernel::sampling_name(config._sampling) << endl;
+		if (config._sharded) {
+			cout << "Lifetime shard " << config._shard_index << " of " << config._n_shards << endl;
+		}
+		if (config._resume) {
+			cout << "Resuming from the checkpoint " << config._output_filename << ".checkpoint" << endl;
+		}
+		if (config._toy_precision > 0.0) {
+			cout << "Adaptive toys: target relative error " << config._toy_precision << ", at most " << config._max_toys << " toys per event" << endl;
+		}
 
-		// Create the muon tree reader object.
-		muon_tree_processor reader (config._muon_tree_root_file);
-		reader.add_preselection([](const muon_tree_processor::eventInfo &e) {return doMCPreselection(e); });
+		// We manage the lifetime of every histogram we create, so keep ROOT from tracking them
+		// in its global directory (that bookkeeping isn't thread safe, and causes name clashes).
+		TH1::AddDirectory(kFALSE);
+		if (config._n_threads > 1) {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,0,0)
+			ROOT::EnableThreadSafety();
+#endif
+		}
+
+		// Create the muon tree reader object. This loads the whole tree into memory, and
+		// it can then be shared by all the threads.
+		muon_tree_processor reader (config._muon_tree_root_file, config._event_cache);
+		reader.add_preselection("MC", [](const muon_tree_processor::eventInfo &e) {return doMCPreselection(e); });
+		reader.index_pt_bins(PopulatePTBinning());
+		cout << "Loaded " << reader.n_events() << " events, " << reader.n_preselected() << " pass the preselection" << endl;
+		cout << "Decay toys use the " << decay_toy_kernel::level_name(decay_toy_kernel::best_level()) << " kernel" << endl;
 
 		// The Lxy efficiency histogram has to be calculated next. We do it with a "denominator", to make sure that we
-		// only are looking at things that are possible.
-		Lxy_weight_calculator2D lxy_weight(reader);
+		// only are looking at things that are possible. The same pass over the events counts the events at generation.
+		Lxy_weight_calculator2D lxy_weight(config._lxy_bilinear);
+		auto setup = RunSetupPass(reader, lxy_weight);
+		lxy_weight.finish();
+
+		if (config._compare_sampling) {
+			work_stealing_pool compare_pool(config._n_threads);
+			CompareSampling(reader, lxy_weight, config, compare_pool);
+			return 0;
+		}
 
 		// Create the histograms we will use to store the raw results.
 		auto tau_binning = PopulateTauTable();
-		vector<TH1F*> h_res_eff;
+
+		// The lifetime bins this job does: all of them, or every N'th one for a shard. Each bin has
+		// its own random number stream, so a bin comes out the same whichever shard does it.
+		vector<size_t> shard_taus;
+		for (size_t i_tau = 0; i_tau < (size_t)tau_binning.nbin(); i_tau++) {
+			if ((int)(i_tau % config._n_shards) == config._shard_index) {
+				shard_taus.push_back(i_tau);
+			}
+		}
+
+		// Everything about the setup that changes the result at a lifetime point. The shards of a run
+		// must all agree on it, and MergeExtrapolation checks they do.
+		vector<double> shard_setup = { config._tau_gen, (double)config._seed, (double)config._beta_type, (double)config._lxy_bilinear,
+			(double)config._common_random, (double)config._analytic, config._toy_precision, (double)config._max_toys,
+			(double)config._n_shards, (double)tau_binning.nbin(), (double)config._ctau_shape_every,
+			(double)config._sampling };
+
+		// Each lifetime point is checkpointed as it finishes. When resuming, only the points that
+		// the earlier run didn't get to are left to do.
+		auto setup_key = shard_setup;
+		setup_key.push_back((double)config._shard_index);
+		tau_checkpoint checkpoint(config._output_filename + ".checkpoint", tau_checkpoint::setup_key(setup_key, config._muon_tree_root_file),
+			config._resume, PopulatePTBinning());
+		auto resumed = checkpoint.take_done();
+		vector<bool> tau_done(tau_binning.nbin(), false);
+		for (const auto &p : resumed) {
+			if (p.i_tau >= tau_done.size()) {
+				throw runtime_error("The checkpoint has a lifetime point that isn't in the lifetime binning");
+			}
+			tau_done[p.i_tau] = true;
+		}
+		vector<size_t> todo_taus;
+		for (auto i_tau : shard_taus) {
+			if (!tau_done[i_tau]) {
+				todo_taus.push_back(i_tau);
+			}
+		}
+		if (config._resume) {
+			cout << resumed.size() << " lifetime points were already done, " << todo_taus.size() << " left to do" << endl;
+		}
+		vector<unique_ptr<TH1F>> h_res_eff;
 		vector<unique_ptr<TGraphAsymmErrors>> g_res_eff;
 
 		for (int i_region = 0; i_region < 4; i_region++) {
 			//Efficiency VS lifetime
 			ostringstream name_h;
 			name_h << "h_res_eff_" << (char) ('A' + i_region);
-			h_res_eff.push_back(new TH1F(name_h.str().c_str(), name_h.str().c_str(), tau_binning.nbin(), tau_binning.bin_list()));
+			h_res_eff.push_back(make_unique<TH1F>(name_h.str().c_str(), name_h.str().c_str(), tau_binning.nbin(), tau_binning.bin_list()));
 
 			g_res_eff.push_back(make_unique<TGraphAsymmErrors>(tau_binning.nbin()));
 			ostringstream name_g;
@@ -131,20 +251,44 @@ int main(int argc, char**argv)
 			g_res_eff[i_region]->SetTitle(title_g.str().c_str());
 		}
 
+		work_stealing_pool pool(config._n_threads);
+
+		// With common random numbers, all the toys are done up front in a single pass over the events.
+		// Entry 0 is the generated lifetime, entry i+1 the i'th lifetime point left to do.
+		unique_ptr<common_random_scan> crn_scan;
+		if (config._common_random) {
+			vector<double> taus;
+			taus.push_back(config._tau_gen);
+			for (auto i_tau : todo_taus) {
+				taus.push_back(h_res_eff[0]->GetBinCenter(i_tau + 1));
+			}
+			bool pt_shapes = config._beta_type == BetaShapeType::FromMC;
+			crn_scan = make_unique<common_random_scan>(taus, pt_shapes ? n_tau_loops_at_gen : n_tau_loops_lxy, config._sampling, pt_shapes, PopulatePTBinning());
+			crn_scan->run(reader, lxy_weight, stream_seed(config._seed, 0), pool);
+			cout << "Finished the single pass over all " << taus.size() << " lifetimes" << endl;
+		}
+
 		// How often, for the generated sample, a pair of pt1, pt2 vpions reaches the HCal.
 		// This is done at generation lifetime, so this will be the baseline which we scale against
 		// in the tau loop below.
-		vector<unique_ptr<TH2F>> h_gen_ratio;
+		vector<weighted_histogram_2D> h_gen_ratio;
+		size_t n_toys_at_gen = 0;
+		// Random stream 0 is used here, stream i_tau+1 for each lifetime point below.
 		if (config._beta_type == BetaShapeType::FromMC) {
-			auto r = GetFullPtShape(config._tau_gen, n_tau_loops_at_gen, reader, lxy_weight);
-			h_gen_ratio = DivideShape(r, "h_Ngen_ratio", "Fraction of events in pT space at raw generated ctau");
+			// Only one lifetime, so the events are split over the threads.
+			auto batches = make_toy_batches(config, n_tau_loops_at_gen);
+			auto r = crn_scan ? crn_scan->pt_shape(0)
+				: config._analytic ? GetFullPtShapeAnalytic(config._tau_gen, n_tau_loops_at_gen, reader, lxy_weight)
+				: GetFullPtShape(config._tau_gen, batches, config._sampling, reader, lxy_weight, stream_seed(config._seed, 0), pool);
+			n_toys_at_gen = crn_scan ? n_tau_loops_at_gen : batches.n_toys();
+			h_gen_ratio = DivideShape(r);
 		}
 
 		// And how many events actually are in the signal regions at generation?
-		auto passedEventsAtGen = CalcPassedEvents(reader, vector<unique_ptr<TH2F>>(), false);
+		auto &passedEventsAtGen = setup.passed;
 
 		// Count the total number of events, taking into account all weighting (like pileup, etc.).
-		auto generatedEventsWithWeightsInRegions = CalcPassedEvents(reader, vector<unique_ptr<TH2F>>(), true);
+		auto &generatedEventsWithWeightsInRegions = setup.generated;
 		auto totalGeneratedEvents = generatedEventsWithWeightsInRegions[0];
 		cout << " Total Generated Events: " << totalGeneratedEvents << endl;
 		for (int i = 0; i < 4; i++) {
@@ -152,65 +296,176 @@ int main(int argc, char**argv)
 		}
 		
 		// Next, do a double check to make sure our preselection isn't eliminating any of our signal.
-		auto crossCheckNumberOfEventsInRegions = GenericCalcPassedEvents(reader, true);
+		auto &crossCheckNumberOfEventsInRegions = setup.cross_check;
 		for (int i = 0; i < 4; i++) {
 			if (crossCheckNumberOfEventsInRegions[i] != passedEventsAtGen[i]) {
 				cout << " ** ERROR - in region " << i << " the number of events passed " << crossCheckNumberOfEventsInRegions[i] << " does not match number after preselection " << passedEventsAtGen[i] << endl;
 			}
 		}
 
-		// Loop over proper lifetime
-		vector<vector<unique_ptr<TH2F> > > ctau_cache; // Cache of ctau pt plots to be written out later.
-		for (unsigned int i_tau = 0; i_tau < tau_binning.nbin(); i_tau++) {
+		// Loop over proper lifetime. Each lifetime point is independent (and has its own random
+		// number stream), so they are spread over the threads. Results are identical no matter how
+		// many threads are used.
+		struct tau_point_result {
+			vector<doubleError> passedEvents;
+			vector<weighted_histogram_2D> ctau_ratio;
+			size_t n_toys = 0; // Toys per event actually thrown
+		};
+		vector<tau_point_result> tau_results(tau_binning.nbin());
+
+		// Each lifetime point goes into the output file as soon as it (and every point before it) is
+		// done, and its pT shapes are let go of, so memory doesn't grow with the number of lifetimes.
+		auto output_file = unique_ptr<TFile>(TFile::Open(config._output_filename.c_str(), "RECREATE"));
+		auto h_n_toys = make_unique<TH1F>("n_toys_used", "Toys thrown per event; ctau [m]; Toys", tau_binning.nbin(), tau_binning.bin_list());
+		auto h_tau_done = make_unique<TH1F>("tau_bins_done", "Lifetime bins done by this shard; ctau [m]", tau_binning.nbin(), tau_binning.bin_list());
+		tau_point_writer writer(shard_taus, [&](size_t i_tau) {
+			auto tau = h_res_eff[0]->GetBinCenter(i_tau+1); // Recal ROOT indicies bins at 1
+			auto &result = tau_results[i_tau];
+			h_n_toys->SetBinContent(i_tau + 1, result.n_toys);
+			h_tau_done->SetBinContent(i_tau + 1, 1.0);
+			const auto &passedEventsAtTau = result.passedEvents;
+			if (result.ctau_ratio.size() > 0) {
+				ostringstream ctau_ratio_name;
+				ctau_ratio_name << "h_ctau_ratio_" << tau << "_";
+				AddShapeToFile(*output_file, result.ctau_ratio, ctau_ratio_name.str(), ctau_ratio_name.str());
+				result.ctau_ratio = vector<weighted_histogram_2D>();
+			}
+
+			// Calculate proper asymmetric errors and save the extrapolation result for the change in efficency.
+			double num[4], num_err2[4], den[4], den_err2[4];
+			for (int i_region = 0; i_region < 4; i_region++) {
+				num[i_region] = passedEventsAtTau[i_region].value();
+				num_err2[i_region] = passedEventsAtTau[i_region].err2();
+				den[i_region] = totalGeneratedEvents.value();
+				den_err2[i_region] = totalGeneratedEvents.err2();
+			}
+			bayes_interval bayes[4];
+			bayes_efficiency_intervals(4, num, num_err2, den, den_err2, bayes);
+			for (int i_region = 0; i_region < 4; i_region++) {
+				doubleError eff = passedEventsAtTau[i_region] / totalGeneratedEvents;
+				std::pair<Double_t, Double_t> bayerr_sig_perc(bayes[i_region].low, bayes[i_region].high);
+				Double_t erro = (bayerr_sig_perc.first + bayerr_sig_perc.second)*0.5;
+
+				h_res_eff[i_region]->SetBinContent(i_tau + 1, eff.value());
+				h_res_eff[i_region]->SetBinError(i_tau + 1, erro);
+				SetAsymError(g_res_eff[i_region], i_tau, tau, eff.value(), bayerr_sig_perc);
+			}
+
+			cout << " tau = " << tau << " npassed = " << passedEventsAtTau[0] << " passed tau/gen = " << passedEventsAtTau[0] / passedEventsAtGen[0] << " global eff = " << passedEventsAtTau[0] / totalGeneratedEvents << endl;
+		});
+
+		// The points from the checkpoint go first.
+		for (auto &p : resumed) {
+			auto &result = tau_results[p.i_tau];
+			for (int i_region = 0; i_region < 4; i_region++) {
+				result.passedEvents.push_back(doubleError(true, p.passed[i_region], p.passed_err2[i_region]));
+			}
+			result.ctau_ratio = move(p.ctau_ratio);
+			result.n_toys = p.n_toys;
+			writer.finished(p.i_tau);
+		}
+		size_t n_resumed = resumed.size();
+		resumed.clear();
+
+		mutex progress_lock;
+		size_t n_tau_done = n_resumed;
+
+		// The points are started in lifetime order, and a thread waits before starting one that is too far
+		// ahead of the next to be written, so only a couple of points per thread are ever held in memory.
+		size_t next_point = 0;
+		const size_t max_ahead = 2 * pool.n_threads();
+		condition_variable writer_moved;
+
+		// The threads are already busy with the lifetimes, so each lifetime goes through the events serially.
+		work_stealing_pool serial_pool(1);
+		pool.run(todo_taus.size(), [&](size_t, unsigned int) {
+			size_t i_point, i_tau;
+			{
+				unique_lock<mutex> l(progress_lock);
+				i_point = next_point++;
+				i_tau = todo_taus[i_point];
+				writer_moved.wait(l, [&] { return writer.can_start(i_tau, max_ahead); });
+			}
 			auto tau = h_res_eff[0]->GetBinCenter(i_tau+1); // Recal ROOT indicies bins at 1
+			auto seed = stream_seed(config._seed, i_tau + 1);
 
-			vector<doubleError> passedEventsAtTau;
+			auto &result = tau_results[i_tau];
 			if (config._beta_type == BetaShapeType::FromMC) {
 				// Get the full pT shape
-				auto rtau = GetFullPtShape(tau, tau_loops(tau), reader, lxy_weight);
-				ostringstream ctau_ratio_name;
-				ctau_ratio_name << "h_ctau_ratio_" << tau << "_";
-				auto h_caut_ratio = DivideShape(rtau, ctau_ratio_name.str(), ctau_ratio_name.str());
+				auto batches = make_toy_batches(config, tau_loops(tau));
+				auto rtau = crn_scan ? crn_scan->pt_shape(i_point + 1)
+					: config._analytic ? GetFullPtShapeAnalytic(tau, tau_loops(tau), reader, lxy_weight)
+					: GetFullPtShape(tau, batches, config._sampling, reader, lxy_weight, seed, serial_pool);
+				result.n_toys = crn_scan ? tau_loops(tau) : batches.n_toys();
+				auto h_caut_ratio = DivideShape(rtau);
 
 				// Now, create a weighting histogram. This is just the differece between the numerators at the
 				// extrapolated ctau and at the generated ctau
-				decltype(h_caut_ratio) h_Nratio;
+				auto h_Nratio = h_caut_ratio;
 				for (int i_region = 0; i_region < 4; i_region++) {
-					auto h = unique_ptr<TH2F>(static_cast<TH2F*>(h_caut_ratio[i_region]->Clone()));
-					h->Divide(h_gen_ratio[i_region].get());
-					h_Nratio.push_back(move(h));
+					h_Nratio[i_region].divide(h_gen_ratio[i_region]);
 				}
 
-				if (i_tau % 1 == 0) {
-					ctau_cache.push_back(move(h_caut_ratio));
+				if (keep_ctau_shape(config, i_tau)) {
+					result.ctau_ratio = move(h_caut_ratio);
 				}
 
 				// The the number of events that passed for this lifetime.
-				passedEventsAtTau = CalcPassedEvents(reader, h_Nratio, false);
+				result.passedEvents = CalcPassedEvents(reader, h_Nratio, false);
+			}
+			else if (config._beta_type == BetaShapeType::TruthReweight) {
+				// No toys, each event just gets a new weight
+				result.passedEvents = CalcPassedEventsReweighted(reader, tau, config._tau_gen);
 			}
 			else {
 				// Just do Lxy scaling
-				passedEventsAtTau = CalcPassedEventsLxy(reader, tau, lxy_weight);
+				if (crn_scan) {
+					auto passed = crn_scan->passed_events(i_point + 1);
+					result.passedEvents = vector<doubleError>(passed.begin(), passed.end());
+					result.n_toys = n_tau_loops_lxy;
+				}
+				else if (config._analytic) {
+					result.passedEvents = CalcPassedEventsLxyAnalytic(reader, tau, lxy_weight);
+				}
+				else {
+					auto batches = make_toy_batches(config, n_tau_loops_lxy);
+					result.passedEvents = CalcPassedEventsLxy(reader, tau, lxy_weight, batches, config._sampling, seed, serial_pool);
+					result.n_toys = batches.n_toys();
+				}
 			}
 
-			// Calculate proper asymmetric errors and save the extrapolation result for the change in efficency.
+			tau_checkpoint::point p;
+			p.i_tau = i_tau;
+			p.n_toys = result.n_toys;
 			for (int i_region = 0; i_region < 4; i_region++) {
-				doubleError eff = passedEventsAtTau[i_region] / totalGeneratedEvents;
-				std::pair<Double_t, Double_t> bayerr_sig_perc = getBayes(passedEventsAtTau[i_region], totalGeneratedEvents);
-				Double_t erro = (bayerr_sig_perc.first + bayerr_sig_perc.second)*0.5;
-
-				h_res_eff[i_region]->SetBinContent(i_tau + 1, eff.value());
-				h_res_eff[i_region]->SetBinError(i_tau + 1, erro);
-				SetAsymError(g_res_eff[i_region], i_tau, tau, eff.value(), bayerr_sig_perc);
+				p.passed[i_region] = result.passedEvents[i_region].value();
+				p.passed_err2[i_region] = result.passedEvents[i_region].err2();
 			}
-
-			cout << " tau = " << tau << " npassed = " << passedEventsAtTau[0] << " passed tau/gen = " << passedEventsAtTau[0] / passedEventsAtGen[0] << " global eff = " << passedEventsAtTau[0] / totalGeneratedEvents << endl;
+			p.ctau_ratio = result.ctau_ratio;
+
+			lock_guard<mutex> l(progress_lock);
+			checkpoint.add(p);
+			n_tau_done++;
+			cout << " finished tau = " << tau << " with " << result.n_toys << " toys per event (" << n_tau_done << " of " << shard_taus.size() << ")" << endl;
+			writer.finished(i_tau);
+			writer_moved.notify_all();
+		});
+		if (!writer.all_written()) {
+			throw runtime_error("Not every lifetime point was written out");
 		}
 
 		// Save plots in the output file
-		auto output_file = unique_ptr<TFile>(TFile::Open(config._output_filename.c_str(), "RECREATE"));
 		for (int i_region = 0; i_region < 4; i_region++) {
-			output_file->Add(h_res_eff[i_region]);
+			output_file->WriteTObject(h_res_eff[i_region].get());
+			output_file->Add(g_res_eff[i_region].release());
+		}
+		output_file->WriteTObject(h_n_toys.get());
+
+		// A shard also records which shard it is, and which bins it did, for MergeExtrapolation.
+		if (config._sharded) {
+			output_file->Add(save_as_histo("tau_shard", vector<double>{ (double)config._shard_index, (double)config._n_shards }).release());
+			output_file->Add(save_as_histo("shard_setup", shard_setup).release());
+			output_file->WriteTObject(h_tau_done.get());
 		}
 
 		// Save the Lxy efficiency plot
@@ -218,24 +473,14 @@ int main(int argc, char**argv)
 			output_file->Add(lxy_weight.clone_weight(i).release());
 		}
 
-		// The default as-generated pT shape, along with a few check-points.
+		// The default as-generated pT shape (the check-points at other lifetimes are already written).
 		if (config._beta_type == BetaShapeType::FromMC) {
-			for (int i = 0; i < 4; i++) {
-				auto h = static_cast<TH2F*>(h_gen_ratio[i]->Clone());
-				h->SetDirectory(nullptr);
-				output_file->Add(h);
-			}
-			for (const auto &ctaus : ctau_cache) {
-				for (int i = 0; i < 4; i++) {
-					auto h = static_cast<TH2F*>(ctaus[i]->Clone());
-					h->SetDirectory(nullptr);
-					output_file->Add(h);
-				}
-			}
+			AddShapeToFile(*output_file, h_gen_ratio, "h_Ngen_ratio", "Fraction of events in pT space at raw generated ctau");
 		}
 
 		// Save basic information for the generated sample.
 		output_file->Add(save_as_histo("generated_ctau", config._tau_gen).release());
+		output_file->Add(save_as_histo("n_toys_used_as_generated", n_toys_at_gen).release());
 		output_file->Add(save_as_histo("n_passed_as_generated", passedEventsAtGen).release());
 		output_file->Add(save_as_histo("n_as_generated", generatedEventsWithWeightsInRegions).release());
 
@@ -246,6 +491,10 @@ int main(int argc, char**argv)
 		output_file->Add(save_as_histo("eff_as_generated", effAtGen).release());
 
 		output_file->Write();
+		output_file->Close();
+
+		// Everything is safely in the output file now.
+		checkpoint.remove();
 	}
 	catch (exception &e)
 	{
@@ -270,6 +519,20 @@ extrapolate_config parse_command_line(int argc, char **argv)
 
 		// Options
 		Flag("UseFlatBeta", "b", "Use only Lxy to do the extrapolation"),
+		Flag("TruthReweight", "w", "Reweight each generated event to the new lifetime using its truth Lxy"),
+		Flag("LxyInterpolate", "l", "Bilinear interpolation of the Lxy efficiency instead of smoothing it"),
+		Flag("CommonRandom", "r", "Do all lifetimes in a single pass over the events, with common random numbers"),
+		Flag("analytic", "a", "Calculate the expected weight over the decay distribution exactly, with no toys"),
+		Arg("toyPrecision", "p", "Throw toys in batches until each region's efficiency has this relative error (default: a fixed number of toys)", Ordinality::Optional),
+		Arg("maxToys", "x", "The most toys per event per lifetime with toyPrecision (default 2000)", Ordinality::Optional),
+		Arg("eventCache", "k", "Read the events from this event cache, making it from muonTreeFile first if it is missing or out of date", Ordinality::Optional),
+		Arg("tauShard", "j", "Only do shard i of N of the lifetime bins, given as i/N (0 <= i < N). Combine the shards with MergeExtrapolation", Ordinality::Optional),
+		Flag("resume", "e", "Carry on from the checkpoint left by an earlier run of this job that was killed, skipping the lifetimes it finished"),
+		Arg("ctauShapeEvery", "n", "Save the ctau pT ratio shapes at every n'th lifetime point (default 1, all of them; 0 for none)", Ordinality::Optional),
+		Flag("Sobol", "q", "Draw the decay toys from a randomly shifted Sobol sequence, which converges faster than independent random numbers"),
+		Flag("compareSampling", "g", "Compare how the passed events converge with random and Sobol toys at the generated lifetime, then stop"),
+		Arg("threads", "t", "Number of threads to spread the lifetime points over (default 1)", Ordinality::Optional),
+		Arg("seed", "s", "Random number seed. Results only depend on this, not on the number of threads (default 4357)", Ordinality::Optional),
 	});
 
 	// Make sure we got all the command line arguments we need
@@ -282,9 +545,64 @@ extrapolate_config parse_command_line(int argc, char **argv)
 
 	extrapolate_config r;
 	r._muon_tree_root_file = args.Get("muonTreeFile");
+	r._event_cache = args.IsSet("eventCache") ? args.Get("eventCache") : "";
+	r._sharded = args.IsSet("tauShard");
+	r._shard_index = 0;
+	r._n_shards = 1;
+	if (r._sharded) {
+		char slash = 0;
+		istringstream shard(args.Get("tauShard"));
+		shard >> r._shard_index >> slash >> r._n_shards;
+		if (!shard || slash != '/' || !shard.eof() || r._n_shards < 1 || r._shard_index < 0 || r._shard_index >= r._n_shards) {
+			throw runtime_error("The lifetime shard must be given as i/N, with 0 <= i < N");
+		}
+	}
 	r._output_filename = args.Get("output");
 	r._tau_gen = args.GetAsFloat("ctau");
-	r._beta_type = args.IsSet("UseFlatBeta") ? BetaShapeType::Unity : BetaShapeType::FromMC;
+	r._beta_type = args.IsSet("UseFlatBeta") ? BetaShapeType::Unity
+		: args.IsSet("TruthReweight") ? BetaShapeType::TruthReweight
+		: BetaShapeType::FromMC;
+	r._n_threads = args.IsSet("threads") ? args.GetAsInt("threads") : 1;
+	r._seed = args.IsSet("seed") ? args.GetAsInt("seed") : 4357;
+	r._lxy_bilinear = args.IsSet("LxyInterpolate");
+	r._common_random = args.IsSet("CommonRandom");
+	r._analytic = args.IsSet("analytic");
+	r._toy_precision = args.IsSet("toyPrecision") ? args.GetAsFloat("toyPrecision") : 0.0;
+	r._max_toys = args.IsSet("maxToys") ? args.GetAsInt("maxToys") : 2000;
+	r._resume = args.IsSet("resume");
+	r._ctau_shape_every = args.IsSet("ctauShapeEvery") ? args.GetAsInt("ctauShapeEvery") : 1;
+	r._sampling = args.IsSet("Sobol") ? decay_toy_kernel::sampling::sobol : decay_toy_kernel::sampling::pseudo_random;
+	r._compare_sampling = args.IsSet("compareSampling");
+
+	if (args.IsSet("toyPrecision") && r._toy_precision <= 0.0) {
+		throw runtime_error("The toy precision must be positive");
+	}
+	if (args.IsSet("ctauShapeEvery") && args.GetAsInt("ctauShapeEvery") < 0) {
+		throw runtime_error("ctauShapeEvery can't be negative");
+	}
+	if (args.IsSet("maxToys") && args.GetAsInt("maxToys") < (int)n_toy_batch) {
+		throw runtime_error("The maximum number of toys must be at least one batch");
+	}
+	if (r._toy_precision > 0.0 && (r._analytic || r._common_random || args.IsSet("TruthReweight"))) {
+		throw runtime_error("Adaptive toys can't be combined with -a, -r, or -w");
+	}
+
+	if (args.IsSet("TruthReweight") && (args.IsSet("UseFlatBeta") || r._analytic || r._common_random)) {
+		throw runtime_error("Reweighting by the truth Lxy throws no toys, it can't be combined with -b, -a, or -r");
+	}
+	if ((args.IsSet("Sobol") || r._compare_sampling) && (r._analytic || args.IsSet("TruthReweight"))) {
+		throw runtime_error("Sobol toys, or comparing them, can't be combined with -a or -w, which throw no toys");
+	}
+	if (r._analytic && r._common_random) {
+		throw runtime_error("The analytic mode uses no toys, so it can't be combined with common random numbers");
+	}
+	if (r._analytic && r._lxy_bilinear) {
+		throw runtime_error("The analytic mode needs the binned Lxy efficiency, it can't be used with interpolation");
+	}
+
+	if (args.IsSet("threads") && args.GetAsInt("threads") < 1) {
+		throw runtime_error("The number of threads must be at least 1");
+	}
 
 	return r;
 }
@@ -339,255 +657,412 @@ bool doMCPreselection(const muon_tree_processor::eventInfo &entry)
 		&& entry.vpi2_pt / 1000.0 > ptCut;
 }
 
-// Sample from the proper lifetime tau for a specific lifetime, and then do the special relativity
-// calculation to understand where it ended up.
-// tau - is in units of meters.
-bool doSR(const caching_tlz &vpi1, const caching_tlz &vpi2, Double_t tau, Double_t &L2D1, Double_t &L2D2) {
-
-	auto beta1 = vpi1.Beta();
-	auto beta2 = vpi2.Beta();
-	Double_t gamma1 = vpi1.Gamma();
-	Double_t gamma2 = vpi2.Gamma();
-
-	// Get ctau of the two we are to simulate, in meters.
-	Double_t ct1 = gRandom->Exp(tau);
-	Double_t ct2 = gRandom->Exp(tau);
-
-	// What is the decay length in the lab frame (in meters)?
-	Double_t ct1prime = gamma1 * ct1;
-	Double_t ct2prime = gamma2 * ct2;
-	Double_t lxy1 = beta1 * ct1prime;
-	Double_t lxy2 = beta2 * ct2prime;
-
-	Double_t theta1 = vpi1.Theta();
-	Double_t theta2 = vpi2.Theta();
-
-	TVector3 vpixyz1, vpixyz2;
-	vpixyz1.SetMagThetaPhi(lxy1, theta1, vpi1.Phi());
-	vpixyz2.SetMagThetaPhi(lxy2, theta2, vpi2.Phi());
-
-	L2D1 = vpixyz1.Perp();
-	L2D2 = vpixyz2.Perp();
-
-#if TIMINGNEEDED
-	// Useing the pT plot to account for timing.
-
-	// Calculate the timing in nano-seconds.
-	Double_t lighttime1 = lxy1 / 2.9979E8 * 1E9;
-	Double_t lighttime2 = lxy2 / 2.9979E8 * 1E9;
-	Double_t timing1 = ct1prime / 2.9979E8 * 1E9;
-	Double_t timing2 = ct2prime / 2.9979E8 * 1E9;
-	Double_t deltat1 = timing1 - lighttime1;
-	Double_t deltat2 = timing2 - lighttime2;
-
-	// Timing restrictions. This first test should never fire
-	// because there is no way for the particle to go faster than "c", and
-	// that is the only way to have negative timing. But we keep it here for completness
-	// sake.
-	if (deltat1 < -3.0 || deltat2 < -3.0) {
-		return false;
+// The empty numerator (one per region) and denominator pT shapes.
+pair<vector<weighted_histogram_2D>, weighted_histogram_2D> MakePtShape()
+{
+	auto pt_binning = PopulatePTBinning();
+	weighted_histogram_2D den(pt_binning.edges(), pt_binning.edges());
+	return make_pair(vector<weighted_histogram_2D>(4, den), den);
+}
+
+// The toys for one chunk of the events, during an event-parallel pass. Each chunk has its own random
+// number stream and its own sums (and pT shapes, if asked for), which are added up once all the chunks are done.
+class toy_pass_chunk
+{
+public:
+	toy_pass_chunk(double tau, size_t n_toys, decay_toy_kernel::sampling how, const Lxy_weight_calculator &lxyWeight, unsigned int seed, bool pt_shapes)
+		: _tau(tau), _lxyWeight(&lxyWeight), _pt_shapes(pt_shapes),
+		_rnd(make_unique<TRandom3>(seed)), _toys(make_unique<decay_toy_kernel>(n_toys, how)),
+		n_fills(0.0)
+	{
+		// The pT shapes are only made when they are wanted; otherwise they stay empty.
+		if (_pt_shapes) {
+			shape = MakePtShape();
+		}
+		for (int i_region = 0; i_region < 4; i_region++) {
+			sums[i_region] = 0.0;
+		}
 	}
-	if (deltat1 > 15.0 || deltat2 > 15.0) {
-		return false;
+
+	void operator() (const muon_tree_processor::eventInfo &entry)
+	{
+		// Do SR for all the toys at once, apply SR related cuts (like timing).
+		_toys->generate(entry, _tau, *_rnd);
+		for (size_t i_toy = 0; i_toy < _toys->n_toys(); i_toy++) {
+			if (_toys->passed(i_toy)) {
+				double lxy_w[4];
+				(*_lxyWeight)(_toys->L2D1(i_toy), _toys->L2D2(i_toy), lxy_w);
+				if (_pt_shapes) {
+					shape.second.fill(entry.pt_bin, entry.weight);
+				}
+				for (int i_region = 0; i_region < 4; i_region++) {
+					if (_pt_shapes) {
+						shape.first[i_region].fill(entry.pt_bin, entry.weight * lxy_w[i_region]);
+					}
+					sums[i_region] += entry.weight * lxy_w[i_region];
+				}
+				n_fills++;
+			}
+		}
 	}
 
-#endif
-	return true;
-}
+	toy_pass_chunk &operator+= (const toy_pass_chunk &other)
+	{
+		if (_pt_shapes) {
+			for (int i_region = 0; i_region < 4; i_region++) {
+				shape.first[i_region] += other.shape.first[i_region];
+			}
+			shape.second += other.shape.second;
+		}
+		for (int i_region = 0; i_region < 4; i_region++) {
+			sums[i_region] += other.sums[i_region];
+		}
+		n_fills += other.n_fills;
+		return *this;
+	}
+
+private:
+	double _tau;
+	const Lxy_weight_calculator *_lxyWeight;
+	bool _pt_shapes;
+	unique_ptr<TRandom3> _rnd;
+	unique_ptr<decay_toy_kernel> _toys;
+
+public:
+	pair<vector<weighted_histogram_2D>, weighted_histogram_2D> shape; // Numerators and denominator (empty without pt_shapes)
+	double n_fills; // Toys that passed
+	double sums[4]; // Sum of the weights of the toys, for each region
+};
 
 // Generate a lxy1 and lxy2 set of histograms. The denominator (first item) is
 // the generated ones. The numerator is modified by the acceptance histogram
 // built from the input file.
-pair<vector<unique_ptr<TH2F>>, unique_ptr<TH2F>> GetFullPtShape(double tau, int ntauloops, const muon_tree_processor &mc_entries, const Lxy_weight_calculator &lxyWeight)
+pair<vector<weighted_histogram_2D>, weighted_histogram_2D> GetFullPtShape(double tau, toy_batches &batches, decay_toy_kernel::sampling how, const muon_tree_processor &mc_entries, const Lxy_weight_calculator &lxyWeight, unsigned int seed, const work_stealing_pool &pool)
 {
-	// Create numerator and denominator histograms.
-	// To avoid annoying ROOT error messages, make a unique name for each.
-	ostringstream dname, nname;
-	dname << "tau_" << tau << "_den";
-	nname << "tau_" << tau << "_num";
+	auto shape = MakePtShape();
+	auto &num = shape.first;
+	auto &den = shape.second;
+
+	// Loop over each MC entry, and generate tau's at several different places, a batch at a time
+	// until we have enough. The pT bin of each event was found when the events were loaded.
+	// Each chunk of each batch gets its own random number stream.
+	double n_fills = 0;
+	size_t i_batch = 0;
+	while (!batches.done()) {
+		auto pass = mc_entries.process_all_entries_parallel(pool, [&](size_t chunk) {
+			return toy_pass_chunk(tau, batches.batch_size(), how, lxyWeight, stream_seed(seed, i_batch * muon_tree_processor::n_parallel_chunks + chunk), true);
+		});
 
-	auto pt_binning = PopulatePTBinning();
+		for (int i_region = 0; i_region < 4; i_region++) {
+			num[i_region] += pass.shape.first[i_region];
+		}
+		den += pass.shape.second;
+		n_fills += pass.n_fills;
 
-	unique_ptr<TH2F> den(make_unique<TH2F>(dname.str().c_str(), dname.str().c_str(), pt_binning.nbin(), pt_binning.bin_list(), pt_binning.nbin(), pt_binning.bin_list()));
-	vector<unique_ptr<TH2F>> num;
-	for (int i_region = 0; i_region < 4; i_region++) {
-		nname << "A";
-		num.push_back(make_unique<TH2F>(nname.str().c_str(), nname.str().c_str(), pt_binning.nbin(), pt_binning.bin_list(), pt_binning.nbin(), pt_binning.bin_list()));
-		num[i_region]->Sumw2();
+		double batch_sums[4];
+		for (int i_region = 0; i_region < 4; i_region++) {
+			batch_sums[i_region] = pass.sums[i_region] / batches.batch_size();
+		}
+		batches.add_batch(batch_sums);
+		i_batch++;
+	}
+	den.set_entries(n_fills);
+	for (auto &h : num) {
+		h.set_entries(n_fills);
 	}
-	den->Sumw2();
+	return shape;
+}
 
-	// Loop over each MC entry, and generate tau's at several different places
-	mc_entries.process_all_entries([&den, &num, ntauloops, tau, &lxyWeight](const muon_tree_processor::eventInfo &entry) {
-		TLorentzVector vpi1_tlz, vpi2_tlz;
-		auto pt1 = entry.vpi1_pt / 1000.0;
-		auto pt2 = entry.vpi2_pt / 1000.0;
-		vpi1_tlz.SetPtEtaPhiE(pt1, entry.vpi1_eta, entry.vpi1_phi, entry.vpi1_E / 1000.0);
-		vpi2_tlz.SetPtEtaPhiE(pt2, entry.vpi2_eta, entry.vpi2_phi, entry.vpi2_E / 1000.0);
+// What GetFullPtShape converges to as the number of toys goes to infinity, calculated exactly.
+// Each event is filled as if it were ntauloops toys, so the errors are on the same footing as
+// the toy version.
+pair<vector<weighted_histogram_2D>, weighted_histogram_2D> GetFullPtShapeAnalytic(double tau, int ntauloops, const muon_tree_processor &mc_entries, const Lxy_weight_calculator &lxyWeight)
+{
+	auto shape = MakePtShape();
+	auto &num = shape.first;
+	auto &den = shape.second;
+
+	double n_fills = 0;
+	analytic_decay decays(lxyWeight);
+	mc_entries.process_all_entries([&den, &num, &decays, ntauloops, tau, &n_fills](const muon_tree_processor::eventInfo &entry) {
+		double p_pass, lxy_w[4], lxy_w2[4];
+		decays.expectation(entry, tau, p_pass, lxy_w, lxy_w2);
+
+		double w = entry.weight;
+		den.fill(entry.pt_bin, ntauloops * w * p_pass, ntauloops * w * w * p_pass);
+		for (int i_region = 0; i_region < 4; i_region++) {
+			num[i_region].fill(entry.pt_bin, ntauloops * w * lxy_w[i_region], ntauloops * w * w * lxy_w2[i_region]);
+		}
+		n_fills += ntauloops * p_pass;
+	});
+	den.set_entries(n_fills);
+	for (auto &h : num) {
+		h.set_entries(n_fills);
+	}
+	return shape;
+}
 
-		auto vpi1 = caching_tlz(vpi1_tlz);
-		auto vpi2 = caching_tlz(vpi2_tlz);
+vector<doubleError> CalcPassedEventsLxy(const muon_tree_processor &mc_entries, double tau, const Lxy_weight_calculator &lxyWeight, toy_batches &batches, decay_toy_kernel::sampling how, unsigned int seed, const work_stealing_pool &pool)
+{
+	// The resulting sums are just all the weights added together.
+	vector<doubleError> results(4);
 
-		for (Int_t maketaus = 0; maketaus < ntauloops; maketaus++) { // tau loop to generate toy events
+#ifdef notyet
+	mc_entries.process_all_entries([&results, &lxyWeight](const muon_tree_processor::eventInfo &entry) {
+		for (int i_region = 0; i_region < 4; i_region++) {
+			results[i_region] += lxyWeight(i_region, entry.vpi1_Lxy/1000.0, entry.vpi2_Lxy/1000.0);
+		}
+	});
+#else
+	// Loop over each MC entry, and generate tau's at several different places, a batch at a time
+	// until we have enough. Each chunk of each batch gets its own random number stream.
+	size_t i_batch = 0;
+	while (!batches.done()) {
+		auto pass = mc_entries.process_all_entries_parallel(pool, [&](size_t chunk) {
+			return toy_pass_chunk(tau, batches.batch_size(), how, lxyWeight, stream_seed(seed, i_batch * muon_tree_processor::n_parallel_chunks + chunk), false);
+		});
+
+		double batch_sums[4];
+		for (int i_region = 0; i_region < 4; i_region++) {
+			results[i_region] += pass.sums[i_region];
+			batch_sums[i_region] = pass.sums[i_region] / batches.batch_size();
+		}
+		batches.add_batch(batch_sums);
+		i_batch++;
+	}
 
-			Double_t L2D1 = -1, L2D2 = -1;
+	for (int i_region = 0; i_region < 4; i_region++) {
+		results[i_region] = results[i_region] / batches.n_toys();
+	}
+#endif
+	return results;
+}
 
-			// Do SR, apply SR related cuts (like timing).
-			if (doSR(vpi1, vpi2, tau, L2D1, L2D2)) {
-				den->Fill(pt1, pt2, entry.weight);
+// Throw the toys at the generated lifetime with each kind of sampling, for a range of toys per event, and
+// print how much the passed events in each region spread between independent replicas. The spread at
+// n toys is the statistical error of the toys in a run with n toys per event.
+void CompareSampling(const muon_tree_processor &reader, const Lxy_weight_calculator &lxyWeight, const extrapolate_config &config, const work_stealing_pool &pool)
+{
+	const size_t n_replicas = 8;
+	const decay_toy_kernel::sampling methods[] = { decay_toy_kernel::sampling::pseudo_random, decay_toy_kernel::sampling::sobol };
+
+	cout << "Relative spread of the passed events over " << n_replicas << " replicas at ctau = " << config._tau_gen << endl;
+	cout << setw(6) << "toys" << setw(44) << "pseudo random: A, B, C, D" << setw(44) << "Sobol: A, B, C, D" << endl;
+	for (size_t n_toys = 4; n_toys <= 512; n_toys *= 2) {
+		cout << setw(6) << n_toys;
+		for (auto how : methods) {
+			double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+			double sum2[4] = { 0.0, 0.0, 0.0, 0.0 };
+			for (size_t i_replica = 0; i_replica < n_replicas; i_replica++) {
+				toy_batches batches(n_toys);
+				auto passed = CalcPassedEventsLxy(reader, config._tau_gen, lxyWeight, batches, how, stream_seed(config._seed, i_replica + 1), pool);
 				for (int i_region = 0; i_region < 4; i_region++) {
-					num[i_region]->Fill(pt1, pt2, entry.weight * lxyWeight(i_region, L2D1, L2D2));
+					sum[i_region] += passed[i_region].value();
+					sum2[i_region] += passed[i_region].value() * passed[i_region].value();
 				}
 			}
+			for (int i_region = 0; i_region < 4; i_region++) {
+				double mean = sum[i_region] / n_replicas;
+				double variance = (sum2[i_region] - n_replicas * mean * mean) / (n_replicas - 1);
+				cout << setw(11) << (mean > 0.0 ? sqrt(max(variance, 0.0)) / mean : 0.0);
+			}
 		}
-	});
-	return make_pair(move(num), move(den));
+		cout << endl;
+	}
 }
 
-vector<doubleError> CalcPassedEventsLxy(const muon_tree_processor &mc_entries, double tau, Lxy_weight_calculator &lxyWeight)
+// What CalcPassedEventsLxy converges to as the number of toys goes to infinity, calculated exactly.
+vector<doubleError> CalcPassedEventsLxyAnalytic(const muon_tree_processor &mc_entries, double tau, const Lxy_weight_calculator &lxyWeight)
 {
-	// The resulting sums are just all the weights added together.
 	vector<doubleError> results(4);
 
-	size_t nloops = 100;
-
-	// Loop over each MC entry, and generate tau's at several different places
-	int count = 0;
-	mc_entries.process_all_entries([&count, &results, nloops, tau, &lxyWeight](const muon_tree_processor::eventInfo &entry) {
-#ifdef notyet
+	analytic_decay decays(lxyWeight);
+	mc_entries.process_all_entries([&results, &decays, tau](const muon_tree_processor::eventInfo &entry) {
+		double p_pass, lxy_w[4], lxy_w2[4];
+		decays.expectation(entry, tau, p_pass, lxy_w, lxy_w2);
 		for (int i_region = 0; i_region < 4; i_region++) {
-			results[i_region] += lxyWeight(i_region, entry.vpi1_Lxy/1000.0, entry.vpi2_Lxy/1000.0);
+			results[i_region] += entry.weight * lxy_w[i_region];
 		}
-#else
-		TLorentzVector vpi1_tlz, vpi2_tlz;
-		vpi1_tlz.SetPtEtaPhiE(entry.vpi1_pt / 1000.0, entry.vpi1_eta, entry.vpi1_phi, entry.vpi1_E / 1000.0);
-		vpi2_tlz.SetPtEtaPhiE(entry.vpi2_pt / 1000.0, entry.vpi2_eta, entry.vpi2_phi, entry.vpi2_E / 1000.0);
+	});
 
-		auto vpi1 = caching_tlz(vpi1_tlz);
-		auto vpi2 = caching_tlz(vpi2_tlz);
+	return results;
+}
 
-		for (Int_t maketaus = 0; maketaus < nloops; maketaus++) { // tau loop to generate toy events
+// The proper decay length (meters) of an LLP, from its truth transverse decay length (mm).
+double truth_ct(double Lxy, double beta, double gamma, double sin_theta)
+{
+	double a = beta * gamma * sin_theta;
+	return a > 0.0 ? Lxy / 1000.0 / a : 0.0;
+}
 
-			Double_t L2D1 = -1, L2D2 = -1;
+// Move the generated events to a new lifetime by reweighting them. Each LLP's proper decay length
+// is known from the truth, so the weight is just the ratio of the exponential decay distributions
+// at the new and the generated lifetimes. The regions are the ones the events actually fell in.
+vector<doubleError> CalcPassedEventsReweighted(const muon_tree_processor &reader, double tau, double tau_gen)
+{
+	vector<doubleError> nEvents(4);
 
-			// Do special relativity, apply cuts as needed.
-			if (doSR(vpi1, vpi2, tau, L2D1, L2D2)) {
-				for (int i_region = 0; i_region < 4; i_region++) {
-					results[i_region] += entry.weight * lxyWeight(i_region, L2D1, L2D2);
-				}
-			}
+	double norm = (tau_gen / tau) * (tau_gen / tau);
+	double rate_change = 1.0 / tau - 1.0 / tau_gen;
+	reader.process_all_entries([&nEvents, norm, rate_change](const muon_tree_processor::eventInfo &entry) {
+		double ct1 = truth_ct(entry.vpi1_Lxy, entry.vpi1_beta, entry.vpi1_gamma, entry.vpi1_sin_theta);
+		double ct2 = truth_ct(entry.vpi2_Lxy, entry.vpi2_beta, entry.vpi2_gamma, entry.vpi2_sin_theta);
+		double w = entry.weight * norm * exp(-(ct1 + ct2) * rate_change);
+		doubleError weight(w, w);
+
+		if (entry.RegionA) {
+			nEvents[0] += weight;
+		}
+		if (entry.RegionB) {
+			nEvents[1] += weight;
+		}
+		if (entry.RegionC) {
+			nEvents[2] += weight;
+		}
+		if (entry.RegionD) {
+			nEvents[3] += weight;
 		}
-#endif
 	});
 
-#ifndef notyet
-	for (int i_region = 0; i_region < 4; i_region++) {
-		results[i_region] = results[i_region] / nloops;
+	return nEvents;
+}
+
+// How to throw the toys for one lifetime: n_toys of them, or, if a precision was asked for, as many
+// batches as it takes.
+toy_batches make_toy_batches(const extrapolate_config &config, size_t n_toys)
+{
+	if (config._toy_precision > 0.0) {
+		return toy_batches(n_toy_batch, config._toy_precision, config._max_toys, n_min_toy_batches);
 	}
-#endif
-	return results;
+	return toy_batches(n_toys);
+}
+
+// Do we save the ctau pT ratio shapes for this lifetime point? They are big, so with a fine lifetime
+// grid it is worth only keeping a sample of them.
+bool keep_ctau_shape(const extrapolate_config &config, size_t i_tau)
+{
+	return config._ctau_shape_every > 0 && i_tau % config._ctau_shape_every == 0;
 }
 
 // Calculate a 2D efficiency given a denominator and the numerator selected from the denominator
-template<class T>
-vector<unique_ptr<T>> DivideShape(const pair<vector<unique_ptr<T>>, unique_ptr<T>> &r, const string &name, const string &title)
+vector<weighted_histogram_2D> DivideShape(const pair<vector<weighted_histogram_2D>, weighted_histogram_2D> &r)
 {
-	vector<unique_ptr<T>> result;
-	char region = 'A';
+	vector<weighted_histogram_2D> result;
 	for (auto &info : r.first) {
-		unique_ptr<T> ratio(static_cast<T*>(info->Clone()));
-		ratio->Divide(info.get(), r.second.get(), 1.0, 1.0, "B");
-		ratio->SetNameTitle((name + region).c_str(), (title + " " + region + "; pT [GeV]; pT [GeV]").c_str());
-		result.push_back(move(ratio));
-		region++;
+		result.push_back(weighted_histogram_2D::divide_binomial(info, r.second));
 	}
 
 	return result;
 }
 
-// Calculate the number of events that pass our cuts (possibly weighted).
-vector<doubleError> CalcPassedEvents(const muon_tree_processor &reader, const vector<unique_ptr<TH2F>> &weightHist, bool eventCountOnly)
+// Write the four regions of a pT shape to the output file as TH2F's. They are written straight
+// away, rather than held by the file until it is closed.
+void AddShapeToFile(TFile &f, const vector<weighted_histogram_2D> &shape, const string &name, const string &title)
 {
-	vector<doubleError> nEvents(4); // This will be the number of events in the TTree (without gluons)
-
-	// Calculate the event weight. A combination of the pile up reweighting from the ntuple and perhaps
-	// the beta re-weighting from the input histogram.
-	reader.process_all_entries([&weightHist, eventCountOnly, &nEvents](const muon_tree_processor::eventInfo &entry) {
+	char region = 'A';
+	for (auto &h : shape) {
+		auto root_h = h.as_root<TH2F>(name + region, title + " " + region + "; pT [GeV]; pT [GeV]");
+		f.WriteTObject(root_h.get());
+		region++;
+	}
+}
 
+// Calculate the number of events that pass our cuts (possibly weighted).
+vector<doubleError> CalcPassedEvents(const muon_tree_processor &reader, const vector<weighted_histogram_2D> &weightHist, bool eventCountOnly)
+{
+	// The sum of the weights, and of the errors squared, for each region. Everything here is
+	// a plain sum, so the compiler is free to vectorize the loop over the regions.
+	double sumw[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double sumerr2[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+	// The event weight is a combination of the pile up reweighting from the ntuple and perhaps
+	// the beta re-weighting from the pT weight histograms. The pT bin of each event was found when
+	// the events were loaded, so that is just a lookup.
+	unique_ptr<pt_weight_table> table;
+	if (weightHist.size() > 0) {
+		table = make_unique<pt_weight_table>(weightHist);
+	}
+	const double unit_cell[8] = { 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0 };
+
+	reader.process_all_entries([&table, &unit_cell, eventCountOnly, &sumw, &sumerr2](const muon_tree_processor::eventInfo &entry) {
+		// Count the event if
+		// We are doing an event count only (e.g. the denominator) or
+		// it passes our analysis cuts (e.g. the numerator).
+		// TODO: when eventCountOnly is true, every single event goes into each region, no matter what.
+		//       make sure that is what we want.
+		// TODO: is this the right way to do an error here? Does it propagate so do we care?
+		const double in_region[4] = {
+			eventCountOnly || entry.RegionA ? 1.0 : 0.0,
+			eventCountOnly || entry.RegionB ? 1.0 : 0.0,
+			eventCountOnly || entry.RegionC ? 1.0 : 0.0,
+			eventCountOnly || entry.RegionD ? 1.0 : 0.0
+		};
+		const double *c = table ? table->cell(entry.pt_bin) : unit_cell;
+		double w = entry.weight;
 		for (int i_region = 0; i_region < 4; i_region++) {
-
-			// TODO: is this the right way to do an error here? Does it propagate so do we care?
-			doubleError weight(entry.weight, entry.weight);
-
-			if (weightHist.size() > 0) {
-				int nbin = weightHist[i_region]->FindBin(entry.vpi1_pt / 1000.0, entry.vpi2_pt / 1000.0);
-				weight *= doubleError(weightHist[i_region]->GetBinContent(nbin), weightHist[i_region]->GetBinError(nbin));
-			}
-
-			// Count the event and populate the output histogram, if
-			// We are doing an event count only (e.g. the denominator) or
-			// it passes our analysis cuts (e.g. the numerator).
-			// TODO: when eventCountOnly is true, every single event goes into each region, no matter what.
-			//       make sure that is what we want.
-			auto inRegion =
-				i_region == 0 ? entry.RegionA
-				: i_region == 1 ? entry.RegionB
-				: i_region == 2 ? entry.RegionC
-				: entry.RegionD;
-			if (eventCountOnly
-				|| inRegion
-				) {
-
-				nEvents[i_region] += weight;
-			}
+			sumw[i_region] += in_region[i_region] * w * c[i_region];
+			sumerr2[i_region] += in_region[i_region] * w * w * c[4 + i_region];
 		}
 	}, !eventCountOnly);
 
+	vector<doubleError> nEvents;
+	for (int i_region = 0; i_region < 4; i_region++) {
+		nEvents.push_back(doubleError(true, sumw[i_region], sumerr2[i_region]));
+	}
 	return nEvents;
 }
 
-// Do a very generic calculation on the number of events that have passed.
-vector<doubleError> GenericCalcPassedEvents(const muon_tree_processor &reader, bool ignore_preselection)
+// Everything needed before the lifetime loop that only depends on the events, in one pass: the
+// Lxy efficiency fills, the events in each region at generation, the total number of events, and
+// a very generic count of the events in each region that ignores the preselection.
+setup_sums RunSetupPass(const muon_tree_processor &reader, Lxy_weight_calculator2D &lxyWeight)
 {
-	vector<doubleError> nEvents(4);
+	double passed_sumw[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double passed_sumerr2[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double generated_sumw = 0.0;
+	double generated_sumerr2 = 0.0;
+	vector<doubleError> cross_check(4);
 
-	reader.process_all_entries([&nEvents](const muon_tree_processor::eventInfo &entry) {
+	reader.process_every_entry([&](const muon_tree_processor::eventInfo &entry, bool preselected) {
+		double w = entry.weight;
 
-		doubleError weight(entry.weight, entry.weight);
+		// Total count, every event in every region (no preselection).
+		generated_sumw += w;
+		generated_sumerr2 += w * w;
 
+		// Generic count, each event in the first region it is in (no preselection).
 		int i_region = entry.RegionA ? 0
 			: entry.RegionB ? 1
 			: entry.RegionC ? 2
 			: entry.RegionD ? 3
 			: -1;
 		if (i_region >= 0) {
-			nEvents[i_region] += weight;
+			cross_check[i_region] += doubleError(w, w);
 		}
-	}, !ignore_preselection);
 
-	return nEvents;
-}
-
-// Calc error via bayes
-std::pair<Double_t, Double_t> getBayes(const doubleError &num, const doubleError &den) {
-	// returns the Bayesian uncertainty over the num/den ratio
-	std::pair<Double_t, Double_t> result(0., 0.);
-
-	auto h_num = make_unique<TH1D>("h_num", "", 1, 0, 1);
-	auto h_den = make_unique<TH1D>("h_den", "", 1, 0, 1);
+		if (preselected) {
+			lxyWeight.fill(entry);
 
-	h_num->SetBinContent(1, num.value());
-	h_den->SetBinContent(1, den.value());
-	h_num->SetBinError(1, num.err());
-	h_den->SetBinError(1, den.err());
-
-	auto h_eff = make_unique<TGraphAsymmErrors>();
-	h_eff->BayesDivide(h_num.get(), h_den.get());//, "w"); 
-
-	result.first = h_eff->GetErrorYlow(0);
-	result.second = h_eff->GetErrorYhigh(0);
+			const double in_region[4] = {
+				entry.RegionA ? 1.0 : 0.0,
+				entry.RegionB ? 1.0 : 0.0,
+				entry.RegionC ? 1.0 : 0.0,
+				entry.RegionD ? 1.0 : 0.0
+			};
+			for (int i = 0; i < 4; i++) {
+				passed_sumw[i] += in_region[i] * w;
+				passed_sumerr2[i] += in_region[i] * w * w;
+			}
+		}
+	});
 
-	return result;
+	setup_sums r;
+	r.cross_check = cross_check;
+	for (int i = 0; i < 4; i++) {
+		r.passed.push_back(doubleError(true, passed_sumw[i], passed_sumerr2[i]));
+		r.generated.push_back(doubleError(true, generated_sumw, generated_sumerr2));
+	}
+	return r;
 }
 
 // Set the asymmetric error simply
@@ -0,0 +1,175 @@
+//
+// A flat table of the Lxy efficiency of all four regions, laid out for fast lookup
+// while throwing toys.
+//
+#pragma once
+
+#include "TH1.h"
+
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+
+class lxy_lookup_table
+{
+public:
+	// Uniform binning, the same in Lxy1 and Lxy2 (meters). There is a cell for every bin a TH2 with this
+	// binning would have, including under and overflow, and each cell holds the four regions next to each other.
+	// With bilinear set the efficiency is interpolated between bin centers rather than taken from the bin.
+	lxy_lookup_table(int n_bins, double lxy_min, double lxy_max, bool bilinear = false)
+		: _n_bins(n_bins), _lxy_min(lxy_min), _lxy_max(lxy_max), _bin_width((lxy_max - lxy_min) / n_bins),
+		_bilinear(bilinear), _cells(4 * (n_bins + 2) * (n_bins + 2), 0.0)
+	{
+		if (n_bins < 2) {
+			throw std::runtime_error("The Lxy lookup table needs at least two bins");
+		}
+	}
+
+	// Copy a region's efficiency from a TH2 with the same binning.
+	void fill_region(int region, const TH1 &h)
+	{
+		check_region(region);
+		for (int ybin = 0; ybin < _n_bins + 2; ybin++) {
+			for (int xbin = 0; xbin < _n_bins + 2; xbin++) {
+				_cells[cell(xbin, ybin) + region] = h.GetBinContent(xbin, ybin);
+			}
+		}
+	}
+
+	// Fill a region from a 1D efficiency (a TH1 with the same binning), as sqrt(eff(lxy1)*eff(lxy2)).
+	void fill_region_from_1D(int region, const TH1 &h)
+	{
+		check_region(region);
+		for (int ybin = 0; ybin < _n_bins + 2; ybin++) {
+			for (int xbin = 0; xbin < _n_bins + 2; xbin++) {
+				_cells[cell(xbin, ybin) + region] = std::sqrt(h.GetBinContent(xbin) * h.GetBinContent(ybin));
+			}
+		}
+	}
+
+	// The efficiency of all four regions (0 == A, 1 == B, 2 == C, 3 == D) at (lxy1, lxy2).
+	void operator() (double lxy1, double lxy2, double eff[4]) const
+	{
+		if (!_bilinear || !in_range(lxy1) || !in_range(lxy2)) {
+			const double *c = &_cells[cell(find_bin(lxy1), find_bin(lxy2))];
+			eff[0] = c[0];
+			eff[1] = c[1];
+			eff[2] = c[2];
+			eff[3] = c[3];
+			return;
+		}
+
+		int xbin, ybin;
+		double tx, ty;
+		interpolation_point(lxy1, xbin, tx);
+		interpolation_point(lxy2, ybin, ty);
+		const double *c00 = &_cells[cell(xbin, ybin)];
+		const double *c10 = &_cells[cell(xbin + 1, ybin)];
+		const double *c01 = &_cells[cell(xbin, ybin + 1)];
+		const double *c11 = &_cells[cell(xbin + 1, ybin + 1)];
+		for (int i = 0; i < 4; i++) {
+			eff[i] = (1.0 - ty) * ((1.0 - tx) * c00[i] + tx * c10[i])
+				+ ty * ((1.0 - tx) * c01[i] + tx * c11[i]);
+		}
+	}
+
+	// The efficiency for a single region.
+	double operator() (int region, double lxy1, double lxy2) const
+	{
+		check_region(region);
+		double eff[4];
+		(*this)(lxy1, lxy2, eff);
+		return eff[region];
+	}
+
+	// The expectation of the efficiency, and of its square, for each region when Lxy1 and Lxy2 are independent
+	// and land in bin i with probability p1[i] and p2[i] (ROOT numbering, n_bins()+2 entries each).
+	// This is exact for the binned table; it can't be done for the interpolated one.
+	void expectation(const double *p1, const double *p2, double eff[4], double eff2[4]) const
+	{
+		if (_bilinear) {
+			throw std::runtime_error("The expectation can't be calculated with an interpolated Lxy efficiency");
+		}
+		for (int i = 0; i < 4; i++) {
+			eff[i] = 0.0;
+			eff2[i] = 0.0;
+		}
+		for (int ybin = 0; ybin < _n_bins + 2; ybin++) {
+			if (p2[ybin] == 0.0) {
+				continue;
+			}
+			double row[4] = { 0.0, 0.0, 0.0, 0.0 };
+			double row2[4] = { 0.0, 0.0, 0.0, 0.0 };
+			for (int xbin = 0; xbin < _n_bins + 2; xbin++) {
+				if (p1[xbin] == 0.0) {
+					continue;
+				}
+				const double *c = &_cells[cell(xbin, ybin)];
+				for (int i = 0; i < 4; i++) {
+					row[i] += p1[xbin] * c[i];
+					row2[i] += p1[xbin] * c[i] * c[i];
+				}
+			}
+			for (int i = 0; i < 4; i++) {
+				eff[i] += p2[ybin] * row[i];
+				eff2[i] += p2[ybin] * row2[i];
+			}
+		}
+	}
+
+	bool bilinear() const { return _bilinear; }
+	int n_bins() const { return _n_bins; }
+	double lxy_min() const { return _lxy_min; }
+	double lxy_max() const { return _lxy_max; }
+	double bin_low_edge(int bin) const { return _lxy_min + (bin - 1) * _bin_width; }
+
+	// Same answer as TAxis::FindBin for our fixed binning.
+	int find_bin(double lxy) const
+	{
+		if (lxy < _lxy_min) {
+			return 0;
+		}
+		if (!(lxy < _lxy_max)) {
+			return _n_bins + 1;
+		}
+		return 1 + int(_n_bins * (lxy - _lxy_min) / (_lxy_max - _lxy_min));
+	}
+
+private:
+	int _n_bins;
+	double _lxy_min;
+	double _lxy_max;
+	double _bin_width;
+	bool _bilinear;
+	std::vector<double> _cells;
+
+	// Index of the first region of a cell (ROOT global bin numbering, times 4).
+	int cell(int xbin, int ybin) const { return 4 * (xbin + (_n_bins + 2) * ybin); }
+
+	bool in_range(double lxy) const { return lxy >= _lxy_min && lxy < _lxy_max; }
+
+	// The lower of the two bins whose centers bracket lxy, and how far lxy is between them.
+	// Within half a bin of the edge we just use the edge bin.
+	void interpolation_point(double lxy, int &bin, double &t) const
+	{
+		double f = (lxy - _lxy_min) / _bin_width - 0.5;
+		int i = static_cast<int>(std::floor(f));
+		t = f - i;
+		if (i < 0) {
+			i = 0;
+			t = 0.0;
+		}
+		else if (i > _n_bins - 2) {
+			i = _n_bins - 2;
+			t = 1.0;
+		}
+		bin = i + 1;
+	}
+
+	static void check_region(int region)
+	{
+		if (region < 0 || region > 3) {
+			throw std::runtime_error("Illegal region in the Lxy lookup table");
+		}
+	}
+};
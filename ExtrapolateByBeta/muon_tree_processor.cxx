@@ -1,40 +1,264 @@
 // All code for reading through the muon tree TTree object.
 #include "muon_tree_processor.h"
+#include "event_cache.h"
+
+#include <TTree.h>
+#include <TFile.h>
+
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include <fstream>
+#include <iostream>
 
 using namespace std;
 
-// Open up and fetch the root file
-muon_tree_processor::muon_tree_processor(const string &filename)
+namespace {
+	// Beta, gamma and theta of a particle, done the same way TLorentzVector::SetPtEtaPhiE would.
+	// pt and E in GeV.
+	void particle_kinematics(double pt, double eta, double phi, double E, double &beta, double &gamma, double &theta, double &sin_theta)
+	{
+		pt = abs(pt);
+		double x = pt * cos(phi);
+		double y = pt * sin(phi);
+		double z = pt * sinh(eta);
+		double perp = sqrt(x*x + y*y);
+		double p = sqrt(x*x + y*y + z*z);
+
+		beta = p / E;
+		gamma = 1.0 / sqrt(1 - beta*beta);
+		theta = (x == 0.0 && y == 0.0 && z == 0.0) ? 0.0 : atan2(perp, z);
+		sin_theta = sin(theta);
+	}
+
+	// The bin number TAxis::FindBin would return for a variable binning axis.
+	int axis_bin(int nbins, const double *edges, double x)
+	{
+		if (x < edges[0]) {
+			return 0;
+		}
+		if (!(x < edges[nbins])) {
+			return nbins + 1;
+		}
+		return (int)(upper_bound(edges, edges + nbins + 1, x) - edges);
+	}
+}
+
+// Load the events, from the cache if we can, otherwise from the ROOT file.
+muon_tree_processor::muon_tree_processor(const string &filename, const string &cache_filename)
+{
+	if (cache_filename.size() > 0 && load_cache(cache_filename, filename)) {
+		return;
+	}
+
+	load_root_file(filename);
+	if (cache_filename.size() > 0) {
+		write_cache(cache_filename, filename);
+		cout << "Wrote event cache " << cache_filename << endl;
+	}
+}
+
+// Open up the root file, and load the whole tree into memory.
+void muon_tree_processor::load_root_file(const string &filename)
 {
-	_file = unique_ptr<TFile>(TFile::Open(filename.c_str(), "READ"));
-	if (!_file->IsOpen()) {
+	auto file = unique_ptr<TFile>(TFile::Open(filename.c_str(), "READ"));
+	if (!file || !file->IsOpen()) {
 		throw runtime_error("Unable to open ROOT input file " + filename + "!");
 	}
-	_tree = static_cast<TTree*>(_file->Get("extrapTree"));
-	if (!_tree) {
+	// The tree is owned by the file, so we don't need to delete it; it will be deleted
+	// for us when the file is closed.
+	auto tree = static_cast<TTree*>(file->Get("extrapTree"));
+	if (!tree) {
 		throw runtime_error("Unable to find extrapTree TTree in file " + filename + "!");
 	}
 
 	// Next, link everything up
-	_tree->SetBranchAddress("PassedCalRatio", &(_tree_data.PassedCalRatio));
-	_tree->SetBranchAddress("llp1_pt", &(_tree_data.vpi1_pt));
-	_tree->SetBranchAddress("llp1_eta", &(_tree_data.vpi1_eta));
-	_tree->SetBranchAddress("llp1_phi", &(_tree_data.vpi1_phi));
-	_tree->SetBranchAddress("llp1_E", &(_tree_data.vpi1_E));
-	_tree->SetBranchAddress("llp1_Lxy", &(_tree_data.vpi1_Lxy));
-	_tree->SetBranchAddress("llp2_pt", &(_tree_data.vpi2_pt));
-	_tree->SetBranchAddress("llp2_eta", &(_tree_data.vpi2_eta));
-	_tree->SetBranchAddress("llp2_phi", &(_tree_data.vpi2_phi));
-	_tree->SetBranchAddress("llp2_E", &(_tree_data.vpi2_E));
-	_tree->SetBranchAddress("llp2_Lxy", &(_tree_data.vpi2_Lxy));
-	_tree->SetBranchAddress("event_weight", &(_tree_data.weight));
-	_tree->SetBranchAddress("RegionA", &(_tree_data.RegionA));
-	_tree->SetBranchAddress("RegionB", &(_tree_data.RegionB));
-	_tree->SetBranchAddress("RegionC", &(_tree_data.RegionC));
-	_tree->SetBranchAddress("RegionD", &(_tree_data.RegionD));
+	eventInfo tree_data;
+	tree->SetBranchAddress("PassedCalRatio", &(tree_data.PassedCalRatio));
+	tree->SetBranchAddress("llp1_pt", &(tree_data.vpi1_pt));
+	tree->SetBranchAddress("llp1_eta", &(tree_data.vpi1_eta));
+	tree->SetBranchAddress("llp1_phi", &(tree_data.vpi1_phi));
+	tree->SetBranchAddress("llp1_E", &(tree_data.vpi1_E));
+	tree->SetBranchAddress("llp1_Lxy", &(tree_data.vpi1_Lxy));
+	tree->SetBranchAddress("llp2_pt", &(tree_data.vpi2_pt));
+	tree->SetBranchAddress("llp2_eta", &(tree_data.vpi2_eta));
+	tree->SetBranchAddress("llp2_phi", &(tree_data.vpi2_phi));
+	tree->SetBranchAddress("llp2_E", &(tree_data.vpi2_E));
+	tree->SetBranchAddress("llp2_Lxy", &(tree_data.vpi2_Lxy));
+	tree->SetBranchAddress("event_weight", &(tree_data.weight));
+	tree->SetBranchAddress("RegionA", &(tree_data.RegionA));
+	tree->SetBranchAddress("RegionB", &(tree_data.RegionB));
+	tree->SetBranchAddress("RegionC", &(tree_data.RegionC));
+	tree->SetBranchAddress("RegionD", &(tree_data.RegionD));
+
+	// Read every entry once, and copy it into the columns.
+	auto n_entries = tree->GetEntries();
+	reserve_columns((size_t)n_entries);
+	for (decltype(n_entries) i = 0; i < n_entries; i++) {
+		tree->GetEntry(i);
+		_events.PassedCalRatio.push_back(tree_data.PassedCalRatio);
+		_events.vpi1_pt.push_back(tree_data.vpi1_pt);
+		_events.vpi1_eta.push_back(tree_data.vpi1_eta);
+		_events.vpi1_phi.push_back(tree_data.vpi1_phi);
+		_events.vpi1_E.push_back(tree_data.vpi1_E);
+		_events.vpi1_Lxy.push_back(tree_data.vpi1_Lxy);
+		_events.vpi2_pt.push_back(tree_data.vpi2_pt);
+		_events.vpi2_eta.push_back(tree_data.vpi2_eta);
+		_events.vpi2_phi.push_back(tree_data.vpi2_phi);
+		_events.vpi2_E.push_back(tree_data.vpi2_E);
+		_events.vpi2_Lxy.push_back(tree_data.vpi2_Lxy);
+		_events.weight.push_back(tree_data.weight);
+		_events.regions.push_back((unsigned char)(
+			(tree_data.RegionA ? region_bit(0) : 0)
+			| (tree_data.RegionB ? region_bit(1) : 0)
+			| (tree_data.RegionC ? region_bit(2) : 0)
+			| (tree_data.RegionD ? region_bit(3) : 0)));
+	}
+
+	calculate_kinematics();
 }
 
 
 muon_tree_processor::~muon_tree_processor()
 {
 }
+
+// Point the columns at an event cache. Returns false if there is no cache, or it is out of date or
+// can't be used (an old version, corrupt, or missing a column).
+bool muon_tree_processor::load_cache(const string &cache_filename, const string &source_filename)
+{
+	if (!ifstream(cache_filename.c_str())) {
+		return false;
+	}
+	unique_ptr<event_cache::reader> cache;
+	size_t n = 0;
+	try {
+		cache.reset(new event_cache::reader(cache_filename));
+		if (!cache->matches(source_filename)) {
+			cout << "Event cache " << cache_filename << " is out of date with " << source_filename << ", it will be remade" << endl;
+			return false;
+		}
+
+		n = cache->n_events();
+		event_columns::for_each_cached_column(_events, [&cache, n](const char *name, auto &column) {
+			typedef typename decay<decltype(column)>::type::value_type element;
+			column.view(cache->column<element>(name), n);
+		});
+	}
+	catch (const runtime_error &e) {
+		cout << e.what() << endl;
+		cout << "Event cache " << cache_filename << " can't be used, it will be remade" << endl;
+		// Some columns may already point into the cache, which is about to go away.
+		_events = event_columns();
+		return false;
+	}
+	_cache = move(cache);
+	cout << "Read " << n << " events from event cache " << cache_filename << endl;
+	return true;
+}
+
+// Write the columns out so the next run can skip ROOT.
+void muon_tree_processor::write_cache(const string &cache_filename, const string &source_filename) const
+{
+	event_cache::writer w(source_filename, _events.size());
+	event_columns::for_each_cached_column(_events, [&w](const char *name, const auto &column) {
+		w.add_column(name, column.data());
+	});
+	w.write(cache_filename);
+}
+
+// Make room for n events in all the columns.
+void muon_tree_processor::reserve_columns(size_t n)
+{
+	_events.PassedCalRatio.reserve(n);
+	_events.vpi1_pt.reserve(n);
+	_events.vpi1_eta.reserve(n);
+	_events.vpi1_phi.reserve(n);
+	_events.vpi1_E.reserve(n);
+	_events.vpi1_Lxy.reserve(n);
+	_events.vpi2_pt.reserve(n);
+	_events.vpi2_eta.reserve(n);
+	_events.vpi2_phi.reserve(n);
+	_events.vpi2_E.reserve(n);
+	_events.vpi2_Lxy.reserve(n);
+	_events.weight.reserve(n);
+	_events.regions.reserve(n);
+}
+
+// Fill the derived kinematic columns from the raw ones.
+void muon_tree_processor::calculate_kinematics()
+{
+	auto n = _events.size();
+	_events.vpi1_beta.resize(n);
+	_events.vpi1_gamma.resize(n);
+	_events.vpi1_theta.resize(n);
+	_events.vpi1_sin_theta.resize(n);
+	_events.vpi2_beta.resize(n);
+	_events.vpi2_gamma.resize(n);
+	_events.vpi2_theta.resize(n);
+	_events.vpi2_sin_theta.resize(n);
+
+	for (size_t i = 0; i < n; i++) {
+		particle_kinematics(_events.vpi1_pt[i] / 1000.0, _events.vpi1_eta[i], _events.vpi1_phi[i], _events.vpi1_E[i] / 1000.0,
+			_events.vpi1_beta[i], _events.vpi1_gamma[i], _events.vpi1_theta[i], _events.vpi1_sin_theta[i]);
+		particle_kinematics(_events.vpi2_pt[i] / 1000.0, _events.vpi2_eta[i], _events.vpi2_phi[i], _events.vpi2_E[i] / 1000.0,
+			_events.vpi2_beta[i], _events.vpi2_gamma[i], _events.vpi2_theta[i], _events.vpi2_sin_theta[i]);
+	}
+}
+
+// Run a preselection over all the events, and update the list of events that pass them all.
+void muon_tree_processor::add_preselection(const string &name, const function<bool(const eventInfo&)> &func)
+{
+	if (_preselections.find(name) != _preselections.end()) {
+		throw runtime_error("Preselection " + name + " has already been added");
+	}
+
+	// Every event is tried, so each named list stands on its own.
+	vector<size_t> passed, selected;
+	eventInfo entry;
+	auto n = _events.size();
+	bool first = _preselections.empty();
+	for (size_t i = 0; i < n; i++) {
+		load_entry(i, entry);
+		if (func(entry)) {
+			passed.push_back(i);
+		}
+	}
+	if (first) {
+		selected = passed;
+	}
+	else {
+		set_intersection(_selected.begin(), _selected.end(), passed.begin(), passed.end(), back_inserter(selected));
+	}
+
+	_preselections[name] = move(passed);
+	_selected = move(selected);
+}
+
+// The entries passing one preselection.
+const vector<size_t> &muon_tree_processor::preselected_entries(const string &name) const
+{
+	auto p = _preselections.find(name);
+	if (p == _preselections.end()) {
+		throw runtime_error("Unknown preselection " + name);
+	}
+	return p->second;
+}
+
+// Find the 2D pT bin of each event.
+void muon_tree_processor::index_pt_bins(const variable_binning_builder &binning)
+{
+	auto nbins = binning.nbin();
+	auto edges = binning.bin_list();
+
+	// Read the pT columns through a const reference: they may be views of the event cache, and the
+	// non-const operator[] would copy them.
+	const auto &events = _events;
+	auto n = events.size();
+	_events.pt_bin.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		auto xbin = axis_bin(nbins, edges, events.vpi1_pt[i] / 1000.0);
+		auto ybin = axis_bin(nbins, edges, events.vpi2_pt[i] / 1000.0);
+		_events.pt_bin[i] = xbin + (nbins + 2) * ybin;
+	}
+}
@@ -1,18 +1,27 @@
 #ifndef __muon_tree_processor__
 #define __muon_tree_processor__
 
-#include <TTree.h>
-#include <TFile.h>
+#include "variable_binning_builder.h"
+#include "event_column.h"
+#include "work_stealing_pool.h"
 
 #include <string>
 #include <memory>
 #include <vector>
+#include <map>
 #include <functional>
 
+namespace event_cache {
+	class reader;
+}
+
 class muon_tree_processor
 {
 public:
-	muon_tree_processor(const std::string &filename);
+	// Load the extrapTree from filename. If cache_filename is given, the events are read from that
+	// event cache instead, as long as it is up to date with filename. If it is missing or stale, the
+	// ROOT file is read and the cache (re)made, ready for the next run.
+	muon_tree_processor(const std::string &filename, const std::string &cache_filename = "");
 	~muon_tree_processor();
 
 	struct eventInfo {
@@ -32,44 +41,227 @@ public:
 		int RegionB;
 		int RegionC;
 		int RegionD;
+
+		// Derived kinematics, calculated once when the tree is loaded (pT and E in GeV while doing so).
+		// These are what TLorentzVector would return for each LLP.
+		double vpi1_beta;
+		double vpi1_gamma;
+		double vpi1_theta;
+		double vpi1_sin_theta;
+		double vpi2_beta;
+		double vpi2_gamma;
+		double vpi2_theta;
+		double vpi2_sin_theta;
+
+		// Global bin number of (pt1, pt2) in the 2D pT histograms, as TH2::FindBin would return it.
+		// Only valid after index_pt_bins has been called.
+		int pt_bin;
 	};
 
-	// This function will be called before the entries are processed. Only if it returns true will
-	// your process function be called. If you want to avoid calling them, pass a special argument
-	// to process_all_entries.
-	void add_preselection(const std::function<bool(const muon_tree_processor::eventInfo&)> &func)
+	// The whole tree, loaded into memory once, one contiguous column per branch. All passes over
+	// the events run from here, so the ROOT file is only read and decompressed a single time.
+	struct event_columns {
+		event_column<int> PassedCalRatio;
+		event_column<double> vpi1_pt;
+		event_column<double> vpi1_eta;
+		event_column<double> vpi1_phi;
+		event_column<double> vpi1_E;
+		event_column<double> vpi1_Lxy;
+		event_column<double> vpi2_pt;
+		event_column<double> vpi2_eta;
+		event_column<double> vpi2_phi;
+		event_column<double> vpi2_E;
+		event_column<double> vpi2_Lxy;
+		event_column<double> weight;
+		event_column<unsigned char> regions; // Bit mask of the analysis regions, see region_bit
+
+		event_column<double> vpi1_beta;
+		event_column<double> vpi1_gamma;
+		event_column<double> vpi1_theta;
+		event_column<double> vpi1_sin_theta;
+		event_column<double> vpi2_beta;
+		event_column<double> vpi2_gamma;
+		event_column<double> vpi2_theta;
+		event_column<double> vpi2_sin_theta;
+
+		event_column<int> pt_bin;
+
+		size_t size() const { return weight.size(); }
+
+		// Call f(name, column) for every column that goes into an event cache: everything but pt_bin,
+		// which depends on the binning of the run.
+		template<class Columns, class F>
+		static void for_each_cached_column(Columns &c, F f)
+		{
+			f("PassedCalRatio", c.PassedCalRatio);
+			f("vpi1_pt", c.vpi1_pt);
+			f("vpi1_eta", c.vpi1_eta);
+			f("vpi1_phi", c.vpi1_phi);
+			f("vpi1_E", c.vpi1_E);
+			f("vpi1_Lxy", c.vpi1_Lxy);
+			f("vpi2_pt", c.vpi2_pt);
+			f("vpi2_eta", c.vpi2_eta);
+			f("vpi2_phi", c.vpi2_phi);
+			f("vpi2_E", c.vpi2_E);
+			f("vpi2_Lxy", c.vpi2_Lxy);
+			f("weight", c.weight);
+			f("regions", c.regions);
+			f("vpi1_beta", c.vpi1_beta);
+			f("vpi1_gamma", c.vpi1_gamma);
+			f("vpi1_theta", c.vpi1_theta);
+			f("vpi1_sin_theta", c.vpi1_sin_theta);
+			f("vpi2_beta", c.vpi2_beta);
+			f("vpi2_gamma", c.vpi2_gamma);
+			f("vpi2_theta", c.vpi2_theta);
+			f("vpi2_sin_theta", c.vpi2_sin_theta);
+		}
+	};
+
+	// Bits in event_columns::regions
+	static unsigned char region_bit(int region) { return (unsigned char)(1 << region); }
+
+	// Calculate the global 2D bin number of (pt1, pt2) [GeV] for each event, for a histogram with this
+	// binning on both axes. The bin numbers follow ROOT's conventions (under and overflow included).
+	void index_pt_bins(const variable_binning_builder &binning);
+
+	// Write the loaded events to an event cache for source_filename (the ROOT file they came from).
+	void write_cache(const std::string &cache_filename, const std::string &source_filename) const;
+
+	// True if the events came from an event cache.
+	bool from_cache() const { return _cache != nullptr; }
+
+	// Access to the raw columns.
+	const event_columns &events() const { return _events; }
+	size_t n_events() const { return _events.size(); }
+
+	// Fill an eventInfo from entry i of the columns.
+	void load_entry(size_t i, eventInfo &entry) const
 	{
-		_preselection_list.push_back(func);
+		entry.PassedCalRatio = _events.PassedCalRatio[i];
+		entry.vpi1_pt = _events.vpi1_pt[i];
+		entry.vpi1_eta = _events.vpi1_eta[i];
+		entry.vpi1_phi = _events.vpi1_phi[i];
+		entry.vpi1_E = _events.vpi1_E[i];
+		entry.vpi1_Lxy = _events.vpi1_Lxy[i];
+		entry.vpi2_pt = _events.vpi2_pt[i];
+		entry.vpi2_eta = _events.vpi2_eta[i];
+		entry.vpi2_phi = _events.vpi2_phi[i];
+		entry.vpi2_E = _events.vpi2_E[i];
+		entry.vpi2_Lxy = _events.vpi2_Lxy[i];
+		entry.weight = _events.weight[i];
+		auto regions = _events.regions[i];
+		entry.RegionA = (regions & region_bit(0)) != 0;
+		entry.RegionB = (regions & region_bit(1)) != 0;
+		entry.RegionC = (regions & region_bit(2)) != 0;
+		entry.RegionD = (regions & region_bit(3)) != 0;
+		entry.vpi1_beta = _events.vpi1_beta[i];
+		entry.vpi1_gamma = _events.vpi1_gamma[i];
+		entry.vpi1_theta = _events.vpi1_theta[i];
+		entry.vpi1_sin_theta = _events.vpi1_sin_theta[i];
+		entry.vpi2_beta = _events.vpi2_beta[i];
+		entry.vpi2_gamma = _events.vpi2_gamma[i];
+		entry.vpi2_theta = _events.vpi2_theta[i];
+		entry.vpi2_sin_theta = _events.vpi2_sin_theta[i];
+		entry.pt_bin = _events.pt_bin.size() > 0 ? _events.pt_bin[i] : -1;
 	}
 
-	//Call f for each entry in the ntuple
+	// Only events that pass every preselection are given to your process function. If you want all
+	// the events, pass a special argument to process_all_entries.
+	// The preselection is run over all the events once, right here, and the entries that pass are
+	// remembered under its name. So it can only look at what is already loaded (not pt_bin).
+	void add_preselection(const std::string &name, const std::function<bool(const muon_tree_processor::eventInfo&)> &func);
+
+	// The entries passing a named preselection, in order.
+	const std::vector<size_t> &preselected_entries(const std::string &name) const;
+
+	// Number of entries passing all preselections.
+	size_t n_preselected() const { return _preselections.empty() ? _events.size() : _selected.size(); }
+
+	//Call f for each entry in the ntuple. This runs from the in-memory columns, and can be
+	// called from several threads at once.
 	template<class UnaryFunction>
 	void process_all_entries(UnaryFunction f, bool apply_preselection = true) const
 	{
-		auto n_entries = _tree->GetEntries();
-		for (decltype(n_entries) i = 0; i < n_entries; i++) {
-			_tree->GetEntry(i);
-			bool good_event = true;
-			if (apply_preselection) {
-				for (auto &f : _preselection_list) {
-					good_event = good_event && f(_tree_data);
-				}
+		eventInfo entry;
+		if (apply_preselection && !_preselections.empty()) {
+			for (auto i : _selected) {
+				load_entry(i, entry);
+				f(entry);
 			}
-			if (good_event) {
-				f(_tree_data);
+		}
+		else {
+			auto n_entries = _events.size();
+			for (size_t i = 0; i < n_entries; i++) {
+				load_entry(i, entry);
+				f(entry);
 			}
 		}
 	}
 
+	// The number of chunks the entries are split into by process_all_entries_parallel.
+	static const size_t n_parallel_chunks = 64;
+
+	// Event-parallel version of process_all_entries. The entries are split into n_parallel_chunks
+	// contiguous chunks, which are spread over the pool's threads. make(chunk) creates the visitor
+	// for a chunk (with its own accumulators, random numbers, etc.), which is called for each entry
+	// in the chunk. At the end the visitors are added together, in chunk order, with operator+=
+	// and the sum is returned. The chunks don't depend on the number of threads, so neither does the result.
+	template<class MakeVisitor>
+	auto process_all_entries_parallel(const work_stealing_pool &pool, MakeVisitor make, bool apply_preselection = true) const
+	{
+		typedef decltype(make(size_t(0))) Visitor;
+
+		bool use_selection = apply_preselection && !_preselections.empty();
+		size_t n_entries = use_selection ? _selected.size() : _events.size();
+		std::vector<std::unique_ptr<Visitor>> visitors(n_parallel_chunks);
+		pool.run(n_parallel_chunks, [&](size_t chunk, unsigned int) {
+			std::unique_ptr<Visitor> v(new Visitor(make(chunk)));
+			eventInfo entry;
+			size_t end = n_entries * (chunk + 1) / n_parallel_chunks;
+			for (size_t i = n_entries * chunk / n_parallel_chunks; i < end; i++) {
+				load_entry(use_selection ? _selected[i] : i, entry);
+				(*v)(entry);
+			}
+			visitors[chunk] = std::move(v);
+		});
+
+		Visitor result(std::move(*visitors[0]));
+		for (size_t chunk = 1; chunk < n_parallel_chunks; chunk++) {
+			result += *visitors[chunk];
+		}
+		return result;
+	}
+
+	// Call f(entry, preselected) for every entry in the ntuple, where preselected tells if the entry
+	// passes all the preselections. For when one pass needs both the preselected and all the events.
+	template<class BinaryFunction>
+	void process_every_entry(BinaryFunction f) const
+	{
+		eventInfo entry;
+		auto next_selected = _selected.begin();
+		auto n_entries = _events.size();
+		for (size_t i = 0; i < n_entries; i++) {
+			load_entry(i, entry);
+			bool preselected = _preselections.empty();
+			if (next_selected != _selected.end() && *next_selected == i) {
+				preselected = true;
+				++next_selected;
+			}
+			f(entry, preselected);
+		}
+	}
+
 private:
-	// The tree we are scanning over
-	// The tree is owned by the file, so we don't need to delete it; it will be deleted
-	// for us when the file is removed.
-	TTree *_tree;
-	std::unique_ptr<TFile> _file;
-
-	eventInfo _tree_data;
-	std::vector <std::function<bool(const eventInfo&)> > _preselection_list;
+	event_columns _events;
+	std::map<std::string, std::vector<size_t>> _preselections; // Passing entries, by preselection name
+	std::vector<size_t> _selected; // Entries passing all the preselections
+
+	std::unique_ptr<event_cache::reader> _cache; // The mapped cache file the columns point into, if any
+
+	void load_root_file(const std::string &filename);
+	bool load_cache(const std::string &cache_filename, const std::string &source_filename);
+	void reserve_columns(size_t n);
+	void calculate_kinematics();
 };
 
 #endif
@@ -0,0 +1,49 @@
+//
+// The four region pT weighting histograms in one flat table, indexed by an event's 2D pT bin
+// (muon_tree_processor::eventInfo::pt_bin), for the passed event sums.
+//
+// Each cell holds the weight of the four regions next to each other, followed by what each region
+// adds to the error squared per unit event weight squared. The error is what doubleError gives for
+// doubleError(w, w) * doubleError(content, error): w^2 * (content^2 + error^2), or zero if the content
+// is zero.
+//
+#pragma once
+
+#include "weighted_histogram.h"
+
+#include <vector>
+#include <stdexcept>
+
+class pt_weight_table
+{
+public:
+	explicit pt_weight_table(const std::vector<weighted_histogram_2D> &weightHist)
+	{
+		if (weightHist.size() != 4) {
+			throw std::runtime_error("The pT weight table needs a weighting histogram for each of the four regions");
+		}
+		_n_cells = weightHist[0].n_cells();
+		_cells.resize(8 * _n_cells, 0.0);
+		for (int bin = 0; bin < _n_cells; bin++) {
+			for (int i_region = 0; i_region < 4; i_region++) {
+				double c = weightHist[i_region].content(bin);
+				double e = weightHist[i_region].error(bin);
+				_cells[8 * bin + i_region] = c;
+				_cells[8 * bin + 4 + i_region] = c == 0.0 ? 0.0 : c * c + e * e;
+			}
+		}
+	}
+
+	// The cell for a global pT bin: four weights, then four error factors.
+	const double *cell(int pt_bin) const
+	{
+		if (pt_bin < 0 || pt_bin >= _n_cells) {
+			throw std::runtime_error("Event pT bin is not in the pT weight table - were the pT bins indexed?");
+		}
+		return &_cells[8 * pt_bin];
+	}
+
+private:
+	int _n_cells;
+	std::vector<double> _cells;
+};
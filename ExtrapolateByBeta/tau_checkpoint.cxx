@@ -0,0 +1,220 @@
+#include "tau_checkpoint.h"
+#include "event_cache.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+
+using namespace std;
+
+namespace {
+	const char magic[8] = { 'E', 'X', 'T', 'R', 'A', 'P', 'C', 'K' };
+	const uint64_t format_version = 1;
+
+	// A record is built up in memory, then written in one go with its length and checksum.
+	class record_writer
+	{
+	public:
+		template<class T>
+		void put(T v)
+		{
+			auto p = reinterpret_cast<const char*>(&v);
+			_bytes.insert(_bytes.end(), p, p + sizeof(T));
+		}
+		const vector<char> &bytes() const { return _bytes; }
+
+	private:
+		vector<char> _bytes;
+	};
+
+	// Reads a record back. Throws if we run off the end (the record is bad).
+	class record_reader
+	{
+	public:
+		explicit record_reader(const vector<char> &bytes) : _bytes(bytes), _pos(0) {}
+
+		template<class T>
+		T get()
+		{
+			T v;
+			if (_pos + sizeof(T) > _bytes.size()) {
+				throw runtime_error("Checkpoint record is too short");
+			}
+			memcpy(&v, &_bytes[_pos], sizeof(T));
+			_pos += sizeof(T);
+			return v;
+		}
+		bool at_end() const { return _pos == _bytes.size(); }
+
+	private:
+		const vector<char> &_bytes;
+		size_t _pos;
+	};
+
+	vector<char> encode(const tau_checkpoint::point &p)
+	{
+		record_writer w;
+		w.put<uint64_t>(p.i_tau);
+		w.put<uint64_t>(p.n_toys);
+		for (int i_region = 0; i_region < 4; i_region++) {
+			w.put(p.passed[i_region]);
+			w.put(p.passed_err2[i_region]);
+		}
+		w.put<uint64_t>(p.ctau_ratio.size());
+		for (const auto &h : p.ctau_ratio) {
+			w.put<uint64_t>(h.n_cells());
+			w.put(h.entries());
+			for (int bin = 0; bin < h.n_cells(); bin++) {
+				w.put(h.content(bin));
+				w.put(h.sumw2(bin));
+			}
+		}
+		return w.bytes();
+	}
+
+	tau_checkpoint::point decode(const vector<char> &bytes, const variable_binning_builder &pt_binning)
+	{
+		record_reader r(bytes);
+		tau_checkpoint::point p;
+		p.i_tau = r.get<uint64_t>();
+		p.n_toys = r.get<uint64_t>();
+		for (int i_region = 0; i_region < 4; i_region++) {
+			p.passed[i_region] = r.get<double>();
+			p.passed_err2[i_region] = r.get<double>();
+		}
+		auto n_ratio = r.get<uint64_t>();
+		for (uint64_t i = 0; i < n_ratio; i++) {
+			// The histograms start empty, so filling each bin once sets it exactly.
+			weighted_histogram_2D h(pt_binning.edges(), pt_binning.edges());
+			if (r.get<uint64_t>() != (uint64_t)h.n_cells()) {
+				throw runtime_error("Checkpoint pT shape has a different binning");
+			}
+			h.set_entries(r.get<double>());
+			for (int bin = 0; bin < h.n_cells(); bin++) {
+				auto sumw = r.get<double>();
+				auto sumw2 = r.get<double>();
+				h.fill(bin, sumw, sumw2);
+			}
+			p.ctau_ratio.push_back(h);
+		}
+		if (!r.at_end()) {
+			throw runtime_error("Checkpoint record is too long");
+		}
+		return p;
+	}
+
+	void write_record(ofstream &out, const vector<char> &bytes)
+	{
+		uint64_t length = bytes.size();
+		uint64_t checksum = event_cache::fnv1a(bytes.data(), bytes.size());
+		out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+		out.write(bytes.data(), bytes.size());
+		out.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+	}
+}
+
+uint64_t tau_checkpoint::setup_key(const vector<double> &setup, const string &source_file)
+{
+	auto stamp = event_cache::stamp_of(source_file);
+	auto h = event_cache::fnv1a(setup.data(), setup.size() * sizeof(double));
+	h = event_cache::fnv1a(&stamp.size, sizeof(stamp.size), h);
+	h = event_cache::fnv1a(&stamp.mtime, sizeof(stamp.mtime), h);
+	return event_cache::fnv1a(&stamp.hash, sizeof(stamp.hash), h);
+}
+
+tau_checkpoint::tau_checkpoint(const string &filename, uint64_t key, bool resume, const variable_binning_builder &pt_binning)
+	: _filename(filename), _key(key)
+{
+	if (resume) {
+		load(pt_binning);
+	}
+	start(resume);
+}
+
+// Read the header and every good record. Stops at the first bad or partial record, which can only
+// be the one that was being written when the job was killed.
+void tau_checkpoint::load(const variable_binning_builder &pt_binning)
+{
+	ifstream in(_filename.c_str(), ios::binary | ios::ate);
+	if (!in) {
+		return;
+	}
+	auto file_size = static_cast<uint64_t>(in.tellg());
+	in.seekg(0);
+
+	char file_magic[8];
+	uint64_t version = 0, key = 0;
+	in.read(file_magic, sizeof(file_magic));
+	in.read(reinterpret_cast<char*>(&version), sizeof(version));
+	in.read(reinterpret_cast<char*>(&key), sizeof(key));
+	if (!in || memcmp(file_magic, magic, sizeof(magic)) != 0) {
+		throw runtime_error(_filename + " is not an extrapolation checkpoint");
+	}
+	if (version != format_version) {
+		throw runtime_error("The checkpoint " + _filename + " is from an older version, and can't be resumed from");
+	}
+	if (key != _key) {
+		throw runtime_error("The checkpoint " + _filename + " was made with different options or a different input file, and can't be resumed from");
+	}
+
+	while (true) {
+		uint64_t length = 0, checksum = 0;
+		if (!in.read(reinterpret_cast<char*>(&length), sizeof(length))
+			|| length > file_size - static_cast<uint64_t>(in.tellg())) {
+			break;
+		}
+		vector<char> bytes(static_cast<size_t>(length));
+		if (!in.read(bytes.data(), bytes.size()) || !in.read(reinterpret_cast<char*>(&checksum), sizeof(checksum))) {
+			break;
+		}
+		if (event_cache::fnv1a(bytes.data(), bytes.size()) != checksum) {
+			break;
+		}
+		_done.push_back(decode(bytes, pt_binning));
+	}
+}
+
+// (Re)write the checkpoint with just the header and the points we are keeping, and leave it open
+// for more points. Writing it afresh drops anything half written at the end of the old one.
+void tau_checkpoint::start(bool keep_done)
+{
+	string temp_file = _filename + ".tmp";
+	{
+		ofstream out(temp_file.c_str(), ios::binary | ios::trunc);
+		out.write(magic, sizeof(magic));
+		out.write(reinterpret_cast<const char*>(&format_version), sizeof(format_version));
+		out.write(reinterpret_cast<const char*>(&_key), sizeof(_key));
+		if (keep_done) {
+			for (const auto &p : _done) {
+				write_record(out, encode(p));
+			}
+		}
+		if (!out) {
+			throw runtime_error("Unable to write the checkpoint " + temp_file);
+		}
+	}
+	::remove(_filename.c_str());
+	if (rename(temp_file.c_str(), _filename.c_str()) != 0) {
+		throw runtime_error("Unable to move the checkpoint into place at " + _filename);
+	}
+
+	_out.open(_filename.c_str(), ios::binary | ios::app);
+	if (!_out) {
+		throw runtime_error("Unable to open the checkpoint " + _filename);
+	}
+}
+
+void tau_checkpoint::add(const point &p)
+{
+	write_record(_out, encode(p));
+	_out.flush();
+	if (!_out) {
+		throw runtime_error("Unable to write to the checkpoint " + _filename);
+	}
+}
+
+void tau_checkpoint::remove()
+{
+	_out.close();
+	::remove(_filename.c_str());
+}
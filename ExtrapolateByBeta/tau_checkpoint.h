@@ -0,0 +1,63 @@
+//
+// A checkpoint of the lifetime points an ExtrapolateByBeta run has finished, so a job that is killed
+// part way through can pick up where it left off.
+//
+// Each finished lifetime point is appended to the file (and flushed) as soon as it is done: the passed
+// events in each region, the toys used, and the ctau pT ratio shapes. Every lifetime point has its own
+// random number stream, so nothing about the random number state needs saving - a point that is
+// re-done after a resume comes out just as it would have. The file header holds a key made from
+// everything that changes the results (the setup, and a stamp of the input file), and a checkpoint
+// with a different key is never resumed from. Each record has a checksum, so a record that was only
+// half written when the job was killed is dropped.
+//
+#pragma once
+
+#include "weighted_histogram.h"
+#include "variable_binning_builder.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+class tau_checkpoint
+{
+public:
+	// One finished lifetime point.
+	struct point {
+		size_t i_tau;
+		size_t n_toys;
+		double passed[4]; // Passed events in each region
+		double passed_err2[4]; // ... and their error squared
+		std::vector<weighted_histogram_2D> ctau_ratio;
+	};
+
+	// A key for the setup of a run: the numbers that change its results, and the input file.
+	static uint64_t setup_key(const std::vector<double> &setup, const std::string &source_file);
+
+	// Start a checkpoint for a run with this setup. With resume, the points already in a checkpoint with
+	// the same key are loaded (it is an error if it has a different key); otherwise any old checkpoint is
+	// thrown away. The ctau ratio shapes are read back with pt_binning.
+	tau_checkpoint(const std::string &filename, uint64_t key, bool resume, const variable_binning_builder &pt_binning);
+
+	// The points that were in the checkpoint when it was opened. They are handed over, so this
+	// only returns them the first time.
+	std::vector<point> take_done() { return std::move(_done); }
+
+	// Record a finished point. Not thread safe.
+	void add(const point &p);
+
+	// Delete the checkpoint, once the output file has been written.
+	void remove();
+
+private:
+	std::string _filename;
+	uint64_t _key;
+	std::vector<point> _done;
+	std::ofstream _out;
+
+	void load(const variable_binning_builder &pt_binning);
+	void start(bool keep_done);
+};
@@ -0,0 +1,63 @@
+//
+// Hands finished lifetime points to a writer in lifetime order, so each can go into the output file
+// (and its histograms be freed) as soon as it is done. When the points are spread over threads they
+// finish out of order; a point that finishes early waits here until the ones before it are written.
+// To keep that to a few points however fine the lifetime grid is (and however long one slow point
+// takes), the points are started in order, and only once can_start says they are close enough to
+// the next one to be written.
+//
+#pragma once
+
+#include <vector>
+#include <map>
+#include <functional>
+#include <stdexcept>
+#include <cstddef>
+
+class tau_point_writer
+{
+public:
+	// The points, in the order they should be written, and what writes one out.
+	tau_point_writer(const std::vector<size_t> &order, std::function<void(size_t)> write)
+		: _order(order), _ready(order.size(), false), _next(0), _write(write)
+	{
+		for (size_t i = 0; i < _order.size(); i++) {
+			_position[_order[i]] = i;
+		}
+	}
+
+	// Mark a point as finished, and write it and any that were waiting for it. Not thread safe.
+	void finished(size_t i_tau)
+	{
+		auto p = _position.find(i_tau);
+		if (p == _position.end() || _ready[p->second]) {
+			throw std::runtime_error("A lifetime point was finished twice, or isn't one this job does");
+		}
+		_ready[p->second] = true;
+		while (_next < _order.size() && _ready[_next]) {
+			_write(_order[_next]);
+			_next++;
+		}
+	}
+
+	// True if i_tau is fewer than max_ahead points past the next one to be written, so that no more
+	// than max_ahead finished points can be held waiting to be written. Not thread safe.
+	bool can_start(size_t i_tau, size_t max_ahead) const
+	{
+		auto p = _position.find(i_tau);
+		if (p == _position.end()) {
+			throw std::runtime_error("A lifetime point isn't one this job does");
+		}
+		return p->second < _next + max_ahead;
+	}
+
+	// True once every point has been written.
+	bool all_written() const { return _next == _order.size(); }
+
+private:
+	std::vector<size_t> _order;
+	std::vector<bool> _ready;
+	std::map<size_t, size_t> _position;
+	size_t _next;
+	std::function<void(size_t)> _write;
+};
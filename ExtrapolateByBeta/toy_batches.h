@@ -0,0 +1,108 @@
+//
+// Decide how many toys to throw for a lifetime point.
+//
+// The toys are thrown in batches (every event gets batch_size() toys per batch). After each batch the
+// per-toy sum of the Lxy weights in each region is recorded, and from the spread between batches we
+// know the statistical error on each region's efficiency. Batches stop once the relative error is
+// below the target in every region, or when the cap on the number of toys is reached.
+// With no target there is a single batch of a fixed size, which is the old behavior.
+//
+#ifndef __toy_batches__
+#define __toy_batches__
+
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+
+class toy_batches
+{
+public:
+	// A fixed number of toys, in one batch.
+	explicit toy_batches(size_t n_toys)
+		: _batch_size(n_toys), _target(0.0), _max_toys(n_toys), _min_batches(1)
+	{
+		reset();
+	}
+
+	// Batches of batch_size toys until the relative error on every region is below target,
+	// but never more than max_toys toys.
+	toy_batches(size_t batch_size, double target, size_t max_toys, size_t min_batches = 3)
+		: _batch_size(batch_size), _target(target), _max_toys(max_toys), _min_batches(min_batches < 2 ? 2 : min_batches)
+	{
+		if (batch_size == 0 || max_toys < batch_size) {
+			throw std::runtime_error("The toy batch size must be at least one, and no more than the toy cap");
+		}
+		if (target <= 0.0) {
+			throw std::runtime_error("The target relative error for the toys must be positive");
+		}
+		reset();
+	}
+
+	size_t batch_size() const { return _batch_size; }
+
+	// Record a batch: for each region, the sum of the weights of the batch divided by batch_size().
+	void add_batch(const double region_sums[4])
+	{
+		_n_batches++;
+		for (int i = 0; i < 4; i++) {
+			// Welford's running mean and variance
+			double delta = region_sums[i] - _mean[i];
+			_mean[i] += delta / _n_batches;
+			_m2[i] += delta * (region_sums[i] - _mean[i]);
+		}
+	}
+
+	// True once no more batches should be thrown.
+	bool done() const
+	{
+		if (_n_batches == 0) {
+			return false;
+		}
+		if (_target <= 0.0 || n_toys() + _batch_size > _max_toys) {
+			return true;
+		}
+		if (_n_batches < _min_batches) {
+			return false;
+		}
+		for (int i = 0; i < 4; i++) {
+			if (rel_error(i) > _target) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Toys per event thrown so far.
+	size_t n_toys() const { return _n_batches * _batch_size; }
+
+	// Relative statistical error on a region's efficiency (0 if nothing has passed).
+	double rel_error(int region) const
+	{
+		if (_n_batches < 2 || _mean[region] == 0.0) {
+			return 0.0;
+		}
+		double variance = _m2[region] / (_n_batches - 1);
+		return std::sqrt(variance / _n_batches) / std::fabs(_mean[region]);
+	}
+
+	void reset()
+	{
+		_n_batches = 0;
+		for (int i = 0; i < 4; i++) {
+			_mean[i] = 0.0;
+			_m2[i] = 0.0;
+		}
+	}
+
+private:
+	size_t _batch_size;
+	double _target;
+	size_t _max_toys;
+	size_t _min_batches;
+
+	size_t _n_batches;
+	double _mean[4];
+	double _m2[4];
+};
+
+#endif
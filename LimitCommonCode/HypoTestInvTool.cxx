@@ -25,6 +25,15 @@
 #include "RooStats/HybridCalculator.h"
 
 #include "Math/MinimizerOptions.h"
+#include "Math/ProbFuncMathCore.h"
+
+#include <array>
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <stdexcept>
 
 using namespace RooStats;
 using namespace RooFit;
@@ -38,6 +47,7 @@ HypoTestInvTool::HypoTestInvTool()
 	mUseProof(false),
 	mRebuild(false),
 	mReuseAltToys(false),
+	mAdaptiveScan(false),
 	mNWorkers(4),
 	mNToyToRebuild(100),
 	mPrintLevel(0),
@@ -45,6 +55,7 @@ HypoTestInvTool::HypoTestInvTool()
 	mRandomSeed(-1),
 	mNToysRatio(2),
 	mMaxPoi(-1),
+	mScanTolerance(0.005),
 	mAsimovBins(0),
 	mNoSystematics(""),
 	mMassValue(""),
@@ -72,6 +83,7 @@ HypoTestInvTool::SetParameter(const char * name, bool value) {
 	if (s_name.find("Rebuild") != std::string::npos) mRebuild = value;
 	if (s_name.find("ReuseAltToys") != std::string::npos) mReuseAltToys = value;
 	if (s_name.find("NoSystematics") != std::string::npos) mNoSystematics = value;
+	if (s_name.find("AdaptiveScan") != std::string::npos) mAdaptiveScan = value;
 
 	return;
 }
@@ -108,6 +120,7 @@ HypoTestInvTool::SetParameter(const char * name, double value) {
 
 	if (s_name.find("NToysRatio") != std::string::npos) mNToysRatio = value;
 	if (s_name.find("MaxPOI") != std::string::npos) mMaxPoi = value;
+	if (s_name.find("ScanTolerance") != std::string::npos) mScanTolerance = value;
 
 	return;
 }
@@ -184,7 +197,7 @@ HypoTestInvTool::AnalyzeResult(HypoTestInverterResult * r,
 		// write to a file the results
 		const char *  calcType = (calculatorType == 0) ? "Freq" : (calculatorType == 1) ? "Hybr" : "Asym";
 		const char *  limitType = (useCLs) ? "CLs" : "Cls+b";
-		const char * scanType = (npoints < 0) ? "auto" : "grid";
+		const char * scanType = (mAdaptiveScan) ? "adaptive" : (npoints < 0) ? "auto" : "grid";
 		if (mResultFileName.IsNull()) {
 			mResultFileName = TString::Format("%s_%s_%s_ts%d_", calcType, limitType, scanType, testStatType);
 			//strip the / from the filename
@@ -381,6 +394,7 @@ HypoTestInvTool::RunInverter(Int_t enne, TString esse, RooWorkspace * w,
 	RooRealVar *poi = (RooRealVar*)poiSet->first();
 
 	std::cout << "StandardHypoTestInvDemo : POI initial value:   " << poi->GetName() << " = " << poi->getVal() << std::endl;
+	double poiStart = poi->getVal(); // the adaptive scan starts from here (before the fit moves it)
 
 	// fit the data first (need to use constraint )
 	TStopwatch tw;
@@ -646,7 +660,13 @@ HypoTestInvTool::RunInverter(Int_t enne, TString esse, RooWorkspace * w,
 	}
 
 
-	if (npoints > 0) {
+	if (mAdaptiveScan) {
+		// Without a guess (or a fit) to go on, start a decade into the range.
+		if (poiStart <= 0) poiStart = (poihat > 0) ? 2 * poihat : 0.1 * poi->getMax();
+		std::cout << "Doing an adaptive scan starting at " << poi->GetName() << " = " << poiStart
+			<< " (to a relative tolerance of " << mScanTolerance << ")" << std::endl;
+	}
+	else if (npoints > 0) {
 		if (poimin > poimax) {
 			// if no min/max given scan between MLE and +4 sigma 
 			poimin = int(poihat);
@@ -661,6 +681,11 @@ HypoTestInvTool::RunInverter(Int_t enne, TString esse, RooWorkspace * w,
 	}
 
 	tw.Start();
+	if (mAdaptiveScan) {
+		int nScanned = RunAdaptiveScan(calc, type == 2 || type == 3, useCLs, testStatType == 3, poiStart, poi->getMax());
+		std::cout << "Adaptive scan done with " << nScanned << " points" << std::endl;
+	}
+	// With the adaptive scan this only collects the points it ran.
 	HypoTestInverterResult * r = calc.GetInterval();
 	std::cout << "Time to perform limit scan \n";
 	tw.Print();
@@ -690,3 +715,143 @@ HypoTestInvTool::RunInverter(Int_t enne, TString esse, RooWorkspace * w,
 	return r;
 }
 
+
+
+
+// The CLs (or CLs+b) at a scanned point: the observed value, then the expected ones at 0, +1, -1,
+// +2 and -2 sigma, worked out the way HypoTestInverterResult does for the expected limits.
+typedef std::array<double, 6> ScanValues;
+static const double expectedSigma[5] = { 0, 1, -1, 2, -2 };
+
+static ScanValues
+ScanPointValues(HypoTestInverterResult &r, int i, bool asymptotic, bool useCLs, bool oneSided) {
+
+	ScanValues v;
+	v[0] = useCLs ? r.CLs(i) : r.CLsplusb(i);
+	if (asymptotic) {
+		HypoTestResult * result = r.GetResult(i);
+		for (int k = 0; k < 5; k++)
+			v[k + 1] = AsymptoticCalculator::GetExpectedPValues(result->NullPValue(), result->AlternatePValue(),
+				expectedSigma[k], useCLs, oneSided);
+	}
+	else {
+		SamplingDistribution * s = r.GetExpectedPValueDist(i);
+		if (!s) throw std::runtime_error("No expected p-value distribution at a point of the adaptive scan");
+		std::vector<double> values(s->GetSamplingDistribution());
+		delete s;
+		for (int k = 0; k < 5; k++) {
+			double p = ROOT::Math::normal_cdf(expectedSigma[k], 1);
+			TMath::Quantiles((int)values.size(), 1, &values[0], &v[k + 1], &p, false);
+		}
+	}
+	return v;
+}
+
+// Where the next point should go to find the first mu where one of the values falls to target,
+// given the points scanned so far. CLs falls roughly exponentially, so points are placed by
+// interpolating (or extrapolating) log CLs, straight from 1 at mu = 0 if there is nothing better:
+//  - while every point is above target, further up (1.1 to 10 times the top one, at most poiMax);
+//  - while every point is below it, further down (1/1.1 to a tenth of the bottom one);
+//  - once two neighbouring points straddle it, between them (kept tolerance/2 of a limit away from
+//    either, so the bracket always shrinks; halfway if bisect).
+// Returns -1 once the bracket is tolerance of the limit across, -2 if the top point is poiMax and
+// still above target.
+static double
+NextScanPoint(const std::map<double, ScanValues> &scanned, int value, double target,
+	double tolerance, double poiMax, bool bisect) {
+
+	// A straight line in log CLs from 1 at mu = 0 to v at x crosses target at x times this (-1 if
+	// v isn't below 1).
+	auto fromZero = [target](double v) {
+		return (v > 0 && v < 1) ? std::log(target) / std::log(v) : -1;
+	};
+
+	double lo = -1, v_lo = 0, below = -1, v_below = 0;
+	for (const auto &point : scanned) {
+		double v = point.second[value];
+		if (v > target) {
+			below = lo, v_below = v_lo;
+			lo = point.first, v_lo = v;
+			continue;
+		}
+
+		if (lo < 0) {
+			// Even the bottom point is below target: walk down, a decade at a time once a step down
+			// hasn't found it.
+			double factor = fromZero(v);
+			auto next = std::next(scanned.begin());
+			if (factor < 0 || (next != scanned.end() && next->second[value] <= target)) factor = 0.1;
+			return point.first * std::min(std::max(factor, 0.1), 1 / 1.1);
+		}
+
+		double hi = point.first;
+		if (hi - lo <= tolerance * hi) return -1;
+		double t = 0.5;
+		if (!bisect)
+			t = (v > 0) ? std::log(v_lo / target) / std::log(v_lo / v) : (v_lo - target) / (v_lo - v);
+		double margin = 0.5 * tolerance * hi;
+		return std::min(std::max(lo + t * (hi - lo), lo + margin), hi - margin);
+	}
+
+	// Every point is above target: walk up, along the line through the top two if they fall.
+	if (lo >= poiMax) return -2;
+	double factor = fromZero(v_lo);
+	if (below > 0 && v_below > v_lo)
+		factor = 1 + (1 - below / lo) * std::log(v_lo / target) / std::log(v_below / v_lo);
+	if (factor < 0) factor = 10;
+	return std::min(lo * std::min(std::max(factor, 1.1), 10.0), poiMax);
+}
+
+// Run the inverter only at the points needed to find the limits, rather than over a grid: for the
+// observed limit and each expected one in turn, bracket the mu where the CLs falls to 1 - CL and
+// close in on it (NextScanPoint) until the bracket is mScanTolerance of the limit across. The
+// search starts at poiStart, and every point scanned is used for every limit, so the later ones
+// mostly start out bracketed. All the points stay in the inverter, and the limits
+// HypoTestInverterResult interpolates from them are these ones. Returns the number of points run.
+int
+HypoTestInvTool::RunAdaptiveScan(HypoTestInverter &calc, bool asymptotic, bool useCLs, bool oneSided,
+	double poiStart, double poiMax) {
+
+	const double alpha = 1 - calc.ConfidenceLevel();
+	const int maxSteps = 30; // for any one limit - only toy noise should need more than a handful
+	std::map<double, ScanValues> scanned;
+
+	auto scan = [&](double mu) {
+		if (scanned.count(mu)) return;
+		if (!calc.RunOnePoint(mu))
+			throw std::runtime_error("The HypoTestInverter failed at a point of the adaptive scan");
+		HypoTestInverterResult * r = calc.GetInterval();
+		int i = r->FindIndex(mu);
+		if (i < 0) {
+			delete r;
+			throw std::runtime_error("Point of the adaptive scan missing from the inverter result");
+		}
+		scanned[mu] = ScanPointValues(*r, i, asymptotic, useCLs, oneSided);
+		delete r;
+	};
+
+	scan(std::min(poiStart, poiMax));
+	for (int value = 0; value < 6; value++) {
+		for (int step = 0; ; step++) {
+			double mu = NextScanPoint(scanned, value, alpha, mScanTolerance, poiMax, step % 8 == 7);
+			if (mu == -1) break;
+			if (mu == -2) {
+				Warning("StandardHypoTestInvDemo", "CLs is still above %g at the top of the POI range (%g)", alpha, poiMax);
+				break;
+			}
+			if (mu < 1e-3 * poiStart) {
+				// Below 1 - CL all the way down (toy noise at the edge of a band): the point at 0 gives
+				// the interpolation a crossing, as the first point of a grid would.
+				scan(0);
+				break;
+			}
+			if (step == maxSteps) {
+				Warning("StandardHypoTestInvDemo", "The adaptive scan has not closed in on a limit after %d points", maxSteps);
+				break;
+			}
+			scan(mu);
+		}
+	}
+
+	return (int)scanned.size();
+}
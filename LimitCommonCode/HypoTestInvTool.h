@@ -7,6 +7,10 @@
 
 #include "Math/MinimizerOptions.h"
 
+namespace RooStats {
+	class HypoTestInverter;
+}
+
 //
 // Tool to run XXXX
 //
@@ -46,6 +50,9 @@ public:
 
 private:
 
+	int RunAdaptiveScan(RooStats::HypoTestInverter &calc, bool asymptotic, bool useCLs, bool oneSided,
+		double poiStart, double poiMax);
+
 	bool mPlotHypoTestResult;
 	bool mWriteResult;
 	bool mOptimize;
@@ -54,6 +61,7 @@ private:
 	bool mUseProof;
 	bool mRebuild;
 	bool mReuseAltToys;
+	bool mAdaptiveScan;
 	int     mNWorkers;
 	int     mNToyToRebuild;
 	int     mPrintLevel;
@@ -61,6 +69,7 @@ private:
 	int     mRandomSeed;
 	double  mNToysRatio;
 	double  mMaxPoi;
+	double  mScanTolerance;
 	int mAsimovBins;
 	bool mNoSystematics;
 	std::string mMassValue;
@@ -9,6 +9,8 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <thread>
+#include <algorithm>
 
 /*
 Two variables x,y create 4 regions: A,B,C,D with A signal dominated region and
@@ -34,6 +36,49 @@ ABCD Ansatz A:B = D:C -->  A = B * D/C
 
 */
 
+class RooWorkspace;
+
+// The values that change from one limit to the next: the signal, the starting guesses for the
+// background, and the observed data. Regions are in A, B, C, D order.
+struct abcd_model_values {
+	double mu; // Starting guess for the POI
+	double ns_A; // Expected signal in region A
+	double sr[4]; // Signal in each region relative to A (sr[0] is ignored)
+	double nq_A; // Starting guess for the multijet background in A
+	double tau_B, tau_D; // ... and its ratios for B and D
+	double nb[4]; // MC background (only used if the model has it)
+	double nc[4]; // Other data driven background (only used if the model has it)
+	double nd[4]; // Observed data
+};
+
+// The ABCD likelihood model in a RooWorkspace, ready for the hypothesis test inverter. Building it
+// from factory strings is slow compared with an asymptotic fit, so it is built once and then only
+// has its values reset for each limit. Everything that changes the shape of the model - which
+// backgrounds are included and the systematic errors - is fixed when it is built.
+class abcd_workspace_model {
+public:
+	abcd_workspace_model(bool useB, bool useC, const std::map<std::string, double> &systematic_errors);
+	~abcd_workspace_model();
+
+	// True if this model was built for these settings.
+	bool same_setup(bool useB, bool useC, const std::map<std::string, double> &systematic_errors) const;
+
+	// Put every parameter back to where it started, then load the values for the next limit. The
+	// data set "obsData" is refilled with the observed data.
+	void set_values(const abcd_model_values &values);
+
+	// The workspace, with the model config "mc" and the data "obsData".
+	RooWorkspace *workspace() const { return _wspace; }
+
+	abcd_workspace_model(const abcd_workspace_model &) = delete;
+	abcd_workspace_model &operator=(const abcd_workspace_model &) = delete;
+
+private:
+	bool _useB, _useC;
+	std::map<std::string, double> _systematic_errors;
+	RooWorkspace *_wspace;
+};
+
 HypoTestInvTool::LimitResults simultaneousABCD(const Double_t n[4], const Double_t s[4], const Double_t b[4], const Double_t c[4],
 	TString out_filename = "ABCD_ws.root",
 	Bool_t useB = kFALSE, // Use background as estimated in MC
@@ -69,6 +114,20 @@ inline HypoTestInvTool::LimitResults simultaneousABCD(const std::vector<double>
 		systematic_errors);
 }
 
+// The CLs limit of simultaneousABCD, but worked out by abcd_likelihood instead of RooFit/RooStats:
+// with toys (calcType 0, abcd_toy_cls, spread over n_threads threads - 0 for all cores) or
+// asymptotically (calcType 2, abcd_asymptotic_cls, which agrees with RooStats to about 1e-4).
+// A limit that isn't reached inside the range of mu is NaN (and a warning is printed).
+HypoTestInvTool::LimitResults nativeABCD(const Double_t n[4], const Double_t s[4], const Double_t b[4], const Double_t c[4],
+	Bool_t useB,
+	Bool_t useC,
+	Bool_t blindA,
+	Int_t calcType,
+	Int_t par_ntoys,
+	Int_t n_threads,
+	const std::map<std::string, double> &systematic_errors
+);
+
 // Convert to a vector that we can pass to the simultanious fitter.
 // TODO: Move this and do_abcd_limit out of this file to prevent confusion.
 inline std::vector<double> ABCD_as_vector_CalRToLJ(const ABCD &events)
@@ -98,6 +157,14 @@ inline ABCD rescale_events_in_regionA(const ABCD &events, double rescaleTo) {
 	return result;
 }
 
+// Put prefix on the front of the file name in path, leaving any directories in front of it alone.
+inline std::string prefix_file_name(const std::string &prefix, const std::string &path)
+{
+	auto slash = path.find_last_of("/\\");
+	auto name_start = slash == std::string::npos ? 0 : slash + 1;
+	return path.substr(0, name_start) + prefix + path.substr(name_start);
+}
+
 // Calculate the limit, and fill in all the results, and return it.
 // Note that the conversion between LJ and CalR world is done here!
 inline limit_result do_abcd_limit(const ABCD &data, const signal_lifetime &expected_signal, const abcd_limit_config &config)
@@ -108,16 +175,31 @@ inline limit_result do_abcd_limit(const ABCD &data, const signal_lifetime &expec
 	auto rescaled_expected_signal = expected_signal;
 	rescaled_expected_signal.signalEvents = rescale_events_in_regionA(expected_signal.signalEvents, config.rescaleSignalTo);
 
-	auto calc_filename = std::string("limit_calc_") + config.fileName;
-
-	auto limit = simultaneousABCD(ABCD_as_vector_CalRToLJ(data), ABCD_as_vector_CalRToLJ(rescaled_expected_signal.signalEvents),
-		dummy, dummy,
-		calc_filename,
-		false, false,
-		data.A == 0,
-		config.useToys ? 0 : 2,
-		config.nToys,
-		config.systematic_errors);
+	auto calc_filename = prefix_file_name("limit_calc_", config.fileName);
+
+	auto n = ABCD_as_vector_CalRToLJ(data);
+	auto s = ABCD_as_vector_CalRToLJ(rescaled_expected_signal.signalEvents);
+	// With several worker processes, share the cores out between them.
+	int n_threads = config.nWorkers > 1
+		? std::max(1, (int)std::thread::hardware_concurrency() / config.nWorkers)
+		: 0;
+
+	auto limit = config.nativeLikelihood
+		? nativeABCD(&(n[0]), &(s[0]), &(dummy[0]), &(dummy[0]),
+			false, false,
+			data.A == 0,
+			config.useToys ? 0 : 2,
+			config.nToys,
+			n_threads,
+			config.systematic_errors)
+		: simultaneousABCD(n, s,
+			dummy, dummy,
+			calc_filename,
+			false, false,
+			data.A == 0,
+			config.useToys ? 0 : 2,
+			config.nToys,
+			config.systematic_errors);
 
 	std::cout << "Limit. data: " << data << "  expected signal: " << rescaled_expected_signal << std::endl;
 	std::cout << "  -> " << limit << std::endl;
@@ -0,0 +1,251 @@
+//
+// Asymptotic CLs limits for the ABCD likelihood.
+//
+#include "abcd_asymptotic_cls.h"
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+
+using namespace std;
+
+namespace {
+	// The standard normal distribution: the lower and upper tail probabilities...
+	double normal_cdf(double x)
+	{
+		return 0.5 * erfc(-x / sqrt(2.0));
+	}
+	double normal_cdf_c(double x)
+	{
+		return 0.5 * erfc(x / sqrt(2.0));
+	}
+
+	// ... and the quantile: P. J. Acklam's rational approximation, polished with one Halley step
+	// (good to full double precision).
+	double normal_quantile(double p)
+	{
+		if (p <= 0.0) {
+			return -HUGE_VAL;
+		}
+		if (p >= 1.0) {
+			return HUGE_VAL;
+		}
+		static const double a[] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+		static const double b[] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01 };
+		static const double c[] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+		static const double d[] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00 };
+		const double p_low = 0.02425;
+
+		double x;
+		if (p < p_low) {
+			double q = sqrt(-2.0 * log(p));
+			x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+		}
+		else if (p <= 1.0 - p_low) {
+			double q = p - 0.5;
+			double r = q * q;
+			x = (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1.0);
+		}
+		else {
+			double q = sqrt(-2.0 * log(1.0 - p));
+			x = -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+		}
+
+		double e = normal_cdf(x) - p;
+		double u = e * 2.5066282746310002 * exp(0.5 * x * x); // sqrt(2 pi)
+		return x - u / (1.0 + 0.5 * x * u);
+	}
+
+	double normal_quantile_c(double p)
+	{
+		return -normal_quantile(p);
+	}
+}
+
+abcd_asymptotic_cls::abcd_asymptotic_cls(const abcd_likelihood &model)
+	: _observed(model), _asimov(model)
+{
+	// Best fit to the observed data.
+	_best = _observed.minimize(_observed.guess(), false);
+	if (!_best.converged) {
+		throw runtime_error("Unable to find the best fit to the observed data in the ABCD likelihood");
+	}
+
+	// The Asimov data: what we'd expect at mu = 0, with the nuisance parameters from the
+	// conditional fit to the observed data.
+	auto start = _best.p;
+	start[abcd_likelihood::mu] = 0.0;
+	auto background_only = _observed.minimize(start, true);
+	if (!background_only.converged) {
+		throw runtime_error("Unable to find the background only fit to the observed data in the ABCD likelihood");
+	}
+	_asimov.set_data(_observed.expected(background_only.p));
+
+	// The global observables (the nominal values in the constraints) are not moved with the Asimov
+	// data, so the best fit to it need not be right at mu = 0. RooStats finds this when it first
+	// meets a negative q~mu for the Asimov data, and uses the lower of the two from then on.
+	auto asimov_background_only = _asimov.minimize(background_only.p, true);
+	_best_asimov = _asimov.minimize(background_only.p, false);
+	if (!_best_asimov.converged || asimov_background_only.nll < _best_asimov.nll) {
+		_best_asimov = asimov_background_only;
+	}
+}
+
+// -log L profiled over the nuisance parameters at a fixed mu.
+double abcd_asymptotic_cls::profile_nll(const abcd_likelihood &l, const abcd_likelihood::point &start, double mu) const
+{
+	auto p = start;
+	p[abcd_likelihood::mu] = mu;
+	auto f = l.minimize(p, true);
+	if (!f.converged) {
+		throw runtime_error("Unable to do the conditional fit to the ABCD likelihood");
+	}
+	return f.nll;
+}
+
+double abcd_asymptotic_cls::q_mu(double mu) const
+{
+	if (best_fit_mu() > mu) {
+		return 0.0;
+	}
+	return max(0.0, 2.0 * (profile_nll(_observed, _best.p, mu) - _best.nll));
+}
+
+double abcd_asymptotic_cls::q_mu_asimov(double mu) const
+{
+	return max(0.0, 2.0 * (profile_nll(_asimov, _best_asimov.p, mu) - _best_asimov.nll));
+}
+
+void abcd_asymptotic_cls::p_values(double mu, double &cls_plus_b, double &cl_b) const
+{
+	double qmu = q_mu(mu);
+	double qmu_A = q_mu_asimov(mu);
+	double sqrtqmu = sqrt(qmu);
+	double sqrtqmu_A = sqrt(qmu_A);
+
+	if (qmu <= qmu_A) {
+		cls_plus_b = normal_cdf_c(sqrtqmu);
+		cl_b = normal_cdf(sqrtqmu_A - sqrtqmu);
+	}
+	else {
+		cls_plus_b = normal_cdf_c((qmu + qmu_A) / (2.0 * sqrtqmu_A));
+		cl_b = normal_cdf_c((qmu - qmu_A) / (2.0 * sqrtqmu_A));
+	}
+}
+
+double abcd_asymptotic_cls::cls(double mu) const
+{
+	double cls_plus_b, cl_b;
+	p_values(mu, cls_plus_b, cl_b);
+	return cl_b > 0.0 ? cls_plus_b / cl_b : 0.0;
+}
+
+// As AsymptoticCalculator::GetExpectedPValues: recover sqrt(q_mu,A) from the p-values, and
+// shift the median background only result by n_sigma.
+double abcd_asymptotic_cls::expected_cls(double mu, double n_sigma) const
+{
+	double cls_plus_b, cl_b;
+	p_values(mu, cls_plus_b, cl_b);
+	double sqrtqmu = normal_quantile_c(cls_plus_b);
+	double sqrtqmu_A = normal_quantile(cl_b) + sqrtqmu;
+	double expected_cls_plus_b = normal_cdf_c(sqrtqmu_A - n_sigma);
+	double expected_cl_b = normal_cdf(n_sigma);
+	return expected_cls_plus_b / expected_cl_b;
+}
+
+// Walk from mu_start until the crossing is bracketed (the step growing each time), then close in
+// on it (regula falsi, Illinois variant, with bisection whenever it stalls). Toy CLs curves are flat
+// in places, so each new point is kept at least half the tolerance in from the ends of the bracket.
+double cls_upper_limit(const function<double(double)> &cls_at, double alpha,
+	double mu_start, double mu_max, double tolerance, double step)
+{
+	double lo = 0.0, f_lo = 1.0 - alpha;
+	double hi = min(mu_start, mu_max);
+	double f_hi = cls_at(hi) - alpha;
+	double factor = step;
+	if (f_hi > 0.0) {
+		while (f_hi > 0.0) {
+			if (hi >= mu_max) {
+				return numeric_limits<double>::quiet_NaN();
+			}
+			lo = hi;
+			f_lo = f_hi;
+			hi = min(factor * hi, mu_max);
+			f_hi = cls_at(hi) - alpha;
+			factor *= factor;
+		}
+	}
+	else {
+		// Toy CLs need not rise above alpha however small mu gets (a few toys from the edge of a
+		// distribution): give up a factor 1000 down, and call it 0.
+		bool bracketed = false;
+		while (!bracketed) {
+			double mu = hi / factor;
+			if (mu < 1e-3 * mu_start) {
+				return 0.0;
+			}
+			double f = cls_at(mu) - alpha;
+			if (f > 0.0) {
+				lo = mu;
+				f_lo = f;
+				bracketed = true;
+			}
+			else {
+				hi = mu;
+				f_hi = f;
+			}
+			factor *= factor;
+		}
+	}
+
+	int side = 0;
+	for (int i = 0; i < 200 && hi - lo > tolerance * hi; i++) {
+		double mu = (lo * f_hi - hi * f_lo) / (f_hi - f_lo);
+		if (!(mu > lo && mu < hi) || i % 8 == 7) {
+			mu = 0.5 * (lo + hi);
+		}
+		double margin = 0.5 * tolerance * hi;
+		mu = min(max(mu, lo + margin), hi - margin);
+		double f = cls_at(mu) - alpha;
+		if (f == 0.0) {
+			return mu;
+		}
+		if (f > 0.0) {
+			lo = mu;
+			f_lo = f;
+			if (side == 1) {
+				f_hi *= 0.5;
+			}
+			side = 1;
+		}
+		else {
+			hi = mu;
+			f_hi = f;
+			if (side == -1) {
+				f_lo *= 0.5;
+			}
+			side = -1;
+		}
+	}
+	return (lo * f_hi - hi * f_lo) / (f_hi - f_lo);
+}
+
+abcd_limits abcd_asymptotic_cls::limits(double cl) const
+{
+	double alpha = 1.0 - cl;
+	double mu_max = _observed.upper(abcd_likelihood::mu);
+	double mu_start = max(_observed.guess()[abcd_likelihood::mu], 2.0 * best_fit_mu());
+	auto expected_at = [this, alpha, mu_start, mu_max](double n_sigma) {
+		return cls_upper_limit([this, n_sigma](double mu) { return expected_cls(mu, n_sigma); }, alpha, mu_start, mu_max, 1e-8);
+	};
+
+	abcd_limits result;
+	result.observed = cls_upper_limit([this](double mu) { return cls(mu); }, alpha, mu_start, mu_max, 1e-8);
+	result.median = expected_at(0.0);
+	result.plus_1 = expected_at(1.0);
+	result.minus_1 = expected_at(-1.0);
+	result.plus_2 = expected_at(2.0);
+	result.minus_2 = expected_at(-2.0);
+	return result;
+}
@@ -0,0 +1,73 @@
+// Asymptotic CLs upper limits for the ABCD likelihood, computed directly from abcd_likelihood.
+//
+// This follows what RooStats' AsymptoticCalculator does for the HypoTestInverter setup in
+// HypoTestInvTool (one-sided profile likelihood, CLs, the POI bounded below at 0 so the q~mu
+// formulae of Cowan et al., Eur.Phys.J. C71 (2011) 1554):
+//
+//  - The best fit to the observed data (mu free), and a conditional fit at each tested mu, give the
+//    observed q~mu (0 when the best fit mu is above the tested one).
+//  - The Asimov data set is the expected events with mu = 0 and the nuisance parameters at their
+//    conditional best fit to the observed data at mu = 0. Its q~mu, against its own best fit, sets
+//    the width of the test statistic distribution.
+//  - The expected limits are found from the expected CLs at each mu, worked out from the observed
+//    p-values exactly as HypoTestInverterResult does.
+//
+// Rather than scanning a grid of mu and interpolating, each limit is found as the root of
+// CLs(mu) = 1 - CL directly.
+
+#ifndef __abcd_asymptotic_cls__
+#define __abcd_asymptotic_cls__
+
+#include "abcd_likelihood.h"
+
+#include <functional>
+
+// The observed limit on mu, and the expected limit with its +-1 and +-2 sigma bands. A limit that
+// isn't reached inside the range of mu (CLs is still above 1 - CL at the top) is NaN.
+struct abcd_limits {
+	double observed;
+	double median;
+	double plus_1, minus_1;
+	double plus_2, minus_2;
+};
+
+// The mu where cls_at(mu) falls to alpha, to a relative tolerance. CLs is 1 at mu = 0 and falls as
+// mu grows; the search starts at mu_start and moves by a factor step, then step^2, step^4, ... until
+// it has the crossing between two points. If CLs never gets that low by mu_max there is no limit, and NaN
+// is returned; if it is already that low a factor 1000 below mu_start, 0.
+double cls_upper_limit(const std::function<double(double)> &cls_at, double alpha,
+	double mu_start, double mu_max, double tolerance, double step = 2.0);
+
+class abcd_asymptotic_cls
+{
+public:
+	// Does the fits to the observed data, and builds the Asimov data set.
+	explicit abcd_asymptotic_cls(const abcd_likelihood &model);
+
+	// The best fit signal strength on the observed data.
+	double best_fit_mu() const { return _best.p[abcd_likelihood::mu]; }
+
+	// The one-sided test statistic at mu, for the observed and for the Asimov data.
+	double q_mu(double mu) const;
+	double q_mu_asimov(double mu) const;
+
+	// The p-values at mu: CLs+b (the null p-value) and CLb (the alternate p-value).
+	void p_values(double mu, double &cls_plus_b, double &cl_b) const;
+
+	// CLs at mu, observed and expected (n_sigma away from the median in the background only case).
+	double cls(double mu) const;
+	double expected_cls(double mu, double n_sigma) const;
+
+	// The upper limits on mu at a confidence level cl.
+	abcd_limits limits(double cl = 0.95) const;
+
+private:
+	abcd_likelihood _observed;
+	abcd_likelihood _asimov;
+	abcd_likelihood::fit _best; // Best fit to the observed data
+	abcd_likelihood::fit _best_asimov; // ... and to the Asimov data
+
+	double profile_nll(const abcd_likelihood &l, const abcd_likelihood::point &start, double mu) const;
+};
+
+#endif
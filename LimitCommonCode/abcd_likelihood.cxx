@@ -0,0 +1,470 @@
+//
+// The ABCD likelihood, and a bounded Newton minimizer for it.
+//
+#include "abcd_likelihood.h"
+#include "log_gamma.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+	const int n_par = abcd_likelihood::n_parameters;
+
+	double region(const ABCD &events, int r)
+	{
+		return r == 0 ? events.A : r == 1 ? events.B : r == 2 ? events.C : events.D;
+	}
+
+	// Solve a x = b for the symmetric positive definite n x n matrix a (row stride n_par), in place
+	// of b. Returns false if a isn't positive definite. The system is scaled by its diagonal first,
+	// as the parameters differ in size by many orders of magnitude.
+	bool solve_positive_definite(int n, double a[n_par * n_par], double b[n_par])
+	{
+		double scale[n_par];
+		for (int i = 0; i < n; i++) {
+			if (!(a[i * n_par + i] > 0.0)) {
+				return false;
+			}
+			scale[i] = 1.0 / sqrt(a[i * n_par + i]);
+		}
+		for (int i = 0; i < n; i++) {
+			b[i] *= scale[i];
+			for (int j = 0; j < n; j++) {
+				a[i * n_par + j] *= scale[i] * scale[j];
+			}
+		}
+
+		// Cholesky, a = L L^T, with L in the lower triangle.
+		for (int j = 0; j < n; j++) {
+			double d = a[j * n_par + j];
+			for (int k = 0; k < j; k++) {
+				d -= a[j * n_par + k] * a[j * n_par + k];
+			}
+			if (!(d > 1e-14)) {
+				return false;
+			}
+			d = sqrt(d);
+			a[j * n_par + j] = d;
+			for (int i = j + 1; i < n; i++) {
+				double s = a[i * n_par + j];
+				for (int k = 0; k < j; k++) {
+					s -= a[i * n_par + k] * a[j * n_par + k];
+				}
+				a[i * n_par + j] = s / d;
+			}
+		}
+		for (int i = 0; i < n; i++) {
+			double s = b[i];
+			for (int k = 0; k < i; k++) {
+				s -= a[i * n_par + k] * b[k];
+			}
+			b[i] = s / a[i * n_par + i];
+		}
+		for (int i = n - 1; i >= 0; i--) {
+			double s = b[i];
+			for (int k = i + 1; k < n; k++) {
+				s -= a[k * n_par + i] * b[k];
+			}
+			b[i] = s / a[i * n_par + i];
+		}
+
+		for (int i = 0; i < n; i++) {
+			b[i] *= scale[i];
+		}
+		return true;
+	}
+}
+
+abcd_likelihood::abcd_likelihood(const ABCD &signal, double sigma_lumi, double sigma_S, double sigma_Q)
+	: _signal(signal)
+{
+	_data.A = _data.B = _data.C = _data.D = 0.0;
+	_log_factorials = 0.0;
+
+	// The ranges of the workspace variables.
+	_lower.fill(0.0);
+	_upper[mu] = 1.0;
+	_upper[Nq] = 20000.0;
+	_upper[tauB] = 1000.0;
+	_upper[tauD] = 1000.0;
+	_upper[alpha_lumi] = 10.0;
+	_upper[alpha_S] = 2.0;
+	_upper[alpha_Q] = 2.0;
+	_upper[alpha_B] = 10.0;
+	_upper[alpha_C] = 10.0;
+
+	_constraint_sigma.fill(0.0);
+	_nominal.fill(1.0);
+	_used.fill(false);
+	for (auto p : { mu, Nq, tauB, tauD }) {
+		_used[p] = true;
+	}
+	add_constraint(alpha_lumi, sigma_lumi);
+	add_constraint(alpha_S, sigma_S);
+	add_constraint(alpha_Q, sigma_Q);
+
+	// Signal: mu*Ns0*eff*lumi*alpha_lumi*alpha_S, with eff relative to region A.
+	for (int r = 0; r < 4; r++) {
+		add_term(r, region(signal, r), { mu, alpha_lumi, alpha_S });
+	}
+
+	// Multijet, by the ABCD ansatz.
+	add_term(0, 1.0, { Nq, alpha_Q });
+	add_term(1, 1.0, { Nq, tauB });
+	add_term(2, 1.0, { Nq, tauB, tauD });
+	add_term(3, 1.0, { Nq, tauD });
+}
+
+void abcd_likelihood::add_mc_background(const ABCD &events, double sigma)
+{
+	add_constraint(alpha_B, sigma);
+	for (int r = 0; r < 4; r++) {
+		add_term(r, region(events, r), { alpha_lumi, alpha_B });
+	}
+}
+
+void abcd_likelihood::add_other_background(const ABCD &events, double sigma)
+{
+	add_constraint(alpha_C, sigma);
+	for (int r = 0; r < 4; r++) {
+		add_term(r, region(events, r), { alpha_C });
+	}
+}
+
+void abcd_likelihood::add_term(int r, double coefficient, initializer_list<int> factors)
+{
+	term t;
+	t.coefficient = coefficient;
+	t.n_factors = 0;
+	for (auto f : factors) {
+		t.factor[t.n_factors++] = f;
+	}
+	_terms[r].push_back(t);
+}
+
+void abcd_likelihood::add_constraint(int i, double sigma)
+{
+	_used[i] = true;
+	_constraint_sigma[i] = sigma;
+}
+
+void abcd_likelihood::set_data(const ABCD &data)
+{
+	_data = data;
+	_log_factorials = 0.0;
+	for (int r = 0; r < 4; r++) {
+		_log_factorials += log_gamma(region(data, r) + 1.0);
+	}
+}
+
+double abcd_likelihood::region_data(int r) const
+{
+	return region(_data, r);
+}
+
+bool abcd_likelihood::floating(int i) const
+{
+	return _used[i];
+}
+
+ABCD abcd_likelihood::expected(const point &p) const
+{
+	double e[4];
+	for (int r = 0; r < 4; r++) {
+		e[r] = 0.0;
+		for (const auto &t : _terms[r]) {
+			double v = t.coefficient;
+			for (int k = 0; k < t.n_factors; k++) {
+				v *= p[t.factor[k]];
+			}
+			e[r] += v;
+		}
+	}
+	ABCD result;
+	result.A = e[0];
+	result.B = e[1];
+	result.C = e[2];
+	result.D = e[3];
+	return result;
+}
+
+double abcd_likelihood::nll(const point &p) const
+{
+	auto e = expected(p);
+	double v = _log_factorials;
+	for (int r = 0; r < 4; r++) {
+		double n = region_data(r);
+		double mean = region(e, r);
+		if (n > 0.0) {
+			if (mean <= 0.0) {
+				return numeric_limits<double>::infinity();
+			}
+			v += mean - n * log(mean);
+		}
+		else {
+			v += mean;
+		}
+	}
+	for (int i = 0; i < n_par; i++) {
+		if (_constraint_sigma[i] > 0.0) {
+			double pull = (p[i] - _nominal[i]) / _constraint_sigma[i];
+			v += 0.5 * pull * pull;
+		}
+	}
+	return v;
+}
+
+double abcd_likelihood::nll(const point &p, point &gradient, matrix &hessian) const
+{
+	gradient.fill(0.0);
+	hessian.fill(0.0);
+
+	double v = _log_factorials;
+	for (int r = 0; r < 4; r++) {
+		// The expected events, and their first and second derivatives.
+		double mean = 0.0;
+		double d_mean[n_par] = { 0.0 };
+		double dd_mean[n_par * n_par] = { 0.0 };
+		for (const auto &t : _terms[r]) {
+			double value = t.coefficient;
+			for (int k = 0; k < t.n_factors; k++) {
+				value *= p[t.factor[k]];
+			}
+			mean += value;
+
+			// Products leaving out one or two factors - by multiplying rather than dividing, so a
+			// parameter sitting at 0 is no problem.
+			for (int a = 0; a < t.n_factors; a++) {
+				double without_a = t.coefficient;
+				for (int k = 0; k < t.n_factors; k++) {
+					if (k != a) {
+						without_a *= p[t.factor[k]];
+					}
+				}
+				d_mean[t.factor[a]] += without_a;
+				for (int b = 0; b < t.n_factors; b++) {
+					if (b == a) {
+						continue;
+					}
+					double without_ab = t.coefficient;
+					for (int k = 0; k < t.n_factors; k++) {
+						if (k != a && k != b) {
+							without_ab *= p[t.factor[k]];
+						}
+					}
+					dd_mean[t.factor[a] * n_par + t.factor[b]] += without_ab;
+				}
+			}
+		}
+
+		// -log Poisson(n; mean) = mean - n log(mean) + log(n!)
+		double n = region_data(r);
+		double d1, d2;
+		if (n > 0.0) {
+			if (mean <= 0.0) {
+				return numeric_limits<double>::infinity();
+			}
+			v += mean - n * log(mean);
+			d1 = 1.0 - n / mean;
+			d2 = n / (mean * mean);
+		}
+		else {
+			v += mean;
+			d1 = 1.0;
+			d2 = 0.0;
+		}
+		for (int i = 0; i < n_par; i++) {
+			gradient[i] += d1 * d_mean[i];
+			for (int j = 0; j < n_par; j++) {
+				hessian[i * n_par + j] += d2 * d_mean[i] * d_mean[j] + d1 * dd_mean[i * n_par + j];
+			}
+		}
+	}
+
+	for (int i = 0; i < n_par; i++) {
+		if (_constraint_sigma[i] > 0.0) {
+			double s2 = _constraint_sigma[i] * _constraint_sigma[i];
+			v += 0.5 * (p[i] - _nominal[i]) * (p[i] - _nominal[i]) / s2;
+			gradient[i] += (p[i] - _nominal[i]) / s2;
+			hessian[i * n_par + i] += 1.0 / s2;
+		}
+	}
+	return v;
+}
+
+abcd_likelihood::point abcd_likelihood::guess() const
+{
+	point p;
+	p.fill(1.0);
+
+	double nq_A = _data.C > 0.0 ? _data.B * _data.D / _data.C : 0.0;
+	for (const auto &t : _terms[0]) {
+		// Take off the other backgrounds in A (the terms without mu or Nq).
+		if (t.factor[0] != mu && t.factor[0] != Nq) {
+			nq_A -= t.coefficient;
+		}
+	}
+	if (nq_A <= 0.0) {
+		nq_A = 3.0;
+	}
+	p[Nq] = nq_A;
+	p[tauB] = _data.B > 0.0 ? _data.B / nq_A : 3.0;
+	p[tauD] = _data.D > 0.0 ? _data.D / nq_A : 3.0;
+	p[mu] = _signal.A > 0.0 ? min(3.0 / _signal.A, _upper[mu]) : 0.0;
+	return p;
+}
+
+namespace {
+	// The multijet normalization and its ratios are only ever multiplied together, and when there is
+	// a lot of signal the best fit can run off along Nq*tauD = constant, Nq -> 0. That valley is
+	// a hyperbola in the parameters, but a straight line in their logs - so these are stepped in log.
+	bool log_step(int i)
+	{
+		return i == abcd_likelihood::Nq || i == abcd_likelihood::tauB || i == abcd_likelihood::tauD;
+	}
+
+	// The gradient and Hessian with respect to the step variables (log x for the log_step ones).
+	void to_step_variables(const abcd_likelihood::point &p, const abcd_likelihood::point &g, const abcd_likelihood::matrix &h,
+		abcd_likelihood::point &g_step, abcd_likelihood::matrix &h_step)
+	{
+		double scale[n_par];
+		for (int i = 0; i < n_par; i++) {
+			scale[i] = log_step(i) ? p[i] : 1.0;
+		}
+		for (int i = 0; i < n_par; i++) {
+			g_step[i] = scale[i] * g[i];
+			for (int j = 0; j < n_par; j++) {
+				h_step[i * n_par + j] = scale[i] * scale[j] * h[i * n_par + j];
+			}
+			if (log_step(i)) {
+				h_step[i * n_par + i] += g_step[i];
+			}
+		}
+	}
+}
+
+// Newton's method, kept inside the parameter ranges. A parameter sitting on the edge of its range
+// with the gradient pushing it out is held there for that step. If the full Newton step doesn't lower
+// -log L (or the Hessian isn't positive definite), the step is damped, Levenberg-Marquardt style,
+// until it does.
+abcd_likelihood::fit abcd_likelihood::minimize(point start, bool fix_mu) const
+{
+	fit result;
+	result.p = start;
+	result.iterations = 0;
+	result.converged = false;
+
+	bool free[n_par];
+	for (int i = 0; i < n_par; i++) {
+		free[i] = floating(i) && !(fix_mu && i == mu);
+		result.p[i] = min(max(result.p[i], _lower[i]), _upper[i]);
+		if (!floating(i)) {
+			result.p[i] = 1.0;
+		}
+		if (log_step(i) && result.p[i] <= 0.0) {
+			result.p[i] = 1e-6;
+		}
+	}
+
+	point p_g, g;
+	matrix p_h, h;
+	result.nll = nll(result.p, p_g, p_h);
+	if (!std::isfinite(result.nll)) {
+		return result;
+	}
+	to_step_variables(result.p, p_g, p_h, g, h);
+
+	double lambda = 0.0;
+	const int max_iterations = 500;
+	for (; result.iterations < max_iterations; result.iterations++) {
+		// The parameters we can move this step.
+		int index[n_par];
+		int n = 0;
+		for (int i = 0; i < n_par; i++) {
+			if (!free[i]) {
+				continue;
+			}
+			if ((result.p[i] <= _lower[i] && g[i] > 0.0) || (result.p[i] >= _upper[i] && g[i] < 0.0)) {
+				continue;
+			}
+			index[n++] = i;
+		}
+		if (n == 0) {
+			result.converged = true;
+			break;
+		}
+
+		// The (damped) Newton step.
+		double a[n_par * n_par], step[n_par];
+		bool solved = false;
+		while (!solved) {
+			for (int i = 0; i < n; i++) {
+				step[i] = -g[index[i]];
+				for (int j = 0; j < n; j++) {
+					a[i * n_par + j] = h[index[i] * n_par + index[j]];
+				}
+				double diag = h[index[i] * n_par + index[i]];
+				a[i * n_par + i] += lambda * (diag > 0.0 ? diag : 1.0);
+			}
+			solved = solve_positive_definite(n, a, step);
+			if (!solved) {
+				lambda = lambda == 0.0 ? 1e-6 : lambda * 10.0;
+				if (lambda > 1e20) {
+					return result;
+				}
+			}
+		}
+
+		// Close enough: the Newton decrement says we can gain almost nothing more.
+		double decrement = 0.0;
+		for (int i = 0; i < n; i++) {
+			decrement -= g[index[i]] * step[i];
+		}
+		if (lambda < 1.0 && decrement < 1e-12) {
+			result.converged = true;
+			break;
+		}
+
+		point trial = result.p;
+		for (int i = 0; i < n; i++) {
+			int k = index[i];
+			if (log_step(k)) {
+				trial[k] = min(trial[k] * exp(max(step[i], -50.0)), _upper[k]);
+			}
+			else {
+				trial[k] = min(max(trial[k] + step[i], _lower[k]), _upper[k]);
+			}
+		}
+		point trial_g;
+		matrix trial_h;
+		double trial_nll = nll(trial, trial_g, trial_h);
+		bool rounding = fabs(trial_nll - result.nll) < 1e-13 * (1.0 + fabs(result.nll));
+		if (rounding && decrement < 1e-9) {
+			// Any change is lost in the rounding of -log L.
+			if (trial_nll < result.nll) {
+				result.p = trial;
+				result.nll = trial_nll;
+			}
+			result.converged = true;
+			break;
+		}
+		if (std::isfinite(trial_nll) && trial_nll <= result.nll) {
+			result.p = trial;
+			result.nll = trial_nll;
+			to_step_variables(trial, trial_g, trial_h, g, h);
+			lambda = lambda < 1e-4 ? 0.0 : lambda * 0.01;
+		}
+		else {
+			lambda = lambda == 0.0 ? 1e-4 : lambda * 10.0;
+			if (lambda > 1e20) {
+				// No step lowers -log L: we are as close to the minimum as rounding allows.
+				result.converged = decrement < 1e-6;
+				break;
+			}
+		}
+	}
+	return result;
+}
@@ -0,0 +1,113 @@
+// The ABCD likelihood of run_ABCD.cxx, written out by hand.
+//
+// The RooFit model is four Poisson terms (one per region), a Gaussian constraint for each systematic
+// nuisance parameter, and a few products. That is simple enough to evaluate directly, with the
+// gradient and Hessian in closed form, so a profile fit is a handful of Newton steps rather than a
+// Minuit minimization over a RooFit expression graph. The parameters, their ranges, and the
+// constants are exactly those of the workspace simultaneousABCD builds:
+//
+//   E_A = mu*Ns0*lumi*alpha_lumi*alpha_S       + Nq*lumi*alpha_Q      (+ MC and other backgrounds)
+//   E_B = mu*Ns0*effB*lumi*alpha_lumi*alpha_S  + Nq*lumi*tauB
+//   E_C = mu*Ns0*effC*lumi*alpha_lumi*alpha_S  + Nq*lumi*tauB*tauD
+//   E_D = mu*Ns0*effD*lumi*alpha_lumi*alpha_S  + Nq*lumi*tauD
+//
+// The MC background in each region is Nb*lumi*alpha_lumi*alpha_B, and the other data driven
+// background Nc*lumi*alpha_C. Each alpha has a Gaussian constraint about its global observable
+// (1, unless a toy has moved it). lumi is fixed at 1.
+//
+// No ROOT at all, so it can be used from many threads at once (each with its own copy if they are
+// fitting different data).
+
+#ifndef __abcd_likelihood__
+#define __abcd_likelihood__
+
+#include "limit_datastructures.h"
+
+#include <array>
+#include <vector>
+#include <initializer_list>
+
+class abcd_likelihood
+{
+public:
+	// The parameters of the model. alpha_B and alpha_C are only used if the MC or other background
+	// is included; otherwise they stay fixed at 1.
+	enum parameter {
+		mu, Nq, tauB, tauD, alpha_lumi, alpha_S, alpha_Q, alpha_B, alpha_C,
+		n_parameters
+	};
+	typedef std::array<double, n_parameters> point;
+	typedef std::array<double, n_parameters * n_parameters> matrix;
+
+	// The model for a signal (the events expected in each region at mu = 1) and the systematic errors
+	// on the luminosity, the signal efficiency (mc_eff) and the ABCD method.
+	abcd_likelihood(const ABCD &signal, double sigma_lumi, double sigma_S, double sigma_Q);
+
+	// Add the MC background (useB) or the other data driven background (useC) to the model.
+	void add_mc_background(const ABCD &events, double sigma = 0.32);
+	void add_other_background(const ABCD &events, double sigma = 0.32);
+
+	// The observed events in each region. They need not be whole numbers (Asimov data isn't).
+	void set_data(const ABCD &data);
+	const ABCD &data() const { return _data; }
+
+	// The global observables: the centre of each constraint. 1 for the observed data; toys that
+	// fluctuate them move them about.
+	void set_global_observables(const point &nominal) { _nominal = nominal; }
+	const point &global_observables() const { return _nominal; }
+
+	// The width of the constraint on parameter i (0 if it has none).
+	double constraint_sigma(int i) const { return _constraint_sigma[i]; }
+
+	// The events expected in each region at p.
+	ABCD expected(const point &p) const;
+
+	// -log L at p (the Poisson terms in full, the constraints without their normalization, so it
+	// differs from RooFit's value by a constant). Infinite if a region with events in it expects none.
+	double nll(const point &p) const;
+
+	// ... and its gradient and Hessian.
+	double nll(const point &p, point &gradient, matrix &hessian) const;
+
+	// Which parameters are free, and their ranges.
+	bool floating(int i) const;
+	double lower(int i) const { return _lower[i]; }
+	double upper(int i) const { return _upper[i]; }
+
+	// A starting point for fits: the background from the plain ABCD estimate, mu from 3 signal
+	// events in A, and all the alphas at 1.
+	point guess() const;
+
+	// Minimize -log L, with mu held fixed at its value in start or left free.
+	struct fit {
+		point p;
+		double nll;
+		int iterations;
+		bool converged;
+	};
+	fit minimize(point start, bool fix_mu) const;
+
+private:
+	// The expected events in a region are a sum of terms, each a constant times a product of
+	// parameters (each at most once).
+	struct term {
+		double coefficient;
+		int n_factors;
+		int factor[4];
+	};
+
+	void add_term(int region, double coefficient, std::initializer_list<int> factors);
+	void add_constraint(int i, double sigma);
+	double region_data(int region) const;
+
+	ABCD _signal;
+	ABCD _data;
+	double _log_factorials; // The log n! terms for the data, which never change
+	std::vector<term> _terms[4];
+	std::array<double, n_parameters> _lower, _upper;
+	std::array<double, n_parameters> _constraint_sigma; // 0 if there is no constraint
+	point _nominal;
+	std::array<bool, n_parameters> _used;
+};
+
+#endif
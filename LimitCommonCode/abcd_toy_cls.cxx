@@ -0,0 +1,411 @@
+//
+// Toy based CLs limits for the ABCD likelihood.
+//
+#include "abcd_toy_cls.h"
+#include "log_gamma.h"
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+using namespace std;
+
+namespace {
+	const int n_par = abcd_likelihood::n_parameters;
+
+	// Toys are thrown and fit this many at a time.
+	const size_t batch_size = 64;
+
+	const double two_pi = 6.28318530717958648;
+
+	// The splitmix64 finalizer: a good 64 bit hash, so random numbers can be made from a counter.
+	inline uint64_t mix64(uint64_t z)
+	{
+		z += 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	// A uniform number in (0, 1) from the top 53 bits.
+	inline double to_uniform(uint64_t x)
+	{
+		return ((x >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+	}
+
+	// The Poisson cumulative distribution for one mean, over the range of counts that can turn
+	// up, so a count is a binary search for a uniform number (the inverse transform).
+	class poisson_table
+	{
+	public:
+		explicit poisson_table(double mean)
+			: _first(0)
+		{
+			if (!(mean > 0.0)) {
+				_cdf.push_back(1.0);
+				return;
+			}
+			double width = sqrt(mean);
+			_first = (int)max(0.0, floor(mean - 12.0 * width - 12.0));
+			double log_mean = log(mean);
+			double sum = 0.0;
+			for (int k = _first; ; k++) {
+				double pmf = exp(k * log_mean - mean - log_gamma(k + 1.0));
+				sum += pmf;
+				_cdf.push_back(sum);
+				if (k > mean + 12.0 * width + 12.0 || (k > mean && pmf < 1e-18)) {
+					break;
+				}
+			}
+			// Whatever is left in the far tails goes in the last bin.
+			_cdf.back() = 1.0;
+		}
+
+		double count(double u) const
+		{
+			return _first + (double)(lower_bound(_cdf.begin(), _cdf.end(), u) - _cdf.begin());
+		}
+
+	private:
+		int _first;
+		vector<double> _cdf;
+	};
+
+	// Throws toys from the model at one point. Toy i gets its random numbers from a hash of the
+	// seed, the stream, and i, and nothing else.
+	class toy_thrower
+	{
+	public:
+		toy_thrower(const abcd_likelihood &l, const abcd_likelihood::point &p, uint64_t seed, int stream, bool fluctuate_globals)
+			: _p(p), _key(mix64(seed ^ mix64((uint64_t)stream << 48))), _globals(fluctuate_globals)
+		{
+			auto e = l.expected(p);
+			_tables.push_back(poisson_table(e.A));
+			_tables.push_back(poisson_table(e.B));
+			_tables.push_back(poisson_table(e.C));
+			_tables.push_back(poisson_table(e.D));
+			for (int i = 0; i < n_par; i++) {
+				_sigma[i] = l.constraint_sigma(i);
+			}
+		}
+
+		// Toys first to first+n (n no more than batch_size). The random numbers, and the Gaussians
+		// made from them, are done for the whole batch at once, one draw at a time.
+		void throw_batch(size_t first, size_t n, ABCD *data, abcd_likelihood::point *nominal) const
+		{
+			const int n_draws = 4 + 2 * n_par;
+			uint64_t key[batch_size];
+			double u[n_draws][batch_size];
+			for (size_t j = 0; j < n; j++) {
+				key[j] = mix64(_key + first + j);
+			}
+			for (int k = 0; k < n_draws; k++) {
+				const uint64_t offset = (k + 1) * 0x9e3779b97f4a7c15ULL;
+				for (size_t j = 0; j < n; j++) {
+					u[k][j] = to_uniform(mix64(key[j] ^ offset));
+				}
+			}
+
+			for (size_t j = 0; j < n; j++) {
+				data[j].A = _tables[0].count(u[0][j]);
+				data[j].B = _tables[1].count(u[1][j]);
+				data[j].C = _tables[2].count(u[2][j]);
+				data[j].D = _tables[3].count(u[3][j]);
+				nominal[j].fill(1.0);
+			}
+
+			if (!_globals) {
+				return;
+			}
+			for (int i = 0; i < n_par; i++) {
+				if (_sigma[i] <= 0.0) {
+					continue;
+				}
+				const double *u1 = u[4 + 2 * i];
+				const double *u2 = u[5 + 2 * i];
+				double z[batch_size];
+				for (size_t j = 0; j < n; j++) {
+					z[j] = sqrt(-2.0 * log(u1[j])) * cos(two_pi * u2[j]);
+				}
+				for (size_t j = 0; j < n; j++) {
+					nominal[j][i] = _p[i] + _sigma[i] * z[j];
+				}
+			}
+		}
+
+	private:
+		abcd_likelihood::point _p;
+		uint64_t _key;
+		bool _globals;
+		vector<poisson_table> _tables;
+		double _sigma[n_par];
+	};
+
+	// Run work(first, n, thread) over [0, n_items) a batch at a time, with the batches handed out
+	// to n_threads threads as they become free. Which thread does a batch makes no difference to
+	// what comes out.
+	void for_each_batch(size_t n_items, int n_threads, const function<void(size_t, size_t, int)> &work)
+	{
+		size_t n_batches = (n_items + batch_size - 1) / batch_size;
+		atomic<size_t> next(0);
+		auto worker = [&](int i_thread) {
+			for (size_t b = next++; b < n_batches; b = next++) {
+				size_t first = b * batch_size;
+				work(first, min(batch_size, n_items - first), i_thread);
+			}
+		};
+
+		if (n_threads <= 1 || n_batches <= 1) {
+			worker(0);
+			return;
+		}
+		vector<thread> threads;
+		for (int i = 1; i < n_threads; i++) {
+			threads.push_back(thread(worker, i));
+		}
+		worker(0);
+		for (auto &t : threads) {
+			t.join();
+		}
+	}
+
+	// The Phi(n_sigma) quantile of some numbers (sorted), interpolating between them as
+	// TMath::Quantiles does by default.
+	double quantile(const vector<double> &sorted, double p)
+	{
+		double h = (sorted.size() - 1) * p;
+		size_t i = (size_t)floor(h);
+		if (i + 1 >= sorted.size()) {
+			return sorted.back();
+		}
+		return sorted[i] + (h - i) * (sorted[i + 1] - sorted[i]);
+	}
+}
+
+abcd_toy_cls::abcd_toy_cls(const abcd_likelihood &model, const abcd_toy_config &config)
+	: _observed(model), _config(config), _n_failed_fits(0)
+{
+	if (_config.n_toys <= 0 || _config.n_toys_ratio <= 0.0) {
+		throw runtime_error("The number of toys and the toy ratio must be positive");
+	}
+	_n_threads = _config.n_threads > 0 ? _config.n_threads : (int)thread::hardware_concurrency();
+	if (_n_threads < 1) {
+		_n_threads = 1;
+	}
+
+	// Best fit to the observed data, and the background only fit the background only toys are
+	// thrown from.
+	_best = _observed.minimize(_observed.guess(), false);
+	if (!_best.converged) {
+		throw runtime_error("Unable to find the best fit to the observed data in the ABCD likelihood");
+	}
+	_background_only = fit_observed(0.0);
+
+	// The background only toys, fit once.
+	size_t n_alt = max(1, (int)(_config.n_toys / _config.n_toys_ratio));
+	_alt_data.resize(n_alt);
+	_alt_nominal.resize(n_alt);
+	_alt_best.resize(n_alt);
+	toy_thrower thrower(_observed, _background_only.p, _config.seed, alt_stream, _config.fluctuate_globals);
+	vector<abcd_likelihood> models(_n_threads, _observed);
+	vector<long> n_failed(_n_threads, 0);
+	for_each_batch(n_alt, _n_threads, [&](size_t first, size_t n, int i_thread) {
+		thrower.throw_batch(first, n, &_alt_data[first], &_alt_nominal[first]);
+		auto &l = models[i_thread];
+		for (size_t i = first; i < first + n; i++) {
+			l.set_data(_alt_data[i]);
+			l.set_global_observables(_alt_nominal[i]);
+			_alt_best[i] = fit(l, _background_only.p, false, n_failed[i_thread]);
+		}
+	});
+	for (auto n : n_failed) {
+		_n_failed_fits += n;
+	}
+}
+
+// The conditional fit to the observed data at mu.
+abcd_likelihood::fit abcd_toy_cls::fit_observed(double mu) const
+{
+	auto start = _best.p;
+	start[abcd_likelihood::mu] = mu;
+	auto f = _observed.minimize(start, true);
+	if (!f.converged) {
+		throw runtime_error("Unable to do the conditional fit to the observed data in the ABCD likelihood");
+	}
+	return f;
+}
+
+// Fit a toy, starting close by. Should that fail, try again from the usual starting guess, and
+// keep whichever is better - as with a failed Minuit fit, the toy is still used.
+abcd_likelihood::fit abcd_toy_cls::fit(abcd_likelihood &l, const abcd_likelihood::point &start, bool fix_mu, long &n_failed) const
+{
+	auto f = l.minimize(start, fix_mu);
+	if (!f.converged) {
+		auto restart = l.guess();
+		restart[abcd_likelihood::mu] = start[abcd_likelihood::mu];
+		auto second = l.minimize(restart, fix_mu);
+		if (second.converged || !(f.nll <= second.nll)) {
+			f = second;
+		}
+		if (!f.converged) {
+			n_failed++;
+		}
+	}
+	return f;
+}
+
+// The one sided test statistic at mu, given the best fit.
+double abcd_toy_cls::q_mu(abcd_likelihood &l, const abcd_likelihood::fit &best, double mu, long &n_failed) const
+{
+	if (best.p[abcd_likelihood::mu] >= mu) {
+		return 0.0;
+	}
+	auto start = best.p;
+	start[abcd_likelihood::mu] = mu;
+	auto conditional = fit(l, start, true, n_failed);
+	return max(0.0, 2.0 * (conditional.nll - best.nll));
+}
+
+// The test statistic at mu for the data and all the toys: the signal+background toys are thrown
+// at mu, the background only ones are reused.
+const abcd_toy_cls::scan_point &abcd_toy_cls::at(double mu)
+{
+	auto found = _scan.find(mu);
+	if (found != _scan.end()) {
+		return found->second;
+	}
+
+	scan_point s;
+	auto null_fit = fit_observed(mu);
+	s.q_observed = best_fit_mu() >= mu ? 0.0 : max(0.0, 2.0 * (null_fit.nll - _best.nll));
+
+	size_t n_null = _config.n_toys;
+	size_t n_alt = _alt_data.size();
+	s.q_null.resize(n_null);
+	s.q_alt.resize(n_alt);
+
+	toy_thrower thrower(_observed, null_fit.p, _config.seed, null_stream, _config.fluctuate_globals);
+	vector<abcd_likelihood> models(_n_threads, _observed);
+	vector<long> n_failed(_n_threads, 0);
+	for_each_batch(n_null, _n_threads, [&](size_t first, size_t n, int i_thread) {
+		ABCD data[batch_size];
+		abcd_likelihood::point nominal[batch_size];
+		thrower.throw_batch(first, n, data, nominal);
+		auto &l = models[i_thread];
+		for (size_t j = 0; j < n; j++) {
+			l.set_data(data[j]);
+			l.set_global_observables(nominal[j]);
+			auto best = fit(l, null_fit.p, false, n_failed[i_thread]);
+			s.q_null[first + j] = q_mu(l, best, mu, n_failed[i_thread]);
+		}
+	});
+	for_each_batch(n_alt, _n_threads, [&](size_t first, size_t n, int i_thread) {
+		auto &l = models[i_thread];
+		for (size_t i = first; i < first + n; i++) {
+			l.set_data(_alt_data[i]);
+			l.set_global_observables(_alt_nominal[i]);
+			s.q_alt[i] = q_mu(l, _alt_best[i], mu, n_failed[i_thread]);
+		}
+	});
+	for (auto n : n_failed) {
+		_n_failed_fits += n;
+	}
+
+	sort(s.q_null.begin(), s.q_null.end());
+	sort(s.q_alt.begin(), s.q_alt.end());
+	return _scan[mu] = s;
+}
+
+void abcd_toy_cls::p_values(double mu, double &cls_plus_b, double &cl_b)
+{
+	const auto &s = at(mu);
+	auto n_null_above = s.q_null.end() - lower_bound(s.q_null.begin(), s.q_null.end(), s.q_observed);
+	auto n_alt_above = s.q_alt.end() - lower_bound(s.q_alt.begin(), s.q_alt.end(), s.q_observed);
+	cls_plus_b = (double)n_null_above / s.q_null.size();
+	cl_b = (double)n_alt_above / s.q_alt.size();
+}
+
+double abcd_toy_cls::cls(double mu)
+{
+	double cls_plus_b, cl_b;
+	p_values(mu, cls_plus_b, cl_b);
+	return cl_b > 0.0 ? cls_plus_b / cl_b : 0.0;
+}
+
+// As HypoTestInverterResult::GetExpectedPValueDist: the CLs each background only toy would have
+// given had it been the data, and then the quantile of those.
+double abcd_toy_cls::expected_cls(double mu, double n_sigma)
+{
+	const auto &s = at(mu);
+	vector<double> toy_cls(s.q_alt.size());
+	for (size_t j = 0; j < s.q_alt.size(); j++) {
+		double q = s.q_alt[j];
+		auto n_null_above = s.q_null.end() - lower_bound(s.q_null.begin(), s.q_null.end(), q);
+		auto n_alt_above = s.q_alt.end() - lower_bound(s.q_alt.begin(), s.q_alt.end(), q);
+		toy_cls[j] = ((double)n_null_above / s.q_null.size()) / ((double)n_alt_above / s.q_alt.size());
+	}
+	sort(toy_cls.begin(), toy_cls.end());
+	return quantile(toy_cls, 0.5 * erfc(-n_sigma / sqrt(2.0)));
+}
+
+// Where to start looking for a crossing: between the two mu's already done that bracket it, if
+// there are any, otherwise at the asymptotic limit. Looking at a mu already done costs no fits.
+double abcd_toy_cls::starting_mu(const function<double(double)> &cls_at, double alpha, double asymptotic)
+{
+	double lo = 0.0, f_lo = 1.0 - alpha;
+	double hi = -1.0, f_hi = 0.0;
+	vector<double> done;
+	for (const auto &s : _scan) {
+		done.push_back(s.first);
+	}
+	for (auto mu : done) {
+		double f = cls_at(mu) - alpha;
+		if (f > 0.0) {
+			if (hi < 0.0) {
+				lo = mu;
+				f_lo = f;
+			}
+		}
+		else if (hi < 0.0) {
+			hi = mu;
+			f_hi = f;
+		}
+	}
+	if (hi < 0.0 || lo == 0.0) {
+		return asymptotic;
+	}
+	return (lo * f_hi - hi * f_lo) / (f_hi - f_lo);
+}
+
+// The toy CLs curves are only known to a few percent, so once a limit has a good starting point
+// the crossing is bracketed in small steps.
+abcd_limits abcd_toy_cls::limits(double cl, double tolerance)
+{
+	double alpha = 1.0 - cl;
+	double mu_max = _observed.upper(abcd_likelihood::mu);
+	const double step = 1.1;
+	auto asymptotic = abcd_asymptotic_cls(_observed).limits(cl);
+
+	auto limit = [&](const function<double(double)> &cls_at, double asymptotic_limit) {
+		if (std::isnan(asymptotic_limit)) {
+			// No asymptotic limit in range either: start at the top, so an unbounded toy limit is found at once.
+			asymptotic_limit = mu_max;
+		}
+		return cls_upper_limit(cls_at, alpha, starting_mu(cls_at, alpha, asymptotic_limit), mu_max, tolerance, step);
+	};
+	auto expected_at = [&](double n_sigma, double asymptotic_limit) {
+		return limit([this, n_sigma](double mu) { return expected_cls(mu, n_sigma); }, asymptotic_limit);
+	};
+
+	abcd_limits result;
+	result.observed = limit([this](double mu) { return cls(mu); }, asymptotic.observed);
+	result.median = expected_at(0.0, asymptotic.median);
+	result.plus_1 = expected_at(1.0, asymptotic.plus_1);
+	result.minus_1 = expected_at(-1.0, asymptotic.minus_1);
+	result.plus_2 = expected_at(2.0, asymptotic.plus_2);
+	result.minus_2 = expected_at(-2.0, asymptotic.minus_2);
+	return result;
+}
@@ -0,0 +1,107 @@
+// Toy based (frequentist) CLs upper limits for the ABCD likelihood, computed directly from
+// abcd_likelihood.
+//
+// This follows the FrequentistCalculator setup in HypoTestInvTool (calcType 0, one-sided profile
+// likelihood test statistic, CLs):
+//
+//  - The toys for a tested mu are generated with the nuisance parameters at their conditional best
+//    fit to the observed data at that mu; the background only toys with them at their best fit at
+//    mu = 0. There are n_toys of the first and n_toys/n_toys_ratio of the second.
+//  - CLs+b is the fraction of the signal+background toys with q_mu at or above the observed one,
+//    CLb the fraction of background only toys at or above it (both are right tail p-values, as in
+//    RooStats' HypoTestResult).
+//  - The expected limits come from the CLs each background only toy would have had, as
+//    HypoTestInverterResult does it: the n_sigma band uses the Phi(n_sigma) quantile.
+//
+// The differences from running the RooStats toys:
+//
+//  - Toy i always uses the same random numbers, whichever mu it is generated at and whichever thread
+//    does it. So the result depends only on the seed, not on the number of threads, and CLs moves
+//    smoothly enough with mu that each limit can be solved for directly rather than read off a scan.
+//  - The background only toys don't depend on the tested mu, so they are thrown (and fit without
+//    a constraint on mu) once, and reused at every mu (RooStats' ReuseAltToys).
+//  - The workspace declares no global observables, so RooStats leaves the constraints where they
+//    are in the toys. The same is done here by default; fluctuate_globals moves them about in each
+//    toy as well (without the ranges RooFit would truncate them to).
+//
+// The toys are thrown a batch at a time: every toy in a batch has the same expected events, so the
+// Poisson cumulative distribution is worked out once per batch and each count is a lookup in it.
+
+#ifndef __abcd_toy_cls__
+#define __abcd_toy_cls__
+
+#include "abcd_likelihood.h"
+#include "abcd_asymptotic_cls.h"
+
+#include <vector>
+#include <map>
+#include <functional>
+#include <cstdint>
+
+struct abcd_toy_config {
+	int n_toys; // Signal+background toys at each mu
+	double n_toys_ratio; // ... and n_toys/n_toys_ratio background only toys
+	int n_threads; // Threads to fit the toys with; 0 for all the cores there are
+	uint64_t seed;
+	bool fluctuate_globals; // Move the global observables about in each toy too
+
+	abcd_toy_config()
+		: n_toys(5000), n_toys_ratio(2.0), n_threads(0), seed(4357), fluctuate_globals(false)
+	{}
+};
+
+class abcd_toy_cls
+{
+public:
+	// Does the fits to the observed data, then throws and fits the background only toys.
+	abcd_toy_cls(const abcd_likelihood &model, const abcd_toy_config &config = abcd_toy_config());
+
+	double best_fit_mu() const { return _best.p[abcd_likelihood::mu]; }
+
+	// The p-values at mu: CLs+b (the null p-value) and CLb (the alternate p-value).
+	void p_values(double mu, double &cls_plus_b, double &cl_b);
+
+	// CLs at mu, observed and expected (n_sigma away from the median in the background only case).
+	double cls(double mu);
+	double expected_cls(double mu, double n_sigma);
+
+	// The upper limits on mu at a confidence level cl, each found to a relative tolerance (the
+	// statistical error from 5000 toys is a good deal larger than the default).
+	abcd_limits limits(double cl = 0.95, double tolerance = 5e-3);
+
+	// How many times the toys have been thrown at a new mu, and how many toy fits failed to converge.
+	int n_evaluations() const { return (int)_scan.size(); }
+	long n_failed_fits() const { return _n_failed_fits; }
+
+private:
+	// The test statistic at one mu: for the data and every toy (the toy ones sorted).
+	struct scan_point {
+		double q_observed;
+		std::vector<double> q_null;
+		std::vector<double> q_alt;
+	};
+
+	abcd_likelihood _observed;
+	abcd_toy_config _config;
+	int _n_threads;
+	abcd_likelihood::fit _best; // Best fit to the observed data
+	abcd_likelihood::fit _background_only; // ... and at mu = 0
+
+	// The background only toys (their counts and global observables), and the best fit to each.
+	std::vector<ABCD> _alt_data;
+	std::vector<abcd_likelihood::point> _alt_nominal;
+	std::vector<abcd_likelihood::fit> _alt_best;
+
+	std::map<double, scan_point> _scan;
+	long _n_failed_fits;
+
+	enum { null_stream = 1, alt_stream = 2 };
+
+	const scan_point &at(double mu);
+	double starting_mu(const std::function<double(double)> &cls_at, double alpha, double asymptotic);
+	abcd_likelihood::fit fit_observed(double mu) const;
+	abcd_likelihood::fit fit(abcd_likelihood &l, const abcd_likelihood::point &start, bool fix_mu, long &n_failed) const;
+	double q_mu(abcd_likelihood &l, const abcd_likelihood::fit &best, double mu, long &n_failed) const;
+};
+
+#endif
@@ -4,12 +4,14 @@
 #include "limitSetting.h"
 #include "extrap_file_wrapper.h"
 #include "limit_output_file.h"
+#include "limit_worker_pool.h"
 
 #include "TH1.h"
 
 #include "SimulABCD.h"
 
 #include <algorithm>
+#include <string>
 
 using namespace std;
 
@@ -53,16 +55,23 @@ void extrapolate_limit_to_lifetime(const extrap_file_wrapper &input,
 	const ABCD &dataObserved,
 	const abcd_limit_config &limit_params)
 {
-	// For each lifetime in the input, rescale the limit till we have a limit number for all
-	// the outputs.
+	// Do the limit at each lifetime in the input. Each is a full hypothesis test inversion, so they
+	// are spread over worker processes. The signal at each lifetime is read up front: the workers share
+	// the input file's handle, so must not read it themselves. Every worker writes its own limit
+	// calculation workspace.
 	auto lifetimes = input.list_of_lifetimes();
-	vector<limit_result> results;
-	transform(lifetimes.begin(), lifetimes.end(), back_inserter(results),
-		[&input, &dataObserved, &limit_params](double ctau)
+	vector<signal_lifetime> signals;
+	transform(lifetimes.begin(), lifetimes.end(), back_inserter(signals),
+		[&input](double ctau) { return input.lifetime(ctau); });
+
+	auto results = run_limits_in_workers(signals.size(), limit_params.nWorkers,
+		[&signals, &dataObserved, &limit_params](size_t i_tau, int i_worker)
 	{
-		// Get the signal info and do the lmit.
-		auto signal = input.lifetime(ctau);
-		return do_abcd_limit(dataObserved, signal, limit_params);
+		auto worker_params = limit_params;
+		if (limit_params.nWorkers > 1) {
+			worker_params.fileName = prefix_file_name("worker" + to_string(i_worker) + "_", limit_params.fileName);
+		}
+		return do_abcd_limit(dataObserved, signals[i_tau], worker_params);
 	}
 	);
 
@@ -27,12 +27,14 @@ struct signal_lifetime {
 // Control how the limit is actually run
 struct abcd_limit_config {
 	bool useToys; // True if we should run toys, otherwise run asym fit.
+	bool nativeLikelihood; // Use abcd_likelihood rather than RooFit/RooStats (toys or asym fit)
 	bool scaleLimitByEfficiency; // True if we should run limit once, and rescale result. False we re-run limit at each lifetime point.
 	std::string fileName; // Output filename for this
 	double rescaleSignalTo; // How to rescale region A during the limit setting
 	int nToys; // How many toys to run if using the toy method
 	std::map<std::string, double> systematic_errors;
 	double luminosity; // Lumi in fb that we are looking at
+	int nWorkers; // How many processes to spread the limits over when re-running at each lifetime point
 };
 
 // Result (and input parameters) from a limit.
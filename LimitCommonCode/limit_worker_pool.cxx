@@ -0,0 +1,273 @@
+//
+// Spread limit calculations over forked worker processes.
+//
+#include "limit_worker_pool.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+namespace {
+	// Run everything here, one point after the other.
+	vector<limit_result> run_limits_serially(size_t n_points, const function<limit_result(size_t, int)> &calc)
+	{
+		vector<limit_result> results;
+		for (size_t i_point = 0; i_point < n_points; i_point++) {
+			results.push_back(calc(i_point, 0));
+		}
+		return results;
+	}
+
+#ifndef _WIN32
+	// A limit_result, flattened so it can go down a pipe: the point it belongs to, then the numbers.
+	class result_writer
+	{
+	public:
+		template<class T>
+		void put(T v)
+		{
+			auto p = reinterpret_cast<const char*>(&v);
+			_bytes.insert(_bytes.end(), p, p + sizeof(T));
+		}
+		void put(const ABCD &v)
+		{
+			put(v.A);
+			put(v.B);
+			put(v.C);
+			put(v.D);
+		}
+		const vector<char> &bytes() const { return _bytes; }
+
+	private:
+		vector<char> _bytes;
+	};
+
+	class result_reader
+	{
+	public:
+		explicit result_reader(const vector<char> &bytes) : _bytes(bytes), _pos(0) {}
+
+		template<class T>
+		T get()
+		{
+			T v;
+			if (_pos + sizeof(T) > _bytes.size()) {
+				throw runtime_error("A limit worker sent back a truncated result");
+			}
+			memcpy(&v, &_bytes[_pos], sizeof(T));
+			_pos += sizeof(T);
+			return v;
+		}
+		ABCD get_abcd()
+		{
+			ABCD v;
+			v.A = get<double>();
+			v.B = get<double>();
+			v.C = get<double>();
+			v.D = get<double>();
+			return v;
+		}
+		bool at_end() const { return _pos == _bytes.size(); }
+
+	private:
+		const vector<char> &_bytes;
+		size_t _pos;
+	};
+
+	void encode(result_writer &w, uint64_t i_point, const limit_result &r)
+	{
+		w.put(i_point);
+		w.put(r.observed_data);
+		w.put(r.signal.signalEvents);
+		w.put(r.signal.lifetime);
+		w.put<uint64_t>(r.signal.efficiency.size());
+		for (auto e : r.signal.efficiency) {
+			w.put(e);
+		}
+		w.put(r.cl_95);
+		w.put(r.cl_p1sigma);
+		w.put(r.cl_p2sigma);
+		w.put(r.cl_n1sigma);
+		w.put(r.cl_n2sigma);
+		w.put(r.cl_limit);
+	}
+
+	limit_result decode(result_reader &r, uint64_t &i_point)
+	{
+		limit_result result;
+		i_point = r.get<uint64_t>();
+		result.observed_data = r.get_abcd();
+		result.signal.signalEvents = r.get_abcd();
+		result.signal.lifetime = r.get<double>();
+		auto n_eff = r.get<uint64_t>();
+		for (uint64_t i = 0; i < n_eff; i++) {
+			result.signal.efficiency.push_back(r.get<double>());
+		}
+		result.cl_95 = r.get<double>();
+		result.cl_p1sigma = r.get<double>();
+		result.cl_p2sigma = r.get<double>();
+		result.cl_n1sigma = r.get<double>();
+		result.cl_n2sigma = r.get<double>();
+		result.cl_limit = r.get<double>();
+		return result;
+	}
+
+	// Write everything, even if the pipe takes it a bit at a time.
+	bool write_all(int fd, const vector<char> &bytes)
+	{
+		size_t done = 0;
+		while (done < bytes.size()) {
+			auto n = write(fd, bytes.data() + done, bytes.size() - done);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			done += n;
+		}
+		return true;
+	}
+
+	// Read until the other end is closed.
+	vector<char> read_all(int fd)
+	{
+		vector<char> bytes;
+		char buffer[4096];
+		while (true) {
+			auto n = read(fd, buffer, sizeof(buffer));
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw runtime_error("Unable to read the results from a limit worker");
+			}
+			if (n == 0) {
+				break;
+			}
+			bytes.insert(bytes.end(), buffer, buffer + n);
+		}
+		return bytes;
+	}
+
+	// What a worker does: its slice of the points, then exit without running any of the parent's
+	// clean up (ROOT's included).
+	void run_worker(int fd, size_t n_points, int n_workers, int i_worker, const function<limit_result(size_t, int)> &calc)
+	{
+		int status = 0;
+		try {
+			for (size_t i_point = i_worker; i_point < n_points; i_point += n_workers) {
+				result_writer w;
+				encode(w, i_point, calc(i_point, i_worker));
+				if (!write_all(fd, w.bytes())) {
+					throw runtime_error("Unable to send a result back to the main process");
+				}
+			}
+		}
+		catch (exception &e) {
+			cout << "Limit worker " << i_worker << " failed: " << e.what() << endl;
+			status = 1;
+		}
+		close(fd);
+		cout.flush();
+		fflush(stdout);
+		_exit(status);
+	}
+#endif
+}
+
+vector<limit_result> run_limits_in_workers(size_t n_points, int n_workers,
+	const function<limit_result(size_t, int)> &calc)
+{
+	if ((size_t)n_workers > n_points) {
+		n_workers = (int)n_points;
+	}
+	if (n_workers <= 1) {
+		return run_limits_serially(n_points, calc);
+	}
+
+#ifdef _WIN32
+	cout << "Warning: no worker processes on this platform - running the limits one after the other." << endl;
+	return run_limits_serially(n_points, calc);
+#else
+	// Anything still buffered would otherwise be written once by every worker too.
+	cout.flush();
+	fflush(stdout);
+
+	// Start the workers, each with its own pipe back to us.
+	vector<pid_t> workers;
+	vector<int> pipes;
+	for (int i_worker = 0; i_worker < n_workers; i_worker++) {
+		int fds[2];
+		if (pipe(fds) != 0) {
+			throw runtime_error("Unable to create a pipe for a limit worker");
+		}
+		auto pid = fork();
+		if (pid < 0) {
+			throw runtime_error("Unable to start limit worker " + to_string(i_worker));
+		}
+		if (pid == 0) {
+			close(fds[0]);
+			for (auto fd : pipes) {
+				close(fd);
+			}
+			run_worker(fds[1], n_points, n_workers, i_worker, calc);
+		}
+		close(fds[1]);
+		workers.push_back(pid);
+		pipes.push_back(fds[0]);
+	}
+
+	// Collect the results. Reading one pipe to the end before the next can't dead lock: a worker
+	// stuck on a full pipe is only waiting for us to get to it.
+	vector<limit_result> results(n_points);
+	vector<bool> have_result(n_points, false);
+	bool failed = false;
+	for (int i_worker = 0; i_worker < n_workers; i_worker++) {
+		auto bytes = read_all(pipes[i_worker]);
+		close(pipes[i_worker]);
+
+		result_reader r(bytes);
+		while (!r.at_end()) {
+			uint64_t i_point;
+			auto result = decode(r, i_point);
+			if (i_point >= n_points || have_result[i_point]) {
+				throw runtime_error("A limit worker sent back a result for a point it wasn't given");
+			}
+			results[i_point] = result;
+			have_result[i_point] = true;
+		}
+	}
+	for (int i_worker = 0; i_worker < n_workers; i_worker++) {
+		int status = 0;
+		while (waitpid(workers[i_worker], &status, 0) < 0 && errno == EINTR) {
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			cout << "Limit worker " << i_worker << " did not finish cleanly" << endl;
+			failed = true;
+		}
+	}
+
+	if (failed) {
+		throw runtime_error("One or more limit workers failed");
+	}
+	for (size_t i_point = 0; i_point < n_points; i_point++) {
+		if (!have_result[i_point]) {
+			throw runtime_error("A limit worker did not send back all of its results");
+		}
+	}
+	return results;
+#endif
+}
@@ -0,0 +1,26 @@
+// Run a set of limit calculations spread over several worker processes.
+//
+// RooFit/RooStats are not thread safe, so the only way to run several limits at once is to
+// fork. Each worker process is handed an interleaved slice of the points (worker i does points
+// i, i+N, i+2N, ...), so slow and fast lifetimes are shared out evenly, and sends its limit_result's
+// back to the parent over a pipe. The results come back in the original order, whatever order the
+// workers finish in.
+//
+// Only on systems with fork - elsewhere (or with a single worker) the points are just run one after
+// the other in this process.
+
+#ifndef __limit_worker_pool__
+#define __limit_worker_pool__
+
+#include "limit_datastructures.h"
+
+#include <functional>
+#include <vector>
+#include <cstddef>
+
+// Run calc(i_point, i_worker) for every i_point in [0, n_points), using up to n_workers processes,
+// and return the results in i_point order. Throws if any worker fails.
+std::vector<limit_result> run_limits_in_workers(size_t n_points, int n_workers,
+	const std::function<limit_result(size_t i_point, int i_worker)> &calc);
+
+#endif
@@ -29,9 +29,13 @@
 
 #include "HypoTestInvTool.h"
 #include "SimulABCD.h"
+#include "abcd_asymptotic_cls.h"
+#include "abcd_toy_cls.h"
 
 #include <TFile.h>
 #include <TROOT.h>
+#include <TStopwatch.h>
+#include <TError.h>
 
 #include "RooCategory.h"
 #include "RooRandom.h"
@@ -39,6 +43,8 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cmath>
+#include <utility>
 
 using namespace RooStats;
 using namespace std;
@@ -68,10 +74,75 @@ int nAsimovBins = 0;                     // number of bins in observables used f
 
 bool reuseAltToys = false;                // reuse same toys for alternate hypothesis (if set one gets more stable bands)
 
+bool adaptiveScan = true;                // find each limit (observed and expected) by bracketing and refining where CLs
+										 // crosses 1-CL, instead of scanning npoints from poimin to poimax
+double scanTolerance = 0.005;            // relative precision the adaptive scan finds each limit to
+
 std::string massValue = "";              // extra string to tag output file of result 
 std::string  minimizerType = "";                  // minimizer type (default is what is in ROOT::Math::MinimizerOptions::DefaultMinimizerType()
 int   printLevel = 0;                    // print level for debugging PL test statistics and calculators  
+bool writeWorkspace = false;             // also write the ABCD workspace to out_filename before each limit (for debugging)
+
+
+// Set up the inverter with the options above.
+void configure_inverter(HypoTestInvTool &calc)
+{
+	calc.SetParameter("PlotHypoTestResult", plotHypoTestResult);
+	calc.SetParameter("WriteResult", writeResult);
+	calc.SetParameter("Optimize", optimize);
+	calc.SetParameter("UseVectorStore", useVectorStore);
+	calc.SetParameter("GenerateBinned", generateBinned);
+	calc.SetParameter("NToysRatio", nToysRatio);
+	calc.SetParameter("MaxPOI", maxPOI);
+	calc.SetParameter("UseProof", useProof);
+	calc.SetParameter("NWorkers", nworkers);
+	calc.SetParameter("Rebuild", rebuild);
+	calc.SetParameter("ReuseAltToys", reuseAltToys);
+	calc.SetParameter("NToyToRebuild", nToyToRebuild);
+	calc.SetParameter("MassValue", massValue.c_str());
+	calc.SetParameter("MinimizerType", minimizerType.c_str());
+	calc.SetParameter("PrintLevel", printLevel);
+	calc.SetParameter("InitialFit", initialFit);
+	calc.SetParameter("ResultFileName", resultFileName);
+	calc.SetParameter("RandomSeed", randomSeed);
+	calc.SetParameter("AsimovBins", nAsimovBins);
+	calc.SetParameter("NoSystematics", noSystematics);
+	calc.SetParameter("AdaptiveScan", adaptiveScan);
+	calc.SetParameter("ScanTolerance", scanTolerance);
+}
 
+// Run the inverted hypothesis test on a workspace that is already in memory. resultNameBase is
+// used to name the file the inverter result is written to.
+HypoTestInvTool::LimitResults
+StandardHypoTestInvOnWorkspace(int enne, TString esse, RooWorkspace * w,
+	const char * resultNameBase,
+	const char * modelSBName,
+	const char * modelBName,
+	const char * dataName,
+	int calculatorType,
+	int testStatType,
+	bool useCLs,
+	int npoints,
+	double poimin,
+	double poimax,
+	int ntoys,
+	bool useNumberCounting = false,
+	const char * nuisPriorName = 0) {
+
+	HypoTestInvTool calc;
+	configure_inverter(calc);
+
+	HypoTestInverterResult * r = calc.RunInverter(enne, esse, w, modelSBName, modelBName,
+		dataName, calculatorType, testStatType, useCLs,
+		npoints, poimin, poimax,
+		ntoys, useNumberCounting, nuisPriorName);
+	if (!r) {
+		std::cerr << "Error running the HypoTestInverter - Exit " << std::endl;
+		throw runtime_error("Error running the HypnoTestInverter");
+	}
+
+	return calc.AnalyzeResult(r, calculatorType, testStatType, useCLs, npoints, resultNameBase);
+}
 
 HypoTestInvTool::LimitResults
 StandardHypoTestInvDemo(int enne, TString esse, const char * infile = 0,
@@ -115,6 +186,8 @@ StandardHypoTestInvDemo(int enne, TString esse, const char * infile = 0,
 	  poimin,poimax:  min/max value to scan in case of fixed scans
 	  (if min >  max, try to find automatically)
 
+	  (npoints, poimin and poimax are not used with adaptiveScan, which starts from the POI value in the workspace)
+
 	  ntoys:         number of toys to use
 
 	  useNumberCounting:  set to true when using number counting events
@@ -129,6 +202,7 @@ StandardHypoTestInvDemo(int enne, TString esse, const char * infile = 0,
 	  useProof             use Proof   (default is true)
 	  writeResult          write result of scan (default is true)
 	  rebuild              rebuild scan for expected limits (require extra toys) (default is false)
+	  adaptiveScan         bracket and refine each limit rather than scan a grid (default is true)
 	  generateBinned       generate binned data sets for toys (default is false) - be careful not to activate with
 	  a too large (>=3) number of observables
 	  nToyRatio            ratio of S+B/B toys (default is 2)
@@ -174,59 +248,26 @@ StandardHypoTestInvDemo(int enne, TString esse, const char * infile = 0,
 		throw runtime_error("Couldn't get the file open for some weird reason.");
 	}
 
-	HypoTestInvTool calc;
-
-	// set parameters
-	calc.SetParameter("PlotHypoTestResult", plotHypoTestResult);
-	calc.SetParameter("WriteResult", writeResult);
-	calc.SetParameter("Optimize", optimize);
-	calc.SetParameter("UseVectorStore", useVectorStore);
-	calc.SetParameter("GenerateBinned", generateBinned);
-	calc.SetParameter("NToysRatio", nToysRatio);
-	calc.SetParameter("MaxPOI", maxPOI);
-	calc.SetParameter("UseProof", useProof);
-	calc.SetParameter("NWorkers", nworkers);
-	calc.SetParameter("Rebuild", rebuild);
-	calc.SetParameter("ReuseAltToys", reuseAltToys);
-	calc.SetParameter("NToyToRebuild", nToyToRebuild);
-	calc.SetParameter("MassValue", massValue.c_str());
-	calc.SetParameter("MinimizerType", minimizerType.c_str());
-	calc.SetParameter("PrintLevel", printLevel);
-	calc.SetParameter("InitialFit", initialFit);
-	calc.SetParameter("ResultFileName", resultFileName);
-	calc.SetParameter("RandomSeed", randomSeed);
-	calc.SetParameter("AsimovBins", nAsimovBins);
-	calc.SetParameter("NoSystematics", noSystematics);
-
-
 	RooWorkspace * w = dynamic_cast<RooWorkspace*>(file->Get(wsName));
-	HypoTestInverterResult * r = 0;
 	std::cout << w << "\t" << fileName << std::endl;
 	if (w != NULL) {
-		r = calc.RunInverter(enne, esse, w, modelSBName, modelBName,
-			dataName, calculatorType, testStatType, useCLs,
-			npoints, poimin, poimax,
-			ntoys, useNumberCounting, nuisPriorName);
-		if (!r) {
-			std::cerr << "Error running the HypoTestInverter - Exit " << std::endl;
-			throw runtime_error("Error running the HypnoTestInverter");
-		}
-	}
-	else {
-		// case workspace is not present look for the inverter result
-		std::cout << "Reading an HypoTestInverterResult with name " << wsName << " from file " << fileName << std::endl;
-		r = dynamic_cast<HypoTestInverterResult*>(file->Get(wsName)); //
-		if (!r) {
-			std::cerr << "File " << fileName << " does not contain a workspace or an HypoTestInverterResult - Exit "
-				<< std::endl;
-			file->ls();
-			throw runtime_error("File doesn't contain a workspace.");
-		}
+		return StandardHypoTestInvOnWorkspace(enne, esse, w, infile, modelSBName, modelBName, dataName,
+			calculatorType, testStatType, useCLs, npoints, poimin, poimax, ntoys, useNumberCounting, nuisPriorName);
 	}
 
-	auto expLimitSG = calc.AnalyzeResult(r, calculatorType, testStatType, useCLs, npoints, infile);
+	// case workspace is not present look for the inverter result
+	std::cout << "Reading an HypoTestInverterResult with name " << wsName << " from file " << fileName << std::endl;
+	HypoTestInverterResult * r = dynamic_cast<HypoTestInverterResult*>(file->Get(wsName)); //
+	if (!r) {
+		std::cerr << "File " << fileName << " does not contain a workspace or an HypoTestInverterResult - Exit "
+			<< std::endl;
+		file->ls();
+		throw runtime_error("File doesn't contain a workspace.");
+	}
 
-	return expLimitSG;
+	HypoTestInvTool calc;
+	configure_inverter(calc);
+	return calc.AnalyzeResult(r, calculatorType, testStatType, useCLs, npoints, infile);
 }
 
 
@@ -248,265 +289,157 @@ double get_error(const map<string, double> &table, const string &key) {
 	return v->second;
 }
 
-/* Simultanous ABCD code  (S.giagu) */
-/*
- * n[4] = {n_A, n_B, n_C, n_D} <-- number of observed events in regions A, B, C, D
- * s[4] = {s_A, s_B, s_C, s_D} <-- number of signal events in regions A, B, C, D
- * b[4] = {b_A, b_B, b_C, b_D} <-- number of BG events (estimated from MC) in regions A, B, C, D
- * c[4] = {c_A, c_B, c_C, c_D} <-- number of other BG events like cosmics etc.. (indipendently estimated from data) in regions A, B, C, D
- * useB = kFALSE <-- don't use BG events estimated from MC;  kTRUE <-- use them
- * useC = kFALSE <-- don't use other BG events (like cosmics etc..) indipendently estimated from data;  kTRUE <-- use them
- * blindA: kTRUE <-- keep signal region blind (i.e. test done assuming n_A = ABCD_exp_A),  kFALSE <-- use obs events in signal region
- *
- */
-HypoTestInvTool::LimitResults simultaneousABCD(const Double_t n[4], const Double_t s[4], const Double_t b[4], const Double_t c[4],
-	TString out_filename,
-	Bool_t useB, // Use background as estimated in MC
-	Bool_t useC, // Use other background events (do subtraction of c above
-	Bool_t blindA, // Assume no signal, so we get expected limits
-	Int_t calculationType, // See comments below - 0 for toys, 2 for asym fit
-	Int_t par_ntoys, // number of events in Asimov sample in case of calc type 2 or 3, number of events in each toys for type 0; default should be : 50000
-	map<string,double> systematic_errors // The errors to be used in the fit
-)
+/* The ABCD model (S.giagu), built once and reused */
+abcd_workspace_model::abcd_workspace_model(bool useB, bool useC, const map<string, double> &systematic_errors)
+	: _useB(useB), _useC(useC), _systematic_errors(systematic_errors), _wspace(0)
 {
-
-	// set RooFit random seed to a fix value for reproducible results
-	RooRandom::randomGenerator()->SetSeed(4357);
-
-	// init
 	RooWorkspace::autoImportClassCode(kTRUE); // set default behaviour of RooWorkspace when importing new classes
 
-	//Inputs
-	// signal
-	Double_t ns_A = s[0];
-	if (ns_A <= 0) {
-		std::cout << "ERROR: 0 signal events in signal region (A)!!! --> Check inputs!  s[0] = " << ns_A << std::endl;
-		throw runtime_error("No signal events found in signal region!");
-	}
-	Double_t ns_B = s[1];
-	Double_t ns_C = s[2];
-	Double_t ns_D = s[3];
-	// data
-	Double_t nd_A = n[0];
-	Double_t nd_B = n[1];
-	Double_t nd_C = n[2];
-	Double_t nd_D = n[3];
-	// MC based BG
-	Double_t nb_A = b[0];
-	Double_t nb_B = b[1];
-	Double_t nb_C = b[2];
-	Double_t nb_D = b[3];
-	// Independently DATA based BG
-	Double_t nc_A = c[0];
-	Double_t nc_B = c[1];
-	Double_t nc_C = c[2];
-	Double_t nc_D = c[3];
-
-	// Some initial printout ...
-	Double_t nd_A_expected = 0.0;
-	if (nd_C > 0) nd_A_expected = nd_B * nd_D / nd_C;
-	std::cout << "Obs events in signal region (A) estimated from control regions using PLAIN ABCD: " << nd_A_expected << std::endl;
-	std::cout << "              " << std::endl;
-
-	if (blindA) { //don't use observed data in signal region (for expected yields) but expectation from PLAIN ABCD
-		nd_A = nd_A_expected;
-	}
-
-	std::cout << "Input yields with signal region " << (blindA ? "blinded: " : "unblinded: ") << std::endl;
-	std::cout << "Observed A/B/C/D: " << nd_A << " / " << nd_B << " / " << nd_C << " / " << nd_D << std::endl;
-	std::cout << "Signal   A/B/C/D: " << ns_A << " / " << ns_B << " / " << ns_C << " / " << ns_D << std::endl;
-	if (useB)
-		std::cout << "MC BG A/B/C/D:    " << nb_A << " / " << nb_B << " / " << nb_C << " / " << nb_D << std::endl;
-	if (useC)
-		std::cout << "Data BG A/B/C/D:  " << nc_A << " / " << nc_B << " / " << nc_C << " / " << nc_D << std::endl;
-	std::cout << "              " << std::endl;
-
-	// guess some initial values (to speedup fit convergence) for the parameters ...
-	Double_t sr_B = ns_B / ns_A;
-	Double_t sr_C = ns_C / ns_A;
-	Double_t sr_D = ns_D / ns_A;
-	Double_t mu_guess = 3.0 / ns_A; // starting guess for mu = N_sig_UL / N_sig_exp assume no signal observed (~3 events UL at 95% CL)
-
-	std::cout << "Signal ratios B/A C/A and D/A: " << sr_B << " / " << sr_C << " / " << sr_D << std::endl;
-	std::cout << "Guess mu: " << mu_guess << std::endl;
-	std::cout << std::endl;
-
-	Double_t nq_A_guess = nd_A_expected; // starting guess from ABCD events in signal region (from ABCD ansatz + other BG)
-	if (useB) nq_A_guess -= nb_A;
-	if (useC) nq_A_guess -= nc_A;
-	if (nq_A_guess < 0) nq_A_guess = 0.0;
-	Double_t nq_B_guess = nd_B;
-	Double_t nq_D_guess = nd_D;
-	std::cout << "Guess Multijet BG A/B/D: " << nq_A_guess << " / " << nq_B_guess << " / " << nq_D_guess << std::endl;
-	std::cout << "              " << std::endl;
-
-
-	if (nq_A_guess <= 0) {
-		nq_A_guess = 3.0;
-		std::cout << "WARNING: zero events for nq_A_guess, used 3 events" << std::endl;
-	}
-	Double_t ta_A = nq_A_guess; // tau parameters guesses (see Likelihood ABCD note in stat forum for definition)
-
-	Double_t ta_B = 3.0;
-	Double_t ta_D = 3.0;
-	if (nq_B_guess > 0)
-		ta_B = nq_B_guess / nq_A_guess;
-	else
-		std::cout << "WARNING: zero events for nq_B_guess, used 3 events" << std::endl;
-	if (nq_D_guess > 0)
-		ta_D = nq_D_guess / nq_A_guess;
-	else
-		std::cout << "WARNING: zero events for nq_D_guess, used 3 events" << std::endl;
-
-	std::cout << "tau Multijet A/B/D: " << ta_A << " / " << ta_B << " / " << ta_D << std::endl;
-	std::cout << "              " << std::endl;
-
-
 	// make model
-	RooWorkspace* wspace = new RooWorkspace("wspace", "ABCD workspace");
-	wspace->addClassDeclImportDir("."); // add code import paths
-	wspace->addClassImplImportDir(".");
+	_wspace = new RooWorkspace("wspace", "ABCD workspace");
+	_wspace->addClassDeclImportDir("."); // add code import paths
+	_wspace->addClassImplImportDir(".");
 
 	// observed events
-	wspace->factory("NA[0,20000]");
-	wspace->factory("NB[0,20000]");
-	wspace->factory("NC[0,20000]");
-	wspace->factory("ND[0,20000]");
+	_wspace->factory("NA[0,20000]");
+	_wspace->factory("NB[0,20000]");
+	_wspace->factory("NC[0,20000]");
+	_wspace->factory("ND[0,20000]");
 
 	// POI
-	wspace->factory(TString::Format("mu[%f,0,1]", mu_guess));  // mu = NsA/Ns0 (Ns0 = expected events)
+	_wspace->factory("mu[0.01,0,1]");  // mu = NsA/Ns0 (Ns0 = expected events)
 	//note: SM means mu=0 (used for the BG only hypotesis for the expected limit
 
 	// pdf parameters
-	wspace->factory(TString::Format("lumi[%f]", 1.0));    // Luminosity (scale factor wrt the luinosity on dat)
+	_wspace->factory(TString::Format("lumi[%f]", 1.0));    // Luminosity (scale factor wrt the luinosity on dat)
 
-	wspace->factory(TString::Format("Ns0[%f,0,20000]", ns_A)); //Expected signal in region A
-	wspace->factory(TString::Format("effB[%f,0,5000]", sr_B)); //Sig. eff. in region B wrt region A
-	wspace->factory(TString::Format("effC[%f,0,5000]", sr_C)); //Sig. eff. in region C wrt region A
-	wspace->factory(TString::Format("effD[%f,0,5000]", sr_D)); //Sig. eff. in region D wrt region A
+	_wspace->factory("Ns0[1,0,20000]"); //Expected signal in region A
+	_wspace->factory("effB[1,0,5000]"); //Sig. eff. in region B wrt region A
+	_wspace->factory("effC[1,0,5000]"); //Sig. eff. in region C wrt region A
+	_wspace->factory("effD[1,0,5000]"); //Sig. eff. in region D wrt region A
 
-	wspace->factory(TString::Format("Nq[%f,0,20000]", ta_A)); //number of Multijet events in region A
-	wspace->factory(TString::Format("tauB[%f,0,1000]", ta_B)); //Multijet BG eff. in region B wrt region A
-	wspace->factory(TString::Format("tauD[%f,0,1000]", ta_D)); //Multijet BG eff. in region D wrt region A
+	_wspace->factory("Nq[3,0,20000]"); //number of Multijet events in region A
+	_wspace->factory("tauB[3,0,1000]"); //Multijet BG eff. in region B wrt region A
+	_wspace->factory("tauD[3,0,1000]"); //Multijet BG eff. in region D wrt region A
 
 	if (useB) {
-		wspace->factory(TString::Format("NbA[%f,0,1000]", nb_A)); //number of MC BG events in region A
-		wspace->factory(TString::Format("NbB[%f,0,1000]", nb_B)); // in region B
-		wspace->factory(TString::Format("NbC[%f,0,1000]", nb_C)); // C
-		wspace->factory(TString::Format("NbD[%f,0,1000]", nb_D)); // ... and D
+		_wspace->factory("NbA[0,0,1000]"); //number of MC BG events in region A
+		_wspace->factory("NbB[0,0,1000]"); // in region B
+		_wspace->factory("NbC[0,0,1000]"); // C
+		_wspace->factory("NbD[0,0,1000]"); // ... and D
 	}
 
 	if (useC) {
-		wspace->factory(TString::Format("NcA[%f,0,1000]", nc_A)); //number of Other data-driven BG events in region A
-		wspace->factory(TString::Format("NcB[%f,0,1000]", nc_B)); // in region B
-		wspace->factory(TString::Format("NcC[%f,0,1000]", nc_C)); // C
-		wspace->factory(TString::Format("NcD[%f,0,1000]", nc_D)); // ... and D
+		_wspace->factory("NcA[0,0,1000]"); //number of Other data-driven BG events in region A
+		_wspace->factory("NcB[0,0,1000]"); // in region B
+		_wspace->factory("NcC[0,0,1000]"); // C
+		_wspace->factory("NcD[0,0,1000]"); // ... and D
 	}
 
 	//Systematic uncertanties' nuisance parameters 
 	//lumi
-	wspace->factory("alpha_lumi[1, 0, 10]");
-	wspace->factory("nom_lumi[1, 0, 10]");
+	_wspace->factory("alpha_lumi[1, 0, 10]");
+	_wspace->factory("nom_lumi[1, 0, 10]");
 	ostringstream lumi_error;
 	lumi_error << "nom_sigma_lumi[" << get_error (systematic_errors, "lumi") << "]";
-	wspace->factory(lumi_error.str().c_str());  // <--  2.1% final run2 2015
-	wspace->factory("Gaussian::constraint_lumi(nom_lumi, alpha_lumi, nom_sigma_lumi)");
+	_wspace->factory(lumi_error.str().c_str());  // <--  2.1% final run2 2015
+	_wspace->factory("Gaussian::constraint_lumi(nom_lumi, alpha_lumi, nom_sigma_lumi)");
 
-	wspace->factory("alpha_S[1, 0, 2]");  //systematic nuisance on signal (efficiencies etc.) and on MC bg
-	wspace->factory("nom_S[1, 0, 10]");
+	_wspace->factory("alpha_S[1, 0, 2]");  //systematic nuisance on signal (efficiencies etc.) and on MC bg
+	_wspace->factory("nom_S[1, 0, 10]");
 	ostringstream mc_events_error;
 	mc_events_error << "nom_sigma_S[" << get_error(systematic_errors, "mc_eff") << "]";
-	wspace->factory(mc_events_error.str().c_str()); // 24% totale displaced LJ analysis 2016
-	wspace->factory("Gaussian::constraint_S(nom_S, alpha_S, nom_sigma_S)");
+	_wspace->factory(mc_events_error.str().c_str()); // 24% totale displaced LJ analysis 2016
+	_wspace->factory("Gaussian::constraint_S(nom_S, alpha_S, nom_sigma_S)");
 
-	wspace->factory("alpha_Q[1, 0, 2]");  //systematic nuisance on Multijet   
-	wspace->factory("nom_Q[1, 0, 5]");
+	_wspace->factory("alpha_Q[1, 0, 2]");  //systematic nuisance on Multijet   
+	_wspace->factory("nom_Q[1, 0, 5]");
 	ostringstream abcd_error;
 	abcd_error << "nom_sigma_Q[" << get_error(systematic_errors, "abcd") << "]";
-	wspace->factory(abcd_error.str().c_str());   //30%% on QCD from ABCD variations and closure tests
-	wspace->factory("Gaussian::constraint_Q(nom_Q, alpha_Q, nom_sigma_Q)");
+	_wspace->factory(abcd_error.str().c_str());   //30%% on QCD from ABCD variations and closure tests
+	_wspace->factory("Gaussian::constraint_Q(nom_Q, alpha_Q, nom_sigma_Q)");
 
 	if (useC) {
-		wspace->factory("alpha_C[1, 0, 10]");  //systematic nuisance on other data-driven BG
-		wspace->factory("nom_C[1, 0, 10]");
-		wspace->factory("nom_sigma_C[0.32]");   //20% on cosmic BG (just as an example)
-		wspace->factory("Gaussian::constraint_C(nom_C, alpha_C, nom_sigma_C)");
+		_wspace->factory("alpha_C[1, 0, 10]");  //systematic nuisance on other data-driven BG
+		_wspace->factory("nom_C[1, 0, 10]");
+		_wspace->factory("nom_sigma_C[0.32]");   //20% on cosmic BG (just as an example)
+		_wspace->factory("Gaussian::constraint_C(nom_C, alpha_C, nom_sigma_C)");
 	}
 
 	if (useB) {
-		wspace->factory("alpha_B[1, 0, 10]");  //systematic nuisance on MC BG
-		wspace->factory("nom_B[1, 0, 10]");
-		wspace->factory("nom_sigma_B[0.32]");   //10% on MC BG (just as an example)
-		wspace->factory("Gaussian::constraint_B(nom_B, alpha_B, nom_sigma_B)");
+		_wspace->factory("alpha_B[1, 0, 10]");  //systematic nuisance on MC BG
+		_wspace->factory("nom_B[1, 0, 10]");
+		_wspace->factory("nom_sigma_B[0.32]");   //10% on MC BG (just as an example)
+		_wspace->factory("Gaussian::constraint_B(nom_B, alpha_B, nom_sigma_B)");
 	}
 
 	// PDF
-	wspace->factory("prod::NsA(mu,Ns0,lumi,alpha_lumi,alpha_S)");      // expected signal events in A: mu*Ns0*L
-	wspace->factory("prod::NsB(mu,Ns0,effB,lumi,alpha_lumi,alpha_S)"); // expected signal events in B: mu*Ns0*L*effB
-	wspace->factory("prod::NsC(mu,Ns0,effC,lumi,alpha_lumi,alpha_S)");
-	wspace->factory("prod::NsD(mu,Ns0,effD,lumi,alpha_lumi,alpha_S)");
+	_wspace->factory("prod::NsA(mu,Ns0,lumi,alpha_lumi,alpha_S)");      // expected signal events in A: mu*Ns0*L
+	_wspace->factory("prod::NsB(mu,Ns0,effB,lumi,alpha_lumi,alpha_S)"); // expected signal events in B: mu*Ns0*L*effB
+	_wspace->factory("prod::NsC(mu,Ns0,effC,lumi,alpha_lumi,alpha_S)");
+	_wspace->factory("prod::NsD(mu,Ns0,effD,lumi,alpha_lumi,alpha_S)");
 
-	wspace->factory("prod::NbQA(Nq,lumi, alpha_Q)");    // expected Multijet (i.e. ABCD) BG events in A: Nq*SysQ
-	wspace->factory("prod::NbQB(Nq,lumi, tauB)");       // expected Multijet BG events in B: Nq*tauB;
-	wspace->factory("prod::NbQC(Nq,lumi, tauB,tauD)");  // ABCD ansatz: expected Multijet BG events in C: Nq*tauB*tauD;
-	wspace->factory("prod::NbQD(Nq,lumi, tauD)");       // expected Multijet BG events in D: Nq*tauD;
+	_wspace->factory("prod::NbQA(Nq,lumi, alpha_Q)");    // expected Multijet (i.e. ABCD) BG events in A: Nq*SysQ
+	_wspace->factory("prod::NbQB(Nq,lumi, tauB)");       // expected Multijet BG events in B: Nq*tauB;
+	_wspace->factory("prod::NbQC(Nq,lumi, tauB,tauD)");  // ABCD ansatz: expected Multijet BG events in C: Nq*tauB*tauD;
+	_wspace->factory("prod::NbQD(Nq,lumi, tauD)");       // expected Multijet BG events in D: Nq*tauD;
 
 	if (useB) {
-		wspace->factory("prod::NbBA(NbA,lumi,alpha_lumi,alpha_B)");   // expected MC BG events in region A: NbA*sysB*sysLumi (MC)
-		wspace->factory("prod::NbBB(NbB,lumi,alpha_lumi,alpha_B)");
-		wspace->factory("prod::NbBC(NbC,lumi,alpha_lumi,alpha_B)");
-		wspace->factory("prod::NbBD(NbD,lumi,alpha_lumi,alpha_B)");
+		_wspace->factory("prod::NbBA(NbA,lumi,alpha_lumi,alpha_B)");   // expected MC BG events in region A: NbA*sysB*sysLumi (MC)
+		_wspace->factory("prod::NbBB(NbB,lumi,alpha_lumi,alpha_B)");
+		_wspace->factory("prod::NbBC(NbC,lumi,alpha_lumi,alpha_B)");
+		_wspace->factory("prod::NbBD(NbD,lumi,alpha_lumi,alpha_B)");
 	}
 
 	if (useC) {
-		wspace->factory("prod::NbCA(NcA,lumi, alpha_C)");   // expected cosm. BG events in A: NcA*sysCos 
-		wspace->factory("prod::NbCB(NcB,lumi, alpha_C)");
-		wspace->factory("prod::NbCC(NcC,lumi, alpha_C)");
-		wspace->factory("prod::NbCD(NcD,lumi, alpha_C)");
+		_wspace->factory("prod::NbCA(NcA,lumi, alpha_C)");   // expected cosm. BG events in A: NcA*sysCos 
+		_wspace->factory("prod::NbCB(NcB,lumi, alpha_C)");
+		_wspace->factory("prod::NbCC(NcC,lumi, alpha_C)");
+		_wspace->factory("prod::NbCD(NcD,lumi, alpha_C)");
 	}
 
 	if (useC && useB) {
-		wspace->factory("sum::NexpA(NsA,NbQA,NbBA,NbCA)");
-		wspace->factory("sum::NexpB(NsB,NbQB,NbBB,NbCB)");
-		wspace->factory("sum::NexpC(NsC,NbQC,NbBC,NbCC)");
-		wspace->factory("sum::NexpD(NsD,NbQD,NbBD,NbCD)");
+		_wspace->factory("sum::NexpA(NsA,NbQA,NbBA,NbCA)");
+		_wspace->factory("sum::NexpB(NsB,NbQB,NbBB,NbCB)");
+		_wspace->factory("sum::NexpC(NsC,NbQC,NbBC,NbCC)");
+		_wspace->factory("sum::NexpD(NsD,NbQD,NbBD,NbCD)");
 	}
 	else if (useC && !useB) {
-		wspace->factory("sum::NexpA(NsA,NbQA,NbCA)");
-		wspace->factory("sum::NexpB(NsB,NbQB,NbCB)");
-		wspace->factory("sum::NexpC(NsC,NbQC,NbCC)");
-		wspace->factory("sum::NexpD(NsD,NbQD,NbCD)");
+		_wspace->factory("sum::NexpA(NsA,NbQA,NbCA)");
+		_wspace->factory("sum::NexpB(NsB,NbQB,NbCB)");
+		_wspace->factory("sum::NexpC(NsC,NbQC,NbCC)");
+		_wspace->factory("sum::NexpD(NsD,NbQD,NbCD)");
 	}
 	else if (!useC && useB) {
-		wspace->factory("sum::NexpA(NsA,NbQA,NbBA)");
-		wspace->factory("sum::NexpB(NsB,NbQB,NbBB)");
-		wspace->factory("sum::NexpC(NsC,NbQC,NbBC)");
-		wspace->factory("sum::NexpD(NsD,NbQD,NbBD)");
+		_wspace->factory("sum::NexpA(NsA,NbQA,NbBA)");
+		_wspace->factory("sum::NexpB(NsB,NbQB,NbBB)");
+		_wspace->factory("sum::NexpC(NsC,NbQC,NbBC)");
+		_wspace->factory("sum::NexpD(NsD,NbQD,NbBD)");
 	}
 	else {
-		wspace->factory("sum::NexpA(NsA,NbQA)");
-		wspace->factory("sum::NexpB(NsB,NbQB)");
-		wspace->factory("sum::NexpC(NsC,NbQC)");
-		wspace->factory("sum::NexpD(NsD,NbQD)");
+		_wspace->factory("sum::NexpA(NsA,NbQA)");
+		_wspace->factory("sum::NexpB(NsB,NbQB)");
+		_wspace->factory("sum::NexpC(NsC,NbQC)");
+		_wspace->factory("sum::NexpD(NsD,NbQD)");
 	}
 
-	wspace->factory("Poisson::obsA(NA,NexpA)");
-	wspace->factory("Poisson::obsB(NB,NexpB)");
-	wspace->factory("Poisson::obsC(NC,NexpC)");
-	wspace->factory("Poisson::obsD(ND,NexpD)");
+	_wspace->factory("Poisson::obsA(NA,NexpA)");
+	_wspace->factory("Poisson::obsB(NB,NexpB)");
+	_wspace->factory("Poisson::obsC(NC,NexpC)");
+	_wspace->factory("Poisson::obsD(ND,NexpD)");
 
 
 	if (useC && useB) {
-		wspace->factory("PROD::model(obsA,obsB,obsC,obsD,constraint_lumi,constraint_Q,constraint_S, constraint_C, constraint_B)");
+		_wspace->factory("PROD::model(obsA,obsB,obsC,obsD,constraint_lumi,constraint_Q,constraint_S, constraint_C, constraint_B)");
 	}
 	else if (useC && !useB) {
-		wspace->factory("PROD::model(obsA,obsB,obsC,obsD,constraint_lumi,constraint_Q,constraint_S, constraint_C)");
+		_wspace->factory("PROD::model(obsA,obsB,obsC,obsD,constraint_lumi,constraint_Q,constraint_S, constraint_C)");
 	}
 	else if (!useC && useB) {
-		wspace->factory("PROD::model(obsA,obsB,obsC,obsD,constraint_lumi,constraint_Q,constraint_S, constraint_B)");
+		_wspace->factory("PROD::model(obsA,obsB,obsC,obsD,constraint_lumi,constraint_Q,constraint_S, constraint_B)");
 	}
 	else {
-		wspace->factory("PROD::model(obsA,obsB,obsC,obsD,constraint_lumi,constraint_Q,constraint_S)");
+		_wspace->factory("PROD::model(obsA,obsB,obsC,obsD,constraint_lumi,constraint_Q,constraint_S)");
 	}
 
 	// sets
@@ -525,17 +458,17 @@ HypoTestInvTool::LimitResults simultaneousABCD(const Double_t n[4], const Double
 	std::cout << "nuisances:  " << the_nuis << std::endl;
 	std::cout << "global var: " << the_glob << std::endl;
 
-	wspace->defineSet("obs", "NA,NB,NC,ND");
-	wspace->defineSet("poi", the_poi);
-	wspace->defineSet("nuis", the_nuis);
-	wspace->defineSet("glob", the_glob);
+	_wspace->defineSet("obs", "NA,NB,NC,ND");
+	_wspace->defineSet("poi", the_poi);
+	_wspace->defineSet("nuis", the_nuis);
+	_wspace->defineSet("glob", the_glob);
 
 	//fix needed parameters
 
 	TString    interesting = "," + the_poi + "," + the_nuis; // note leading comma
 
 	TIterator *itr;
-	itr = wspace->pdf("model")->getParameters(*wspace->set("obs"))->createIterator();
+	itr = _wspace->pdf("model")->getParameters(*_wspace->set("obs"))->createIterator();
 	TObject *obj(0);
 	RooRealVar *rrv(0);
 	RooCategory *rc(0);
@@ -559,44 +492,224 @@ HypoTestInvTool::LimitResults simultaneousABCD(const Double_t n[4], const Double
 	} // loop on pdf parameters
 
 	// inspect workspace
-	wspace->Print();
-
-	////////////////////////////////////////////////////////////
-	// Generate toy data
-	// generate toy data assuming current value of the parameters
-	// add Verbose() to see how it's being generated
-	//RooDataSet* data = wspace->pdf("model")->generate(*wspace->set("obs"),1);
-	//data->Print("v");
-	// or input real data
-	// add Verbose() to see how it's being generated
-	RooDataSet* data = new RooDataSet("data", "obsData", *wspace->set("obs"));
-	wspace->var("NA")->setVal(nd_A);
-	wspace->var("NB")->setVal(nd_B);
-	wspace->var("NC")->setVal(nd_C);
-	wspace->var("ND")->setVal(nd_D);
-	data->add(*wspace->set("obs"));
-	data->Print("v");
+	_wspace->Print();
 
-	// import into workspace.
-	wspace->import(*data, RooFit::Rename("obsData"));
+	// The data set starts empty; set_values fills it with the observed data for each limit.
+	RooDataSet* data = new RooDataSet("data", "obsData", *_wspace->set("obs"));
+	_wspace->import(*data, RooFit::Rename("obsData"));
 
 	/////////////////////////////////////////////////////
 	// Now the statistical tests
 	// model config
 	ModelConfig* mc = new ModelConfig("mc");
-	mc->SetWorkspace(*wspace);
-	mc->SetPdf(*wspace->pdf("model"));
-	mc->SetObservables(*wspace->set("obs"));
-	mc->SetParametersOfInterest(*wspace->set("poi"));
-	mc->SetNuisanceParameters(*wspace->set("nuis"));
+	mc->SetWorkspace(*_wspace);
+	mc->SetPdf(*_wspace->pdf("model"));
+	mc->SetObservables(*_wspace->set("obs"));
+	mc->SetParametersOfInterest(*_wspace->set("poi"));
+	mc->SetNuisanceParameters(*_wspace->set("nuis"));
 	mc->SetGlobalObservables(RooArgSet());
-	wspace->import(*mc);
+	_wspace->import(*mc);
+
+	_wspace->Print();
+
+	// Remember where every parameter starts, so each limit starts from the same place no matter
+	// where the fits for the last one left them.
+	_wspace->saveSnapshot("abcd_start", _wspace->allVars());
+}
+
+abcd_workspace_model::~abcd_workspace_model()
+{
+	delete _wspace;
+}
+
+bool abcd_workspace_model::same_setup(bool useB, bool useC, const map<string, double> &systematic_errors) const
+{
+	return useB == _useB && useC == _useC && systematic_errors == _systematic_errors;
+}
+
+void abcd_workspace_model::set_values(const abcd_model_values &values)
+{
+	_wspace->loadSnapshot("abcd_start");
+
+	_wspace->var("mu")->setVal(values.mu);
+	_wspace->var("Ns0")->setVal(values.ns_A);
+	_wspace->var("effB")->setVal(values.sr[1]);
+	_wspace->var("effC")->setVal(values.sr[2]);
+	_wspace->var("effD")->setVal(values.sr[3]);
+
+	_wspace->var("Nq")->setVal(values.nq_A);
+	_wspace->var("tauB")->setVal(values.tau_B);
+	_wspace->var("tauD")->setVal(values.tau_D);
+
+	const char *regions[4] = { "A", "B", "C", "D" };
+	for (int i = 0; i < 4; i++) {
+		if (_useB) {
+			_wspace->var(TString::Format("Nb%s", regions[i]))->setVal(values.nb[i]);
+		}
+		if (_useC) {
+			_wspace->var(TString::Format("Nc%s", regions[i]))->setVal(values.nc[i]);
+		}
+		_wspace->var(TString::Format("N%s", regions[i]))->setVal(values.nd[i]);
+	}
+
+	// input real data
+	RooAbsData* data = _wspace->data("obsData");
+	data->reset();
+	data->add(*_wspace->set("obs"));
+	data->Print("v");
+
+	// The inverter takes its S+B snapshot from the POI when there is none, and the last limit
+	// left one behind: replace it with the new starting value.
+	ModelConfig* mc = dynamic_cast<ModelConfig*>(_wspace->obj("mc"));
+	mc->SetSnapshot(*mc->GetParametersOfInterest());
+}
+
+/* Simultanous ABCD code  (S.giagu) */
+/*
+ * n[4] = {n_A, n_B, n_C, n_D} <-- number of observed events in regions A, B, C, D
+ * s[4] = {s_A, s_B, s_C, s_D} <-- number of signal events in regions A, B, C, D
+ * b[4] = {b_A, b_B, b_C, b_D} <-- number of BG events (estimated from MC) in regions A, B, C, D
+ * c[4] = {c_A, c_B, c_C, c_D} <-- number of other BG events like cosmics etc.. (indipendently estimated from data) in regions A, B, C, D
+ * useB = kFALSE <-- don't use BG events estimated from MC;  kTRUE <-- use them
+ * useC = kFALSE <-- don't use other BG events (like cosmics etc..) indipendently estimated from data;  kTRUE <-- use them
+ * blindA: kTRUE <-- keep signal region blind (i.e. test done assuming n_A = ABCD_exp_A),  kFALSE <-- use obs events in signal region
+ *
+ */
+HypoTestInvTool::LimitResults simultaneousABCD(const Double_t n[4], const Double_t s[4], const Double_t b[4], const Double_t c[4],
+	TString out_filename,
+	Bool_t useB, // Use background as estimated in MC
+	Bool_t useC, // Use other background events (do subtraction of c above
+	Bool_t blindA, // Assume no signal, so we get expected limits
+	Int_t calculationType, // See comments below - 0 for toys, 2 for asym fit
+	Int_t par_ntoys, // number of events in Asimov sample in case of calc type 2 or 3, number of events in each toys for type 0; default should be : 50000
+	map<string,double> systematic_errors // The errors to be used in the fit
+)
+{
+
+	// set RooFit random seed to a fix value for reproducible results
+	RooRandom::randomGenerator()->SetSeed(4357);
+
+	// init
+	RooWorkspace::autoImportClassCode(kTRUE); // set default behaviour of RooWorkspace when importing new classes
+
+	//Inputs
+	// signal
+	Double_t ns_A = s[0];
+	if (ns_A <= 0) {
+		std::cout << "ERROR: 0 signal events in signal region (A)!!! --> Check inputs!  s[0] = " << ns_A << std::endl;
+		throw runtime_error("No signal events found in signal region!");
+	}
+	Double_t ns_B = s[1];
+	Double_t ns_C = s[2];
+	Double_t ns_D = s[3];
+	// data
+	Double_t nd_A = n[0];
+	Double_t nd_B = n[1];
+	Double_t nd_C = n[2];
+	Double_t nd_D = n[3];
+	// MC based BG
+	Double_t nb_A = b[0];
+	Double_t nb_B = b[1];
+	Double_t nb_C = b[2];
+	Double_t nb_D = b[3];
+	// Independently DATA based BG
+	Double_t nc_A = c[0];
+	Double_t nc_B = c[1];
+	Double_t nc_C = c[2];
+	Double_t nc_D = c[3];
+
+	// Some initial printout ...
+	Double_t nd_A_expected = 0.0;
+	if (nd_C > 0) nd_A_expected = nd_B * nd_D / nd_C;
+	std::cout << "Obs events in signal region (A) estimated from control regions using PLAIN ABCD: " << nd_A_expected << std::endl;
+	std::cout << "              " << std::endl;
+
+	if (blindA) { //don't use observed data in signal region (for expected yields) but expectation from PLAIN ABCD
+		nd_A = nd_A_expected;
+	}
+
+	std::cout << "Input yields with signal region " << (blindA ? "blinded: " : "unblinded: ") << std::endl;
+	std::cout << "Observed A/B/C/D: " << nd_A << " / " << nd_B << " / " << nd_C << " / " << nd_D << std::endl;
+	std::cout << "Signal   A/B/C/D: " << ns_A << " / " << ns_B << " / " << ns_C << " / " << ns_D << std::endl;
+	if (useB)
+		std::cout << "MC BG A/B/C/D:    " << nb_A << " / " << nb_B << " / " << nb_C << " / " << nb_D << std::endl;
+	if (useC)
+		std::cout << "Data BG A/B/C/D:  " << nc_A << " / " << nc_B << " / " << nc_C << " / " << nc_D << std::endl;
+	std::cout << "              " << std::endl;
+
+	// guess some initial values (to speedup fit convergence) for the parameters ...
+	Double_t sr_B = ns_B / ns_A;
+	Double_t sr_C = ns_C / ns_A;
+	Double_t sr_D = ns_D / ns_A;
+	Double_t mu_guess = 3.0 / ns_A; // starting guess for mu = N_sig_UL / N_sig_exp assume no signal observed (~3 events UL at 95% CL)
 
-	wspace->Print();
+	std::cout << "Signal ratios B/A C/A and D/A: " << sr_B << " / " << sr_C << " / " << sr_D << std::endl;
+	std::cout << "Guess mu: " << mu_guess << std::endl;
+	std::cout << std::endl;
 
-	std::cout << "Writing on " << out_filename << std::endl;
-	wspace->writeToFile(out_filename);
-	std::cout << "All OK." << std::endl;
+	Double_t nq_A_guess = nd_A_expected; // starting guess from ABCD events in signal region (from ABCD ansatz + other BG)
+	if (useB) nq_A_guess -= nb_A;
+	if (useC) nq_A_guess -= nc_A;
+	if (nq_A_guess < 0) nq_A_guess = 0.0;
+	Double_t nq_B_guess = nd_B;
+	Double_t nq_D_guess = nd_D;
+	std::cout << "Guess Multijet BG A/B/D: " << nq_A_guess << " / " << nq_B_guess << " / " << nq_D_guess << std::endl;
+	std::cout << "              " << std::endl;
+
+
+	if (nq_A_guess <= 0) {
+		nq_A_guess = 3.0;
+		std::cout << "WARNING: zero events for nq_A_guess, used 3 events" << std::endl;
+	}
+	Double_t ta_A = nq_A_guess; // tau parameters guesses (see Likelihood ABCD note in stat forum for definition)
+
+	Double_t ta_B = 3.0;
+	Double_t ta_D = 3.0;
+	if (nq_B_guess > 0)
+		ta_B = nq_B_guess / nq_A_guess;
+	else
+		std::cout << "WARNING: zero events for nq_B_guess, used 3 events" << std::endl;
+	if (nq_D_guess > 0)
+		ta_D = nq_D_guess / nq_A_guess;
+	else
+		std::cout << "WARNING: zero events for nq_D_guess, used 3 events" << std::endl;
+
+	std::cout << "tau Multijet A/B/D: " << ta_A << " / " << ta_B << " / " << ta_D << std::endl;
+	std::cout << "              " << std::endl;
+
+
+	// Build the model the first time through (or if the settings have changed); after that only its
+	// values need resetting. Like the rest of the RooFit objects here it is left for ROOT to clean up.
+	static abcd_workspace_model *model = 0;
+	if (model == 0 || !model->same_setup(useB, useC, systematic_errors)) {
+		delete model;
+		model = new abcd_workspace_model(useB, useC, systematic_errors);
+	}
+
+	abcd_model_values values;
+	values.mu = mu_guess;
+	values.ns_A = ns_A;
+	values.sr[0] = 1.0;
+	values.sr[1] = sr_B;
+	values.sr[2] = sr_C;
+	values.sr[3] = sr_D;
+	values.nq_A = ta_A;
+	values.tau_B = ta_B;
+	values.tau_D = ta_D;
+	for (int i = 0; i < 4; i++) {
+		values.nb[i] = b[i];
+		values.nc[i] = c[i];
+	}
+	values.nd[0] = nd_A;
+	values.nd[1] = nd_B;
+	values.nd[2] = nd_C;
+	values.nd[3] = nd_D;
+	model->set_values(values);
+
+	if (writeWorkspace) {
+		std::cout << "Writing on " << out_filename << std::endl;
+		model->workspace()->writeToFile(out_filename);
+	}
 
 	// CLs test
 
@@ -615,11 +728,99 @@ HypoTestInvTool::LimitResults simultaneousABCD(const Double_t n[4], const Double
 	//              = 5 Max Likelihood Estimate as test statistic
 	//              = 6 Number of observed event as test statistic
 
+	// With adaptiveScan (the default) each limit is searched for starting from mu_guess, and these
+	// are not used.
 	Double_t par_poi_min = 0.0;   // mu scanned from par_poi_min to par_poi_max with par_npointscan steps
 	Double_t par_poi_max = 0.01;
 	Int_t    par_npointscan = 500; // default: 100
 
-	auto score = StandardHypoTestInvDemo(0, "", out_filename, "wspace", "mc", "mc", "obsData", calculationType, testStatType, true, par_npointscan, par_poi_min, par_poi_max, par_ntoys);
+	auto score = StandardHypoTestInvOnWorkspace(0, "", model->workspace(), out_filename, "mc", "mc", "obsData", calculationType, testStatType, true, par_npointscan, par_poi_min, par_poi_max, par_ntoys);
 
 	return score;
 }
+
+/* The same limit as simultaneousABCD, but from the hand written likelihood in abcd_likelihood - no
+ * RooFit. Same inputs (A, B, C, D in the LJ order), same blinding of region A. calcType 0 runs
+ * par_ntoys toys (on n_threads threads, 0 for all cores), 2 the asymptotic calculation.
+ */
+HypoTestInvTool::LimitResults nativeABCD(const Double_t n[4], const Double_t s[4], const Double_t b[4], const Double_t c[4],
+	Bool_t useB,
+	Bool_t useC,
+	Bool_t blindA,
+	Int_t calcType,
+	Int_t par_ntoys,
+	Int_t n_threads,
+	const map<string, double> &systematic_errors
+)
+{
+	if (calcType != 0 && calcType != 2) {
+		throw runtime_error("The native ABCD likelihood can only do toys (calcType 0) or the asymptotic limit (calcType 2)");
+	}
+	if (s[0] <= 0) {
+		std::cout << "ERROR: 0 signal events in signal region (A)!!! --> Check inputs!  s[0] = " << s[0] << std::endl;
+		throw runtime_error("No signal events found in signal region!");
+	}
+
+	ABCD data{ n[0], n[1], n[2], n[3] };
+	if (blindA) {
+		data.A = n[2] > 0 ? n[1] * n[3] / n[2] : 0.0;
+	}
+
+	abcd_likelihood model(ABCD{ s[0], s[1], s[2], s[3] },
+		get_error(systematic_errors, "lumi"),
+		get_error(systematic_errors, "mc_eff"),
+		get_error(systematic_errors, "abcd"));
+	if (useB) {
+		model.add_mc_background(ABCD{ b[0], b[1], b[2], b[3] });
+	}
+	if (useC) {
+		model.add_other_background(ABCD{ c[0], c[1], c[2], c[3] });
+	}
+	model.set_data(data);
+
+	std::cout << "Native ABCD likelihood, observed A/B/C/D: " << data.A << " / " << data.B << " / " << data.C << " / " << data.D << std::endl;
+
+	abcd_limits limits;
+	if (calcType == 0) {
+		// Same seed as the RooStats toys in simultaneousABCD.
+		abcd_toy_config config;
+		config.n_toys = par_ntoys;
+		config.n_threads = n_threads;
+		config.seed = 4357;
+
+		TStopwatch tw;
+		abcd_toy_cls calc(model, config);
+		limits = calc.limits(0.95);
+		std::cout << "  best fit mu: " << calc.best_fit_mu() << std::endl;
+		std::cout << "  " << par_ntoys << " toys at each of " << calc.n_evaluations() << " values of mu (" << calc.n_failed_fits() << " toy fits failed to converge)" << std::endl;
+		std::cout << "  Time for the toy limits: ";
+		tw.Print();
+	}
+	else {
+		abcd_asymptotic_cls calc(model);
+		limits = calc.limits(0.95);
+		std::cout << "  best fit mu: " << calc.best_fit_mu() << std::endl;
+	}
+
+	// A limit CLs doesn't reach inside the range of mu comes back as NaN, and is passed on as that
+	// rather than as the edge of the range.
+	double mu_max = model.upper(abcd_likelihood::mu);
+	const pair<const char *, double> each_limit[] = {
+		{ "observed", limits.observed }, { "median expected", limits.median },
+		{ "+1 sigma", limits.plus_1 }, { "-1 sigma", limits.minus_1 },
+		{ "+2 sigma", limits.plus_2 }, { "-2 sigma", limits.minus_2 } };
+	for (const auto &l : each_limit) {
+		if (std::isnan(l.second)) {
+			Warning("nativeABCD", "CLs is still above 0.05 at the top of the mu range (%g): the %s limit is unbounded, and is given as NaN", mu_max, l.first);
+		}
+	}
+
+	HypoTestInvTool::LimitResults r;
+	r.median = limits.median;
+	r.sigma_plus_1 = limits.plus_1;
+	r.sigma_minus_1 = limits.minus_1;
+	r.sigma_plus_2 = limits.plus_2;
+	r.sigma_minus_2 = limits.minus_2;
+	r.upper_limit = limits.observed;
+	return r;
+}